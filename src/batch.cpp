@@ -0,0 +1,277 @@
+#include "chip8.h"
+#include "chip8_jit.h"
+#include "frame_dump.h"
+#include "input_log.h"
+#include "rom_cache.h"
+#include "scheduler.h"
+#include "work_stealing.h"
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+/*
+Headless batch runner: runs every ROM given on the command line, or found in
+a directory given there, in its own chip8 instance, spread over all cores,
+and writes one result line per ROM. ROMs are mapped and cached by content up
+front, so each instance starts with a copy of a ready boot image.
+No SDL is linked into this binary.
+*/
+
+struct job_result
+{
+    const char* exit;
+    uint64_t cycles;
+    uint64_t frames;
+    uint64_t hash;
+    double seconds;
+};
+
+struct batch_options
+{
+    uint64_t cycles = 0;
+    uint64_t frames = 0;
+    unsigned ipf = frame_scheduler::DEFAULT_IPF;
+    unsigned threads = 0;
+    bool jit = false;
+    uint64_t seed = 0;
+    const char* replay = NULL;
+    const char* out = NULL;
+    const char* profile = NULL;
+    const char* dump = NULL;
+};
+
+// Frames between periodic profile exports
+static const unsigned PROFILE_INTERVAL = 600;
+
+typedef std::pair<std::string, const rom_image*> rom_entry;
+
+static job_result runRom(const rom_entry& rom, quirk_profile quirks, const batch_options& opts)
+{
+    job_result result = { "load-error", 0, 0, 0, 0.0 };
+    const rom_image* image = rom.second;
+    if (!image) {
+        return result;
+    }
+
+    // A replay brings its own seed, frame size and length, and must match the ROM
+    input_player player;
+    uint64_t seed = opts.seed;
+    unsigned ipf = opts.ipf;
+    if (opts.replay) {
+        result.exit = "replay-error";
+        if (!player.load(opts.replay)) {
+            return result;
+        }
+        if (image->hash != player.header().romHash) {
+            std::cout << opts.replay << " was recorded with a different ROM than " << rom.first << "\n";
+            return result;
+        }
+        seed = player.header().seed;
+        ipf = player.header().ipf;
+        quirks = (quirk_profile)player.header().quirks;
+    }
+
+    chip8* machine = new chip8();
+    machine->seedRandom(seed);
+    machine->setQuirks(quirks);
+    machine->restart(*image);
+#ifdef CHIP8_PROFILE
+    // One profile per ROM, named after it, rewritten as the run goes and at the end
+    std::string profileFile;
+    if (opts.profile) {
+        size_t slash = rom.first.find_last_of('/');
+        profileFile = std::string(opts.profile) + "/" + rom.first.substr(slash == std::string::npos ? 0 : slash + 1) + ".json";
+        machine->profile.setOutput(profileFile.c_str(), PROFILE_INTERVAL);
+    }
+#endif
+
+    // A frame budget is turned into a cycle budget of ipf instructions per frame
+    uint64_t budget = opts.frames ? opts.frames * ipf : opts.cycles;
+    if (opts.replay) {
+        budget = player.endCycle();
+    }
+
+    chip8_jit* jit = opts.jit ? new chip8_jit(*machine) : NULL;
+
+    // Frames go to <dir>/<rom>.c8fd, named like the profiles, all of them so dumps are reproducible
+    frame_dump dump;
+    if (opts.dump) {
+        size_t slash = rom.first.find_last_of('/');
+        std::string dumpFile = std::string(opts.dump) + "/" + rom.first.substr(slash == std::string::npos ? 0 : slash + 1) + ".c8fd";
+        dump.open(dumpFile.c_str(), 60, true);
+    }
+
+    // Unthrottled frames: ipf instructions, then one timer tick
+    const char* stop = NULL;
+    uint64_t done = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (; done < budget; done += ipf) {
+        uint64_t cycles = budget - done < ipf ? budget - done : ipf;
+        player.apply(done, machine->key);
+        // Fx0A waits out the rest of the frame, anything else that stops the core ends the run
+        uint64_t ran = 0;
+        chip8::run_exit why = jit ? jit->run(cycles, &ran) : machine->run(cycles, &ran);
+        if (why != chip8::RUN_BUDGET && why != chip8::RUN_KEY_WAIT) {
+            stop = chip8::exitName(why);
+            done += ran;
+            break;
+        }
+        if (cycles == ipf) {
+            machine->tickTimers();
+            dump.capture(*machine, done / ipf);
+        }
+    }
+    if (stop) {
+        dump.capture(*machine, done / ipf);
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    delete jit;
+    if (!dump.close()) {
+        std::cout << "Couldn't write the frame dump for " << rom.first << "\n";
+    }
+#ifdef CHIP8_PROFILE
+    if (opts.profile) {
+        machine->writeProfile(profileFile.c_str());
+    }
+#endif
+
+    result.exit = stop ? stop : opts.replay ? "replay" : opts.frames ? "frames" : "cycles";
+    result.cycles = stop ? done : budget;
+    result.frames = result.cycles / ipf;
+    uint64_t frame[chip8::FRAME_WORDS];
+    size_t words = machine->copyFrame(frame);
+    // FNV-1a over the framebuffer, so identical final screens hash identically
+    result.hash = hashFrameWords(frame, words);
+    result.seconds = std::chrono::duration<double>(end - start).count();
+
+    delete machine;
+    return result;
+}
+
+static void usage()
+{
+    std::cout << "Usage ./chip8-batch [--cycles N | --frames N] [--ipf N] [--threads N] [--backend interp|jit] [--seed N] [--replay log] [--out file] [--profile dir] [--dump dir] [--quirks vip|schip|xochip] ROM|DIR..." << std::endl;
+    std::cout << "--quirks applies to the ROMs after it on the command line, vip before the first one" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    batch_options opts;
+    std::vector<const char*> args;
+    std::vector<quirk_profile> argQuirks;
+    quirk_profile quirks = QUIRKS_VIP;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--cycles") == 0 && hasValue) {
+            opts.cycles = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--frames") == 0 && hasValue) {
+            opts.frames = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--ipf") == 0 && hasValue) {
+            opts.ipf = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--threads") == 0 && hasValue) {
+            opts.threads = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--backend") == 0 && hasValue) {
+            const char* backend = argv[++i];
+            if (strcmp(backend, "jit") == 0) {
+                opts.jit = true;
+            } else if (strcmp(backend, "interp") != 0) {
+                usage();
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--seed") == 0 && hasValue) {
+            opts.seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--replay") == 0 && hasValue) {
+            opts.replay = argv[++i];
+        } else if (strcmp(argv[i], "--out") == 0 && hasValue) {
+            opts.out = argv[++i];
+        } else if (strcmp(argv[i], "--quirks") == 0 && hasValue) {
+            if (!parseQuirks(argv[++i], quirks)) {
+                usage();
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--profile") == 0 && hasValue) {
+            opts.profile = argv[++i];
+        } else if (strcmp(argv[i], "--dump") == 0 && hasValue) {
+            opts.dump = argv[++i];
+        } else if (argv[i][0] == '-') {
+            usage();
+            return 1;
+        } else {
+            args.push_back(argv[i]);
+            argQuirks.push_back(quirks);
+        }
+    }
+
+    if (args.empty() || opts.ipf == 0) {
+        usage();
+        return 1;
+    }
+    if (opts.cycles == 0 && opts.frames == 0) {
+        opts.frames = 600;
+    }
+#ifndef CHIP8_PROFILE
+    if (opts.profile) {
+        std::cout << "--profile needs a build with PROFILE=1. Exiting..." << "\n";
+        return 1;
+    }
+#endif
+    if (opts.jit && !chip8_jit::supported()) {
+        std::cout << "JIT backend isn't available on this host, using the interpreter" << std::endl;
+        opts.jit = false;
+    }
+
+    // Directories expand to the ROMs in them, a ROM that fails to load is reported as load-error
+    rom_cache cache;
+    std::vector<rom_entry> roms;
+    std::vector<quirk_profile> romQuirks;
+    for (size_t i = 0; i < args.size(); i++) {
+        struct stat info;
+        if (stat(args[i], &info) == 0 && S_ISDIR(info.st_mode)) {
+            if (!cache.loadDirectory(args[i], roms)) {
+                return 1;
+            }
+        } else {
+            roms.push_back(rom_entry(args[i], cache.load(args[i])));
+        }
+        romQuirks.resize(roms.size(), argQuirks[i]);
+    }
+
+    std::vector<job_result> results(roms.size());
+    work_stealing_pool pool(opts.threads);
+    pool.run(roms.size(), [&](size_t job, unsigned) {
+        results[job] = runRom(roms[job], romQuirks[job], opts);
+    });
+
+    std::ofstream file;
+    if (opts.out) {
+        file.open(opts.out);
+        if (!file) {
+            std::cout << "Couldn't open " << opts.out << " for writing. Exiting..." << "\n";
+            return 1;
+        }
+    }
+    std::ostream& out = opts.out ? file : std::cout;
+
+    int failed = 0;
+    out << "rom,exit,cycles,frames,hash,cycles_per_sec\n";
+    for (size_t i = 0; i < roms.size(); i++) {
+        const job_result& r = results[i];
+        char line[64];
+        snprintf(line, sizeof(line), "%016llx,%.0f", (unsigned long long)r.hash,
+                 r.seconds > 0 ? r.cycles / r.seconds : 0.0);
+        out << roms[i].first << "," << r.exit << "," << r.cycles << "," << r.frames << "," << line << "\n";
+        if (strcmp(r.exit, "load-error") == 0 || strcmp(r.exit, "replay-error") == 0) {
+            failed++;
+        }
+    }
+
+    return failed ? 2 : 0;
+}
@@ -0,0 +1,46 @@
+#include "beeper.h"
+#include <string.h>
+
+// A 440 Hz tone, the phase accumulator wraps once per period
+static const uint32_t TONE_STEP = (uint32_t)(440.0 * 4294967296.0 / beeper::SAMPLE_RATE);
+
+// Peak amplitude, and how far the volume moves per sample when starting or stopping (2 ms)
+static const int VOLUME = 4000;
+static const int RAMP_STEP = VOLUME / (beeper::SAMPLE_RATE / 500);
+
+// Largest change in frame length, about 6%, too small to hear as a pitch shift
+static const int MAX_STRETCH = beeper::SAMPLES_PER_FRAME / 16;
+
+beeper::beeper() : phase(0), volume(0)
+{
+}
+
+void beeper::frame(bool on)
+{
+    int queued = (int)ring.size();
+    int stretch = (TARGET_QUEUED - queued) / 8;
+    if (stretch > MAX_STRETCH) stretch = MAX_STRETCH;
+    if (stretch < -MAX_STRETCH) stretch = -MAX_STRETCH;
+    int count = SAMPLES_PER_FRAME + stretch;
+
+    int16_t samples[SAMPLES_PER_FRAME + MAX_STRETCH];
+    int target = on ? VOLUME : 0;
+    for (int i = 0; i < count; i++) {
+        if (volume < target) {
+            volume = volume + RAMP_STEP < target ? volume + RAMP_STEP : target;
+        } else if (volume > target) {
+            volume = volume - RAMP_STEP > target ? volume - RAMP_STEP : target;
+        }
+        samples[i] = (int16_t)(phase < 0x80000000u ? volume : -volume);
+        phase += TONE_STEP;
+    }
+
+    // A full ring means the audio device stopped pulling, the overflow is dropped
+    ring.write(samples, count);
+}
+
+void beeper::fill(int16_t* out, int count)
+{
+    size_t got = ring.read(out, count);
+    memset(out + got, 0, (count - got) * sizeof(int16_t));
+}
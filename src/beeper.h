@@ -0,0 +1,47 @@
+#ifndef BEEPER
+#define BEEPER
+#include <stdint.h>
+#include "spsc_ring.h"
+
+/*
+The CHIP-8 buzzer as a square wave. The emulation thread calls frame() once
+per 60 Hz frame with whether the sound timer is running and the samples for
+that frame go into a lock-free ring; the audio callback drains the ring with
+fill(). The oscillator's phase and volume carry over from frame to frame, and
+the volume ramps over a couple of milliseconds when the tone starts or stops,
+so frame boundaries never click.
+
+Latency is whatever is queued plus the device buffer. The emulation and
+audio clocks drift, so each frame is made a few samples longer or shorter
+to keep about TARGET_QUEUED samples waiting: around 10 ms, plus 5 ms of
+DEVICE_SAMPLES.
+*/
+class beeper
+{
+
+    public:
+        static const int SAMPLE_RATE = 48000;
+        static const int SAMPLES_PER_FRAME = SAMPLE_RATE / 60;
+
+        // Size of the audio device's buffer, the callback asks for this many at a time
+        static const int DEVICE_SAMPLES = 256;
+
+        beeper();
+
+        // Emulation thread: queue one frame of tone or silence
+        void frame(bool on);
+
+        // Audio callback: count mono samples, silence for any the ring can't supply
+        void fill(int16_t* out, int count);
+
+    private:
+        static const int TARGET_QUEUED = 480;
+
+        spsc_ring<int16_t, 4096> ring;
+
+        // Producer state, only touched by frame()
+        uint32_t phase;
+        int volume;
+
+};
+#endif
@@ -0,0 +1,486 @@
+#include "chip8.h"
+#include "chip8_batch.h"
+#include "chip8_jit.h"
+#include "chip8_pool.h"
+#include "rom_cache.h"
+#include "scheduler.h"
+#include <chrono>
+#include <iostream>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+/*
+Headless throughput benchmarks. Synthetic ROMs exercise one opcode class each,
+then every ROM in a directory runs for a fixed number of cycles. Each case runs
+on every available backend, the best of several repetitions is kept, and the
+results are printed as JSON so runs can be compared across releases.
+The lock-step engine runs LOCKSTEP_LANES seeds of each case with differing key
+presses, after checking every lane against its own chip8 instruction for
+instruction.
+The pool runs POOL_INSTANCES instances of each case a frame at a time
+through one chip8, after the same check against plain machines, and reports
+the memory an instance takes alongside the time.
+*/
+
+static const size_t LOCKSTEP_LANES = 32;
+typedef chip8_batch<LOCKSTEP_LANES> lockstep_batch;
+
+static const size_t POOL_INSTANCES = 1024;
+
+struct bench_case
+{
+    std::string name;
+    std::string kind;
+    std::vector<uint8_t> rom;
+};
+
+struct bench_options
+{
+    uint64_t cycles = 5000000;
+    unsigned ipf = frame_scheduler::DEFAULT_IPF;
+    unsigned repeat = 3;
+    const char* romDir = "rom";
+};
+
+static void emit(std::vector<uint8_t>& rom, uint16_t opcode)
+{
+    rom.push_back(opcode >> 8);
+    rom.push_back(opcode & 0xFF);
+}
+
+// 8xyN arithmetic and logic in a tight loop
+static std::vector<uint8_t> aluRom()
+{
+    std::vector<uint8_t> rom;
+    emit(rom, 0x6001);
+    emit(rom, 0x6103);
+    for (int i = 0; i < 4; i++) {
+        emit(rom, 0x8014); emit(rom, 0x8125); emit(rom, 0x8201); emit(rom, 0x8312);
+        emit(rom, 0x8433); emit(rom, 0x8506); emit(rom, 0x8617); emit(rom, 0x870E);
+    }
+    emit(rom, 0x1204);
+    return rom;
+}
+
+// DXYN sprites walking across the screen
+static std::vector<uint8_t> drawRom()
+{
+    std::vector<uint8_t> rom;
+    emit(rom, 0xA050);
+    emit(rom, 0xD015);
+    emit(rom, 0xD125);
+    emit(rom, 0xD23F);
+    emit(rom, 0x7003);
+    emit(rom, 0x7105);
+    emit(rom, 0x1202);
+    return rom;
+}
+
+// Fx55/Fx65 register block stores and loads
+static std::vector<uint8_t> loadStoreRom()
+{
+    std::vector<uint8_t> rom;
+    emit(rom, 0xAE00);
+    emit(rom, 0xFF55);
+    emit(rom, 0xAE00);
+    emit(rom, 0xFF65);
+    emit(rom, 0xAE80);
+    emit(rom, 0xF755);
+    emit(rom, 0xAE80);
+    emit(rom, 0xF765);
+    emit(rom, 0x1200);
+    return rom;
+}
+
+// Skips, calls, returns and jumps
+static std::vector<uint8_t> branchRom()
+{
+    std::vector<uint8_t> rom;
+    emit(rom, 0x7001);  // 200: V0 += 1
+    emit(rom, 0x3000);  // 202: skip if V0 == 0
+    emit(rom, 0x220C);  // 204: call 20C
+    emit(rom, 0x4100);  // 206: skip if V1 != 0
+    emit(rom, 0x1200);  // 208: jump 200
+    emit(rom, 0x1200);  // 20A: jump 200
+    emit(rom, 0x5010);  // 20C: skip if V0 == V1
+    emit(rom, 0x00EE);  // 20E: return
+    emit(rom, 0x00EE);  // 210: return
+    return rom;
+}
+
+static void romCases(const char* dir, std::vector<bench_case>& cases)
+{
+    rom_cache cache;
+    std::vector<std::pair<std::string, const rom_image*> > roms;
+    if (!cache.loadDirectory(dir, roms)) {
+        return;
+    }
+
+    for (size_t i = 0; i < roms.size(); i++) {
+        const rom_image* image = roms[i].second;
+        if (!image) {
+            continue;
+        }
+        bench_case c;
+        c.name = roms[i].first.substr(strlen(dir) + 1);
+        c.kind = "rom";
+        c.rom.assign(image->memory + 0x200, image->memory + 0x200 + image->size);
+        cases.push_back(c);
+    }
+}
+
+// Seconds to run a budget of cycles instructions from a fresh load, in unthrottled frames. Of the
+// budget, executed counts the instructions that ran and skipped the idle-loop iterations run() skipped;
+// what's left is frames cut short by Fx0A
+static double timeRun(const bench_case& c, bool useJit, const bench_options& opts, uint64_t& executed, uint64_t& skipped)
+{
+    chip8* machine = new chip8();
+    machine->loadBuffer(c.rom.data(), c.rom.size());
+    chip8_jit* jit = useJit ? new chip8_jit(*machine) : NULL;
+
+    executed = 0;
+    skipped = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (uint64_t done = 0; done < opts.cycles; done += opts.ipf) {
+        uint64_t cycles = opts.cycles - done < opts.ipf ? opts.cycles - done : opts.ipf;
+        uint64_t ran = 0;
+        uint64_t idle = 0;
+        if (jit) {
+            jit->run(cycles, &ran, &idle);
+        } else {
+            machine->run(cycles, &ran, &idle);
+        }
+        executed += ran - idle;
+        skipped += idle;
+        machine->tickTimers();
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    delete jit;
+    delete machine;
+    return std::chrono::duration<double>(end - start).count();
+}
+
+// Per-lane key presses that change every few frames, so lanes diverge the way rollouts do
+static void pressKeys(uint8_t* key, size_t lane, uint64_t frame)
+{
+    uint32_t h = (uint32_t)(lane * 2654435761u) ^ (uint32_t)(frame / 8 * 40503u);
+    h ^= h >> 13;
+    h *= 0x5bd1e995;
+    h ^= h >> 15;
+    memset(key, 0, 16);
+    if (h & 1) {
+        key[(h >> 4) & 0xF] = 1;
+    }
+}
+
+// Runs the jit and the interpreter side by side a frame at a time, false at the first frame where
+// they stop for different reasons, after different counts or in different states
+static bool validateJit(const bench_case& c, const bench_options& opts, uint64_t frames)
+{
+    chip8* interp = new chip8();
+    chip8* translated = new chip8();
+    interp->loadBuffer(c.rom.data(), c.rom.size());
+    translated->loadBuffer(c.rom.data(), c.rom.size());
+    chip8_jit* jit = new chip8_jit(*translated);
+
+    bool same = true;
+    uint8_t expected[chip8::STATE_SIZE];
+    uint8_t actual[chip8::STATE_SIZE];
+    for (uint64_t f = 0; f < frames && same; f++) {
+        pressKeys(interp->key, 0, f);
+        pressKeys(translated->key, 0, f);
+        uint64_t expectedCycles = 0;
+        uint64_t actualCycles = 0;
+        chip8::run_exit expectedExit = interp->run(opts.ipf, &expectedCycles);
+        chip8::run_exit actualExit = jit->run(opts.ipf, &actualCycles);
+        interp->tickTimers();
+        translated->tickTimers();
+        interp->saveState(expected);
+        translated->saveState(actual);
+        if (actualExit != expectedExit || actualCycles != expectedCycles) {
+            std::cerr << c.name << ": jit stopped with " << chip8::exitName(actualExit) << " after " << actualCycles
+                      << " instead of " << chip8::exitName(expectedExit) << " after " << expectedCycles << " in frame " << f << std::endl;
+            same = false;
+        } else if (memcmp(expected, actual, sizeof(actual)) != 0) {
+            std::cerr << c.name << ": jit differs from the interpreter after frame " << f << std::endl;
+            same = false;
+        }
+    }
+
+    delete jit;
+    delete translated;
+    delete interp;
+    return same;
+}
+
+// Steps a batch and one chip8 per lane side by side, false at the first differing state
+static bool validateLockstep(const bench_case& c, const bench_options& opts, uint64_t frames)
+{
+    lockstep_batch* batch = new lockstep_batch();
+    chip8* single = new chip8[LOCKSTEP_LANES];
+    batch->load(c.rom.data(), c.rom.size());
+    for (size_t l = 0; l < LOCKSTEP_LANES; l++) {
+        single[l].loadBuffer(c.rom.data(), c.rom.size());
+        single[l].seedRandom(l);
+        batch->seed(l, l);
+    }
+
+    bool same = true;
+    uint8_t expected[chip8::STATE_SIZE];
+    uint8_t actual[chip8::STATE_SIZE];
+    for (uint64_t f = 0; f < frames && same; f++) {
+        for (size_t l = 0; l < LOCKSTEP_LANES; l++) {
+            pressKeys(batch->keys(l), l, f);
+            pressKeys(single[l].key, l, f);
+        }
+        batch->run(opts.ipf);
+        for (size_t l = 0; l < LOCKSTEP_LANES; l++) {
+            for (unsigned i = 0; i < opts.ipf; i++) {
+                single[l].runCycle();
+            }
+        }
+        batch->tickTimers();
+        for (size_t l = 0; l < LOCKSTEP_LANES && same; l++) {
+            single[l].tickTimers();
+            single[l].saveState(expected);
+            batch->lane(l).saveState(actual);
+            if (memcmp(expected, actual, sizeof(actual)) != 0) {
+                std::cerr << c.name << ": lane " << l << " differs from chip8 after frame " << f << std::endl;
+                same = false;
+            }
+        }
+    }
+
+    delete[] single;
+    delete batch;
+    return same;
+}
+
+// Seconds to run cycles lane-instructions in total, share of them run grouped in vectorShare
+static double timeLockstep(const bench_case& c, const bench_options& opts, double& vectorShare)
+{
+    lockstep_batch* batch = new lockstep_batch();
+    batch->load(c.rom.data(), c.rom.size());
+    for (size_t l = 0; l < LOCKSTEP_LANES; l++) {
+        batch->seed(l, l);
+    }
+
+    uint64_t steps = opts.cycles / LOCKSTEP_LANES;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t frame = 0;
+    for (uint64_t done = 0; done < steps; done += opts.ipf, frame++) {
+        for (size_t l = 0; l < LOCKSTEP_LANES; l++) {
+            pressKeys(batch->keys(l), l, frame);
+        }
+        uint64_t cycles = steps - done < opts.ipf ? steps - done : opts.ipf;
+        batch->run((unsigned)cycles);
+        batch->tickTimers();
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    uint64_t total = batch->vectorSteps() + batch->scalarSteps();
+    vectorShare = total ? batch->vectorSteps() / (double)total : 0;
+    delete batch;
+    return std::chrono::duration<double>(end - start).count();
+}
+
+// Runs pooled instances and one chip8 each side by side, a frame at a time, false at the first differing state
+static bool validatePool(const bench_case& c, const bench_options& opts, uint64_t frames)
+{
+    rom_cache cache;
+    const rom_image* image = cache.insert(c.rom.data(), c.rom.size());
+    if (!image) {
+        return false;
+    }
+    chip8_pool pool(LOCKSTEP_LANES);
+    chip8* machine = new chip8();
+    chip8* single = new chip8[LOCKSTEP_LANES];
+    for (size_t l = 0; l < LOCKSTEP_LANES; l++) {
+        pool.add(*image, QUIRKS_VIP, l);
+        single[l].loadBuffer(c.rom.data(), c.rom.size());
+        single[l].seedRandom(l);
+    }
+
+    bool same = true;
+    uint8_t expected[chip8::STATE_SIZE];
+    uint8_t actual[chip8::STATE_SIZE];
+    for (uint64_t f = 0; f < frames && same; f++) {
+        for (size_t l = 0; l < LOCKSTEP_LANES && same; l++) {
+            pressKeys(pool.keys(l), l, f);
+            pressKeys(single[l].key, l, f);
+            pool.runFrame(l, *machine, opts.ipf);
+            single[l].runUntilFrame(opts.ipf);
+        }
+        // Only once every instance ran, so each is loaded after another one used the machine
+        for (size_t l = 0; l < LOCKSTEP_LANES && same; l++) {
+            pool.load(l, *machine);
+            machine->saveState(actual);
+            single[l].saveState(expected);
+            if (memcmp(expected, actual, sizeof(actual)) != 0) {
+                std::cerr << c.name << ": pooled instance " << l << " differs from chip8 after frame " << f << std::endl;
+                same = false;
+            }
+        }
+    }
+
+    delete[] single;
+    delete machine;
+    return same;
+}
+
+// Seconds to run cycles instructions a frame at a time on each instance in turn, counted as timeRun()
+// does, memory per instance in bytes
+static double timePool(const bench_case& c, const bench_options& opts, double& bytes, uint64_t& executed, uint64_t& skipped)
+{
+    rom_cache cache;
+    const rom_image* image = cache.insert(c.rom.data(), c.rom.size());
+    chip8_pool* pool = new chip8_pool(POOL_INSTANCES);
+    chip8* machine = new chip8();
+    for (size_t i = 0; i < POOL_INSTANCES; i++) {
+        pool->add(*image, QUIRKS_VIP, i);
+    }
+
+    executed = 0;
+    skipped = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t frame = 0;
+    for (uint64_t done = 0; done < opts.cycles; done += opts.ipf, frame++) {
+        size_t id = frame % POOL_INSTANCES;
+        pressKeys(pool->keys(id), id, frame / POOL_INSTANCES);
+        pool->load(id, *machine);
+        uint64_t cycles = opts.cycles - done < opts.ipf ? opts.cycles - done : opts.ipf;
+        uint64_t ran = 0;
+        uint64_t idle = 0;
+        machine->run(cycles, &ran, &idle);
+        executed += ran - idle;
+        skipped += idle;
+        machine->tickTimers();
+        pool->store(id, *machine);
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    bytes = chip8_pool::instanceBytes() + pool->privatePages() * 64.0 / POOL_INSTANCES;
+    delete machine;
+    delete pool;
+    return std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char** argv)
+{
+    bench_options opts;
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--cycles") == 0 && hasValue) {
+            opts.cycles = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--ipf") == 0 && hasValue) {
+            opts.ipf = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--repeat") == 0 && hasValue) {
+            opts.repeat = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--roms") == 0 && hasValue) {
+            opts.romDir = argv[++i];
+        } else {
+            std::cout << "Usage ./chip8-bench [--cycles N] [--ipf N] [--repeat N] [--roms dir]" << std::endl;
+            return 1;
+        }
+    }
+    if (opts.cycles == 0 || opts.ipf == 0 || opts.repeat == 0) {
+        std::cout << "--cycles, --ipf and --repeat must be non-zero" << std::endl;
+        return 1;
+    }
+
+    std::vector<bench_case> cases;
+    bench_case micro[] = {
+        { "alu_8xyN", "micro", aluRom() },
+        { "draw_DXYN", "micro", drawRom() },
+        { "load_store_Fx55_Fx65", "micro", loadStoreRom() },
+        { "branches", "micro", branchRom() },
+    };
+    cases.assign(micro, micro + sizeof(micro) / sizeof(micro[0]));
+    romCases(opts.romDir, cases);
+
+    std::vector<const char*> backends;
+    backends.push_back("interp");
+    if (chip8_jit::supported()) {
+        backends.push_back("jit");
+    }
+
+    printf("{\n  \"cycles\": %llu,\n  \"ipf\": %u,\n  \"repeat\": %u,\n  \"results\": [\n",
+           (unsigned long long)opts.cycles, opts.ipf, opts.repeat);
+    bool first = true;
+    int failed = 0;
+    for (size_t i = 0; i < cases.size(); i++) {
+        // The jit only counts as a result once it stops where the interpreter does, frame by frame
+        if (backends.size() > 1 && !validateJit(cases[i], opts, 600)) {
+            failed++;
+            continue;
+        }
+        for (size_t b = 0; b < backends.size(); b++) {
+            bool useJit = strcmp(backends[b], "jit") == 0;
+            double best = 0;
+            uint64_t executed = 0;
+            uint64_t skipped = 0;
+            for (unsigned r = 0; r < opts.repeat; r++) {
+                double seconds = timeRun(cases[i], useJit, opts, executed, skipped);
+                if (r == 0 || seconds < best) {
+                    best = seconds;
+                }
+            }
+
+            // Throughput of the instructions that ran, skipped idle iterations cost next to nothing
+            double ips = best > 0 ? executed / best : 0;
+            double fps = best > 0 ? (opts.cycles / (double)opts.ipf) / best : 0;
+            printf("%s    {\"name\": \"%s\", \"kind\": \"%s\", \"backend\": \"%s\", \"seconds\": %.6f, "
+                   "\"instructions_per_sec\": %.0f, \"ns_per_instruction\": %.3f, \"frames_per_sec\": %.0f, "
+                   "\"executed\": %llu, \"skipped\": %llu}",
+                   first ? "" : ",\n", cases[i].name.c_str(), cases[i].kind.c_str(), backends[b], best,
+                   ips, executed ? best * 1e9 / executed : 0, fps, (unsigned long long)executed, (unsigned long long)skipped);
+            first = false;
+        }
+
+        // Lock-step lanes only count as a result once they match chip8 lane by lane
+        if (!validateLockstep(cases[i], opts, 600)) {
+            failed++;
+            continue;
+        }
+        double best = 0;
+        double vectorShare = 0;
+        for (unsigned r = 0; r < opts.repeat; r++) {
+            double seconds = timeLockstep(cases[i], opts, vectorShare);
+            if (r == 0 || seconds < best) {
+                best = seconds;
+            }
+        }
+        uint64_t laneCycles = opts.cycles / LOCKSTEP_LANES * LOCKSTEP_LANES;
+        printf(",\n    {\"name\": \"%s\", \"kind\": \"%s\", \"backend\": \"lockstep%u\", \"seconds\": %.6f, "
+               "\"instructions_per_sec\": %.0f, \"ns_per_instruction\": %.3f, \"vector_share\": %.3f}",
+               cases[i].name.c_str(), cases[i].kind.c_str(), (unsigned)LOCKSTEP_LANES, best,
+               best > 0 ? laneCycles / best : 0, best * 1e9 / laneCycles, vectorShare);
+
+        if (!validatePool(cases[i], opts, 600)) {
+            failed++;
+            continue;
+        }
+        double bytes = 0;
+        uint64_t executed = 0;
+        uint64_t skipped = 0;
+        for (unsigned r = 0; r < opts.repeat; r++) {
+            double seconds = timePool(cases[i], opts, bytes, executed, skipped);
+            if (r == 0 || seconds < best) {
+                best = seconds;
+            }
+        }
+        printf(",\n    {\"name\": \"%s\", \"kind\": \"%s\", \"backend\": \"pool%u\", \"seconds\": %.6f, "
+               "\"instructions_per_sec\": %.0f, \"ns_per_instruction\": %.3f, \"executed\": %llu, \"skipped\": %llu, "
+               "\"instance_bytes\": %.0f, \"chip8_bytes\": %u}",
+               cases[i].name.c_str(), cases[i].kind.c_str(), (unsigned)POOL_INSTANCES, best,
+               best > 0 ? executed / best : 0, executed ? best * 1e9 / executed : 0,
+               (unsigned long long)executed, (unsigned long long)skipped, bytes, (unsigned)sizeof(chip8));
+    }
+    printf("\n  ]\n}\n");
+    return failed ? 1 : 0;
+}
@@ -1,13 +1,16 @@
 #include "chip8.h" 
+#include "chip8_jit.h"
+#include "rom_cache.h"
 #include <cmath>
 #include <stdint.h>
+#include <string.h>
 #include <fstream>
 #include <iostream>
 #include <ios>
 #include <vector> 
 
 
-uint8_t chip8_fontset[80] = { 
+static const uint8_t chip8_fontset[80] = { 
     0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
     0x20, 0x60, 0x20, 0x20, 0x70, // 1
     0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
@@ -26,8 +29,179 @@ uint8_t chip8_fontset[80] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
+// SCHIP 8x10 digits for Fx30, loaded at 0x0A0 right after the small font
+static const uint8_t chip8_bigfontset[160] = { 
+    0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, // 0
+    0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, // 1
+    0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, // 2
+    0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, // 3
+    0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, // 5
+    0x3E, 0x7C, 0xE0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, // 6
+    0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, // 8
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, // 9
+    0x18, 0x3C, 0x66, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFE, 0xC3, 0xC3, 0xFE, 0xFE, 0xC3, 0xC3, 0xFE, 0xFC, // B
+    0x3C, 0x7E, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0x7E, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFE, 0xFE, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFE, 0xFE, 0xC0, 0xC0, 0xC0, 0xC0  // F
+};
+
 
 void chip8::initialize()
+{
+    // Clear memory and load font sprites beginning at address 0x050
+    bootImage(memory, NULL, 0); 
+    booted = false; 
+    forgetCode(); 
+    reset(); 
+}
+
+void chip8::restart(const rom_image& image)
+{
+    rebootImage(image); 
+    reset(); 
+}
+
+void chip8::rebootImage(const rom_image& image)
+{
+    // Cached images never change, so the same one again only needs the written pages put back
+    const uint8_t* data = image.memory + PROGRAM_START; 
+    reboot(data, image.size, booted && bootData == data && bootSize == image.size); 
+}
+
+bool chip8::romFits(size_t size)
+{
+    // Checked before bootImage(), which can only print
+    if (size <= sizeof(memory) - PROGRAM_START) {
+        return true; 
+    }
+    if (errorHandler) {
+        errorHandler(errorContext, ROM_TOO_LARGE, PC, 0); 
+    } else {
+        std::cout << "ROM is too large (" << size << " bytes). Exiting..." << "\n"; 
+    }
+    return false; 
+}
+
+bool chip8::reload(const uint8_t* data, size_t size)
+{
+    if (!romFits(size)) {
+        return false; 
+    }
+    reboot(data, size, false); 
+    reset(); 
+    // The caller may reuse the buffer for a different ROM
+    bootData = NULL; 
+    return true; 
+}
+
+// Font and zeros, what every page outside the ROM boots to
+static const uint8_t* blankImage()
+{
+    static uint8_t image[4096]; 
+    static bool built = chip8::bootImage(image, NULL, 0); 
+    (void)built; 
+    return image; 
+}
+
+// Pages holding [PROGRAM_START, PROGRAM_START + size)
+static uint64_t romPages(size_t size, int shift)
+{
+    if (size == 0) {
+        return 0; 
+    }
+    int first = 0x200 >> shift; 
+    int last = (0x200 + size - 1) >> shift; 
+    uint64_t upToLast = last == 63 ? ~0ULL : (1ULL << (last + 1)) - 1; 
+    return upToLast & ~((1ULL << first) - 1); 
+}
+
+void chip8::reboot(const uint8_t* data, size_t size, bool same)
+{
+    if (!booted) {
+        bootImage(memory, data, size); 
+        forgetCode(); 
+    } else {
+        uint64_t pages = dirtyPages; 
+        if (!same) {
+            pages |= romPages(bootSize, PAGE_SHIFT) | romPages(size, PAGE_SHIFT); 
+        }
+        const uint8_t* blank = blankImage(); 
+        const unsigned PAGE = 1 << PAGE_SHIFT; 
+        for (unsigned p = 0; pages; p++, pages >>= 1) {
+            if (!(pages & 1)) {
+                continue; 
+            }
+            unsigned start = p * PAGE; 
+            unsigned end = start + PAGE; 
+            memcpy(memory + start, blank + start, PAGE); 
+            unsigned romStart = start > PROGRAM_START ? start : PROGRAM_START; 
+            unsigned romEnd = end < PROGRAM_START + size ? end : PROGRAM_START + size; 
+            if (romStart < romEnd) {
+                memcpy(memory + romStart, data + romStart - PROGRAM_START, romEnd - romStart); 
+            }
+            forgetPage(p); 
+        }
+    }
+    booted = true; 
+    bootData = data; 
+    bootSize = size; 
+    dirtyPages = 0; 
+}
+
+void chip8::forgetPage(unsigned page)
+{
+    const unsigned PAGE = 1 << PAGE_SHIFT; 
+    unsigned start = page * PAGE; 
+    unsigned end = start + PAGE; 
+    // Decodes starting in the page, or in its last byte before it
+    unsigned first = start > PROGRAM_START ? start - 1 : PROGRAM_START; 
+    unsigned last = end < PROGRAM_END ? end : PROGRAM_END; 
+    for (unsigned addr = first; addr < last; addr++) {
+        decoded[addr - PROGRAM_START].handler = 0; 
+    }
+    for (unsigned addr = start; jit && addr < end; addr++) {
+        jit->invalidate(addr); 
+    }
+}
+
+void chip8::setErrorHandler(error_fn fn, void* context)
+{
+    errorHandler = fn; 
+    errorContext = context; 
+}
+
+void chip8::forgetCode()
+{
+    for (int i = 0; i < PROGRAM_END - PROGRAM_START; i++) {
+        decoded[i].handler = 0; 
+    }
+    if (jit) {
+        jit->flush(); 
+    }
+}
+
+bool chip8::bootImage(uint8_t* out, const uint8_t* data, size_t size)
+{
+    // game starts at mem[0x200] and has to fit below 0x1000
+    if (size > 4096 - 0x200) {
+        std::cout << "ROM is too large (" << size << " bytes). Exiting..." << "\n"; 
+        return false; 
+    }
+
+    memset(out, 0, 4096); 
+    memcpy(out + 0x050, chip8_fontset, sizeof(chip8_fontset)); 
+    memcpy(out + 0x0A0, chip8_bigfontset, sizeof(chip8_bigfontset)); 
+    if (size) {
+        memcpy(out + 0x200, data, size); 
+    }
+    return true; 
+}
+
+void chip8::reset()
 {
     // Clear opcode
     opcode = 0; 
@@ -46,369 +220,1193 @@ void chip8::initialize()
         stack[i] = 0; 
     }
 
-    // Clear Memory
-    for (int i = 0; i < 4096; i++) {
-        memory[i] = 0; 
-    }
-
-    // Load font sprites beginning at address 0x050
-    for (int i = 0x050; i < 80 + 0x050; i++) {
-        memory[i] = chip8_fontset[i]; 
+    // Clear display and key state, instances may be reused or heap allocated
+    memset(graphics, 0, sizeof(graphics)); 
+    highRes = false; 
+    dirtyRows = ~0ULL; 
+    for (int i = 0; i < 16; i++) {
+        key[i] = 0; 
     }
+    memset(rplFlags, 0, sizeof(rplFlags)); 
 
     drawFlag = false; 
     delay_timer = 0;
-    sound_timer = 0; 
+    sound_timer = 0;
+    frameCycles = 0; 
+    breakAt = -1; 
+    watchHit = -1; 
 
-    srand(time(NULL)); 
+    // Same seed, same sequence of Cxkk results
+    randomState = randomSeed; 
 }
 
-void chip8::runCycle()
+/*
+Handlers for every decoded instruction. Each one receives the operands that
+decode() extracted once for its address and returns false if the instruction
+did not retire (Fx0A waiting on a key, unknown opcodes, 00FD,
+breakpoints and watchpoints).
+*/
+struct chip8_ops
 {
+    enum {
+        DECODE = 0, CLS, RET, UNKNOWN_0, JP, CALL, SE_BYTE, SNE_BYTE, SE_REG, LD_BYTE, ADD_BYTE,
+        LD_REG, OR, AND, XOR, ADD_REG, SUB, SHR, SUBN, SHL, UNKNOWN_8, SNE_REG, LD_I, JP_V0,
+        RND, DRW, SKP, SKNP, UNKNOWN_E, LD_VX_DT, LD_VX_K, LD_DT, LD_ST, ADD_I, LD_F, LD_B,
+        LD_MEM_VX, LD_VX_MEM, UNKNOWN_F, SCD, SCU, SCR, SCL, EXIT, LOW, HIGH, LD_HF, LD_R, LD_VX_R,
+        BREAK, WATCH, COUNT
+    };
+
+    // Handlers patched in by the debugging support, standing in for the decoded instruction
+    static bool trap(uint8_t handler)
+    {
+        return handler == BREAK || handler == WATCH;
+    }
+
+    // Rows of the current mode, as a dirtyRows mask
+    static uint64_t allRows(const chip8& c)
+    {
+        return c.highRes ? ~0ULL : 0xFFFFFFFFULL; 
+    }
+
     /*
-    Beacuse we are fetching two bytes for each instruction, 
-    the firSt byte is shifted left 8-bits before performing bitwise or
-    */ 
-    opcode = memory[PC] << 8 | memory[PC + 1]; 
+    Addresses and key numbers come from the ROM. Hardened builds (make
+    HARDENED=1, for fuzzing) wrap them into range, normal builds trust the
+    ROM like the original interpreters did. Untrusted ROMs are full of
+    unknown opcodes, so hardened builds also don't print them.
+    */
+    static uint16_t address(unsigned addr)
+    {
+#ifdef CHIP8_HARDENED
+        return addr & 0xFFF; 
+#else
+        return addr; 
+#endif
+    }
 
-    // decode
-    uint16_t opIns0 = (opcode & 0xF000);  
-    uint16_t opIns1 = (opcode & 0x000F); 
-    uint8_t opIns2  = (opcode & 0x000F); 
+    static uint8_t keyIndex(uint8_t k)
+    {
+#ifdef CHIP8_HARDENED
+        return k & 0xF; 
+#else
+        return k; 
+#endif
+    }
 
-    uint8_t opInsByte  = (opcode & 0x00FF);  
-    uint8_t opInsX     = (opcode & 0x0F00) >> 8; 
-    uint8_t opInsY     = (opcode & 0x00F0) >> 4; 
-    uint16_t opInsLong = (opcode & 0x0FFF); 
+    // Unknown opcodes go to the error handler if there is one, otherwise they're printed with format
+    static void unknown(chip8& c, const chip8::instruction& in, const char* format)
+    {
+        if (c.errorHandler) {
+            c.errorHandler(c.errorContext, chip8::UNKNOWN_OPCODE, c.PC, in.opcode); 
+            return; 
+        }
+#ifndef CHIP8_HARDENED
+        printf(format, in.opcode); 
+#endif
+    }
 
-    // decode opcode
-    // execute opcode
-    switch (opIns0){
-        case 0x0000: 
-            switch (opIns1){
-                case(0x0000): 
-                    // 00E0 - CLS: clear the display 
-                    for (int i = 0; i < PIXEL_H * PIXEL_W; i++) {
-                        graphics[i] = 0; 
-                    }
-                    drawFlag = true; 
-                    PC += 2; 
-                    break; 
-                 
-                case(0x000E): 
-                    // 00EE - RET: set PC to top of stack, decrement stack pointer 
-                    sp--; 
-                    PC = stack[sp]; 
-                    PC += 2; 
-                break;
+    static bool cls(chip8& c, const chip8::instruction& in)
+    {
+        // 00E0 - CLS: clear the display 
+        for (int y = 0; y < c.height(); y++) {
+            if (c.graphics[y][0] | c.graphics[y][1]) {
+                c.dirtyRows |= 1ULL << y; 
+            }
+        }
+        memset(c.graphics, 0, sizeof(c.graphics)); 
+        c.drawFlag = true; 
+        c.PC += 2; 
+        return true;
+    }
 
-                default: 
-                    printf("Unknown opcode 0x%X\n", opcode); 
-                break;  
+    static bool ret(chip8& c, const chip8::instruction& in)
+    {
+        // 00EE - RET: set PC to top of stack, decrement stack pointer 
+#ifdef CHIP8_HARDENED
+        // Returning with an empty stack stops the machine on the RET
+        if (c.sp == 0) {
+            return false;
+        }
+#endif
+        c.sp--; 
+        c.PC = c.stack[c.sp]; 
+        c.PC += 2; 
+        return true;
+    }
 
+    static bool unknown0(chip8& c, const chip8::instruction& in)
+    {
+        unknown(c, in, "Unknown opcode 0x%X\n"); 
+        return false;
+    }
+
+    static bool jp(chip8& c, const chip8::instruction& in)
+    {
+        // 1nnn - JP addr: set PC to value nnn
+        c.PC = in.nnn; 
+        return true;
+    }
+
+    static bool call(chip8& c, const chip8::instruction& in)
+    {
+        // 2nnn - CALL addr: store PC in stack, set PC to nnn 
+#ifdef CHIP8_HARDENED
+        // Calling with a full stack stops the machine on the CALL
+        if (c.sp >= 16) {
+            return false;
+        }
+#endif
+        c.stack[c.sp] = c.PC;
+        c.sp ++;
+        c.PC = in.nnn; 
+        return true;
+    }
+
+    static bool seByte(chip8& c, const chip8::instruction& in)
+    {
+        // 3xnn - SE Vx, byte: skip next instruction if V[x] == byte 
+        c.PC += c.V[in.x] == in.kk ? 4 : 2; 
+        return true;
+    }
+
+    static bool sneByte(chip8& c, const chip8::instruction& in)
+    {
+        // 4xnn - SNE Vx, byte: skip next instruction if V[x] != byte 
+        c.PC += c.V[in.x] != in.kk ? 4 : 2; 
+        return true;
+    }
+
+    static bool seReg(chip8& c, const chip8::instruction& in)
+    {
+        // 5xy0 - SE Vx, Vy: skip next instruction if Vx = Vy
+        c.PC += c.V[in.x] == c.V[in.y] ? 4 : 2; 
+        return true;
+    }
+
+    static bool ldByte(chip8& c, const chip8::instruction& in)
+    {
+        // 6xnn - LD Vx: set register Vx to nn
+        c.V[in.x] = in.kk;    
+        c.PC += 2; 
+        return true;
+    }
+
+    static bool addByte(chip8& c, const chip8::instruction& in)
+    {
+        // 7xnn - ADD Vx, byte: adds nn to Vx then stores in Vx
+        c.V[in.x] = c.V[in.x] + in.kk; 
+        c.PC += 2; 
+        return true;
+    }
+
+    static bool ldReg(chip8& c, const chip8::instruction& in)
+    {
+        // 8yx0 - LD Vx, Vy: Stores value of V[Y] in V[X]
+        c.V[in.x] = c.V[in.y]; 
+        c.PC += 2; 
+        return true;
+    }
+
+    static bool orReg(chip8& c, const chip8::instruction& in)
+    {
+        // 8xy1 - OR Vx, Vy: stores result of Vx | Vy in Vx
+        c.V[in.x] = c.V[in.x] | c.V[in.y]; 
+        c.PC += 2; 
+        return true;
+    }
+
+    static bool andReg(chip8& c, const chip8::instruction& in)
+    {
+        // 8xy2 - AND Vx, Vy: stores result of Vx & Vy in Vx
+        c.V[in.x] = c.V[in.x] & c.V[in.y]; 
+        c.PC += 2; 
+        return true;
+    }
+
+    static bool xorReg(chip8& c, const chip8::instruction& in)
+    {
+        // 8xy3 - XOR Vx, Vy: stores result of Vx ^ Vy in Vx
+        c.V[in.x] = c.V[in.x] ^ c.V[in.y]; 
+        c.PC += 2; 
+        return true;
+    }
+
+    static bool addReg(chip8& c, const chip8::instruction& in)
+    {
+        // 8xy4 - ADD Vx, Vy: stores result of Vx + Vy in Vx
+        // if result if > 255, set VF == 1, else 0
+        c.V[15] = c.V[in.x] + c.V[in.y] > 255 ? 1 : 0;  
+        c.V[in.x] = c.V[in.x] + c.V[in.y];
+        c.PC += 2; 
+        return true;
+    }
+
+    static bool sub(chip8& c, const chip8::instruction& in)
+    {
+        // 8xy5 - SUB Vx, Vy: stores result of Vx - Vy in Vx
+        // if Vx > Vy, set VF = 1 else 0 
+        c.V[15] = c.V[in.x] > c.V[in.y] ? 1 : 0;
+        c.V[in.x] = c.V[in.x] - c.V[in.y]; 
+        c.PC += 2; 
+        return true;
+    }
+
+    template <class Q>
+    static bool shr(chip8& c, const chip8::instruction& in)
+    {
+        // 8xy6 - SHR Vx {, Vy}: stores result of Vy >> 1 (or Vx >> 1) in Vx
+        // VF is set = 1 if the shifted value % 2 != 0
+        uint8_t s = Q::SHIFT_VY ? in.y : in.x; 
+        c.V[15] = c.V[s] % 2 == 0 ? 0 : 1; 
+        c.V[in.x] = c.V[s] / 2; 
+        c.PC += 2; 
+        return true;
+    }
+
+    static bool subn(chip8& c, const chip8::instruction& in)
+    {
+        // 8xy7 - SUB Vx, Vy: stores result of Vy - Vx in Vx
+        // if Vy > Vx, set VF = 1 else 0 
+        c.V[15] = c.V[in.y] > c.V[in.x] ? 1 : 0;
+        c.V[in.x] = c.V[in.y] - c.V[in.x]; 
+        c.PC += 2; 
+        return true;
+    }
+
+    template <class Q>
+    static bool shl(chip8& c, const chip8::instruction& in)
+    {
+        // 8xyE - SHL Vx {, Vy}: If MSB of Vy (or Vx) is 1, VF = 1, else 0. Vx = that * 2
+        uint8_t s = Q::SHIFT_VY ? in.y : in.x; 
+        c.V[0xF] = c.V[s] >> 7;
+        c.V[in.x] = c.V[s] << 1;
+        c.PC += 2;
+        return true;
+    }
+
+    static bool unknown8(chip8& c, const chip8::instruction& in)
+    {
+        unknown(c, in, "Invalid opcode 8x%X\n"); 
+        return false;
+    }
+
+    static bool sneReg(chip8& c, const chip8::instruction& in)
+    {
+        // 9xy0 - SNE Vx, Vy: if Vx != Vy, PC += 2 
+        c.PC += c.V[in.x] != c.V[in.y] ? 4 : 2; 
+        return true;
+    }
+
+    static bool ldI(chip8& c, const chip8::instruction& in)
+    {
+        // Annn - LD I, addr: set index register to value nnn
+        c.I = in.nnn; 
+        c.PC += 2; 
+        return true;
+    }
+
+    template <class Q>
+    static bool jpV0(chip8& c, const chip8::instruction& in)
+    {
+        // Bnnn - JP V0, addr: PC set to nnn + V0 (BxNN: nnn + Vx)
+        c.PC = c.V[Q::JUMP_VX ? in.x : 0x0] + in.nnn; 
+        return true;
+    }
+
+    static bool rnd(chip8& c, const chip8::instruction& in)
+    {
+        // Cxkk - RND Vx, byte: generate rand number 0-255, & w/ kk, st in Vx 
+        c.V[in.x] = c.nextRandom() & (in.kk); 
+        c.PC += 2; 
+        return true;
+    }
+
+    template <class Q>
+    static bool drw(chip8& c, const chip8::instruction& in)
+    {
+        /*
+        Dxyn - DRW Vx, Vy, nibble
+        Display an n-byte sprite starting at the mem location at I, set VF = collision 
+        Read N bytes from memory starting at I. Bytes are displayed at Vx, Vy on screen
+        The start position wraps around the screen, the sprite itself is clipped at the
+        edges or, with WRAP_SPRITES, wraps around them too
+        Dxy0 draws a 16x16 sprite of two bytes per row where LARGE_SPRITES
+        */
+        uint16_t height = in.opcode & 0x000F;  
+        bool large = Q::LARGE_SPRITES && height == 0; 
+        if (large) {
+            height = 16; 
+        }
+        int w = c.width(); 
+        int h = c.height(); 
+        uint16_t xCord = c.V[in.x] % w; 
+        uint16_t yCord = c.V[in.y] % h; 
+        int rows = Q::WRAP_SPRITES || yCord + height <= h ? height : h - yCord; 
+
+        c.V[0xF] = 0; 
+
+        for (int y = 0; y < rows; y++) {
+            // The sprite row in the top bits of a word, then lined up with the display row:
+            // bits past the right edge fall off, or wrap to the left one
+            uint64_t sprite = large
+                ? (uint64_t)(c.memory[address(c.I + 2 * y)] << 8 | c.memory[address(c.I + 2 * y + 1)]) << 48
+                : (uint64_t)c.memory[address(c.I + y)] << 56; 
+            uint64_t left; 
+            uint64_t right = 0; 
+            if (!c.highRes) {
+                left = sprite >> xCord; 
+                if (Q::WRAP_SPRITES && xCord) {
+                    left |= sprite << (64 - xCord); 
+                }
+            } else if (xCord < 64) {
+                left = sprite >> xCord; 
+                right = xCord ? sprite << (64 - xCord) : 0; 
+            } else {
+                left = Q::WRAP_SPRITES && xCord > 64 ? sprite << (128 - xCord) : 0; 
+                right = sprite >> (xCord - 64); 
             }
-        break; 
 
-        case 0x1000: 
-            // 1nnn - JP addr: set PC to value nnn
-            PC = opInsLong; 
-        break;
+            int line = (yCord + y) % h; 
+            uint64_t* row = c.graphics[line];
+            if ((row[0] & left) | (row[1] & right)) {
+                c.V[0xF] = 1; 
+            }
+            row[0] ^= left; 
+            row[1] ^= right; 
+            if (left | right) {
+                c.dirtyRows |= 1ULL << line; 
+            }
+        }
+#ifdef CHIP8_PROFILE
+        c.profile.draw(rows); 
+#endif
+         
+        c.drawFlag = true; 
+        c.PC += 2; 
+        return true;
+    }
 
-        case 0x2000: 
-            // 2nnn - CALL addr: store PC in stack, set PC to nnn 
-            stack[sp] = PC;
-            sp ++;
-            PC = opInsLong; 
-        break;
+    static bool skp(chip8& c, const chip8::instruction& in)
+    {
+        // Ex9E - SKP Vx: skip instruction if key with val Vx is pressed
+        c.PC += c.key[keyIndex(c.V[in.x])] == 1 ? 4 : 2; 
+        return true;
+    }
 
-        case 0x3000: 
-            // 3xnn - SE Vx, byte: skip next instruction if V[x] == byte 
-            V[opInsX] == opInsByte ? PC += 4 : PC += 2; 
-        break;
-        
-        case 0x4000: 
-            // 4xnn - SNE Vx, byte: skip next instruction if V[x] != byte 
-            V[opInsX] != opInsByte ? PC += 4 : PC += 2; 
-        break;
+    static bool sknp(chip8& c, const chip8::instruction& in)
+    {
+        // ExA1 - SKPN Vx: skip instruction if key with val Vx ~ pressed
+        c.PC += c.key[keyIndex(c.V[in.x])] != 1 ? 4 : 2; 
+        return true;
+    }
 
-        case 0x5000:
-            // 5xy0 - SE Vx, Vy: skip next instruction if Vx = Vy
-            V[opInsX] == V[opInsY] ? PC += 4 : PC += 2; 
-        break;
+    static bool unknownE(chip8& c, const chip8::instruction& in)
+    {
+        unknown(c, in, "Unkown opcode: Ex%X\n"); 
+        return false;
+    }
+
+    static bool ldVxDt(chip8& c, const chip8::instruction& in)
+    {
+        // Fx07 - LD Vx, DT: value of DT is placed in Vx
+        c.V[in.x] = c.delay_timer;
+        c.PC += 2;
+        return true;
+    }
+
+    static bool ldVxK(chip8& c, const chip8::instruction& in)
+    {
+        // Fx0A - LD Vx, K: wait for key press. store value of key in Vx
+        bool keypress = false;
+        for(int i = 0; i< 16; ++i){
+            if (c.key[i] == 1) {
+                c.V[in.x] = i;
+                keypress = true;
+            }
+        }
+    
+        if(!keypress)
+            return false; 
+        c.PC += 2;
+        return true;
+    }
+
+    static bool ldDt(chip8& c, const chip8::instruction& in)
+    {
+        // Fx15 - LD DT, Vx
+        c.delay_timer = c.V[in.x];
+        c.PC += 2;
+        return true;
+    }
+
+    static bool ldSt(chip8& c, const chip8::instruction& in)
+    {
+        // Fx18 - LD ST, Vx
+        c.sound_timer = c.V[in.x];
+        c.PC += 2;
+        return true;
+    }
+
+    static bool addI(chip8& c, const chip8::instruction& in)
+    {
+        // Fx1E - ADD I, Vx: VF is set when I overflows 0xFFF
+        if( c.I + c.V[in.x] > 0xFFF){
+          c.V[0xF] = 1;
+        }
+        else {
+          c.V[0xF] = 0;
+        }
+        c.I = c.I + c.V[in.x];
+        c.PC += 2;
+        return true;
+    }
+
+    static bool ldF(chip8& c, const chip8::instruction& in)
+    {
+        // Fx29 - LD F, Vx: point I at the font sprite for digit Vx
+        c.I = 0x050 + c.V[in.x] *5;
+        c.PC += 2;
+        return true;
+    }
+
+    static bool ldB(chip8& c, const chip8::instruction& in)
+    {
+        // Fx33 - LD B, Vx: store BCD of Vx at I, I+1, I+2
+        c.memory[address(c.I)]  = c.V[in.x] / 100;
+        c.memory[address(c.I+1)] = (c.V[in.x] /10) % 10;
+        c.memory[address(c.I+2)] = (c.V[in.x] % 100) % 10;
+        c.invalidate(address(c.I));
+        c.invalidate(address(c.I + 1));
+        c.invalidate(address(c.I + 2));
+        c.PC += 2;
+        return true;
+    }
+
+    template <class Q>
+    static bool ldMemVx(chip8& c, const chip8::instruction& in)
+    {
+        // Fx55 - LD [I], Vx: store V0..Vx starting at I
+        unsigned char X = in.x;
+        for (unsigned char r = 0; r <= X; r++) {
+            c.memory[address(c.I+r)] = c.V[r];
+            c.invalidate(address(c.I + r));
+        }
         
-        case 0x6000:
-            // 6xnn - LD Vx: set register Vx to nn
-            V[opInsX] = opInsByte;    
-            PC += 2; 
-        break;
+        if (Q::LOAD_STORE_INCREMENTS_I) {
+            c.I = c.I + X + 1;
+        }
+        c.PC += 2;
+        return true;
+    }
+
+    template <class Q>
+    static bool ldVxMem(chip8& c, const chip8::instruction& in)
+    {
+        // Fx65 - LD Vx, [I]: load V0..Vx starting at I
+        unsigned char X = in.x;
+        for (unsigned char r = 0; r <= X; r++) {
+            c.V[r] = c.memory [address(c.I+r)];  
+        }
         
-        case 0x7000:
-            // 7xnn - ADD Vx, byte: adds nn to Vx then stores in Vx
-            V[opInsX] = V[opInsX] + opInsByte; 
-            PC += 2; 
-        break;
+        if (Q::LOAD_STORE_INCREMENTS_I) {
+            c.I = c.I + X + 1;
+        }
+        c.PC += 2;
+        return true;
+    }
 
-        case 0x8000: 
-            switch(opIns1){
-                case 0x0000:
-                    // 8yx0 - LD Vx, Vy: Stores value of V[Y] in V[X]
-                    V[opInsX] = V[opInsY]; 
-                    PC += 2; 
-                break; 
+    static bool unknownF(chip8& c, const chip8::instruction& in)
+    {
+        unknown(c, in, "Unkown opcode: Fx%X\n"); 
+        return false;
+    }
 
-                case 0x0001:
-                    // 8xy1 - OR Vx, Vy: stores result of Vx | Vy in Vx
-                    V[opInsX] = V[opInsX] | V[opInsY]; 
-                    PC += 2; 
-                break;
+    /*
+    SUPER-CHIP. Scrolls move whole display words, n counts pixels of the
+    current resolution, and pixels scrolled off the display are lost.
+    */
+    static bool scd(chip8& c, const chip8::instruction& in)
+    {
+        // 00Cn - SCD n: scroll the display down n rows
+        int n = in.opcode & 0x000F; 
+        memmove(c.graphics[n], c.graphics[0], (c.height() - n) * sizeof(c.graphics[0])); 
+        memset(c.graphics[0], 0, n * sizeof(c.graphics[0])); 
+        c.dirtyRows |= allRows(c); 
+        c.drawFlag = true; 
+        c.PC += 2; 
+        return true;
+    }
 
-                case 0x0002:
-                    // 8xy2 - AND Vx, Vy: stores result of Vx & Vy in Vx
-                    V[opInsX] = V[opInsX] & V[opInsY]; 
-                    PC += 2; 
-                break;
+    static bool scu(chip8& c, const chip8::instruction& in)
+    {
+        // 00Dn - SCU n: scroll the display up n rows (XO-CHIP)
+        int n = in.opcode & 0x000F; 
+        memmove(c.graphics[0], c.graphics[n], (c.height() - n) * sizeof(c.graphics[0])); 
+        memset(c.graphics[c.height() - n], 0, n * sizeof(c.graphics[0])); 
+        c.dirtyRows |= allRows(c); 
+        c.drawFlag = true; 
+        c.PC += 2; 
+        return true;
+    }
 
-                case 0x0003:
-                    // 8xy3 - XOR Vx, Vy: stores result of Vx ^ Vy in Vx
-                    V[opInsX] = V[opInsX] ^ V[opInsY]; 
-                    PC += 2; 
-                break;
+    static bool scr(chip8& c, const chip8::instruction& in)
+    {
+        // 00FB - SCR: scroll the display right 4 pixels
+        // Low resolution rows end at bit 0 of word 0, whatever moves past it is gone
+        for (int y = 0; y < c.height(); y++) {
+            if (c.highRes) {
+                c.graphics[y][1] = c.graphics[y][1] >> 4 | c.graphics[y][0] << 60; 
+            }
+            c.graphics[y][0] >>= 4; 
+        }
+        c.dirtyRows |= allRows(c); 
+        c.drawFlag = true; 
+        c.PC += 2; 
+        return true;
+    }
 
-                case 0x0004:
-                    // 8xy4 - ADD Vx, Vy: stores result of Vx + Vy in Vx
-                    // if result if > 255, set VF == 1, else 0
-                    V[opInsX] + V[opInsY] > 255 ? V[15] = 1 : V[15] = 0;  
-                    V[opInsX] = V[opInsX] + V[opInsY];
-                    PC += 2; 
-                break;
+    static bool scl(chip8& c, const chip8::instruction& in)
+    {
+        // 00FC - SCL: scroll the display left 4 pixels
+        for (int y = 0; y < c.height(); y++) {
+            c.graphics[y][0] = c.graphics[y][0] << 4 | c.graphics[y][1] >> 60; 
+            c.graphics[y][1] <<= 4; 
+        }
+        c.dirtyRows |= allRows(c); 
+        c.drawFlag = true; 
+        c.PC += 2; 
+        return true;
+    }
 
-                case 0x0005:
-                    // 8xy5 - SUB Vx, Vy: stores result of Vx - Vy in Vx
-                    // if Vx > Vy, set VF = 1 else 0 
-                    V[opInsX] > V[opInsY] ? V[15] = 1 : V[15] = 0;
-                    V[opInsX] = V[opInsX] - V[opInsY]; 
-                    PC += 2; 
-                break;
+    static bool exit(chip8& c, const chip8::instruction& in)
+    {
+        // 00FD - EXIT: stop the interpreter, PC stays on this instruction
+        return false;
+    }
 
-                case 0x0006:
-                    // 8xy6 - SHR Vx {, Vy}: stores result of Vx >> 1
-                    // VF is set = 1 if Vx % 2 != 0
-                    V[opInsX] % 2 == 0 ? V[15] = 0 : V[15] = 1; 
-                    V[opInsX] = V[opInsX] / 2; 
-                    PC += 2; 
-                break;
+    static bool breakpoint(chip8& c, const chip8::instruction& in)
+    {
+        // Stands in for the instruction at a breakpoint, which is executed by whoever dispatched here
+        return false;
+    }
 
-                case 0x0007:
-                    // 8xy7 - SUB Vx, Vy: stores result of Vy - Vx in Vx
-                    // if Vy > Vx, set VF = 1 else 0 
-                    V[opInsY] > V[opInsX] ? V[15] = 1 : V[15] = 0;
-                    V[opInsX] = V[opInsY] - V[opInsX]; 
-                    PC += 2; 
-                break;
-                
-                case 0x000E:
-                    // 8xyE - SHL Vx {, Vy}: If MSB of Vx is 1, VF = 1, else 0. Vx *= 2
-                    V[0xF] = V[opInsX] >> 7;
-                    V[(opcode & 0x0F00) >> 8] <<= 1;
-                    PC += 2;
-                break; 
+    template <class Q>
+    static bool watch(chip8& c, const chip8::instruction& in)
+    {
+        // Fx33/Fx55 while watchpoints are set: stop before writing a watched address, otherwise store
+        unsigned last = in.kk == 0x33 ? 2 : in.x;
+        for (unsigned r = 0; r <= last; r++) {
+            uint16_t addr = (c.I + r) & 0xFFF;
+            if (c.watchpoints[addr >> 6] >> (addr & 63) & 1) {
+                c.watchHit = addr;
+                return false;
+            }
+        }
+        return in.kk == 0x33 ? ldB(c, in) : ldMemVx<Q>(c, in);
+    }
 
-                default: 
-                    printf("Invalid opcode 8x%X\n", opcode); 
-                break; 
-            }    
-        break; 
-        
-        case 0x9000: 
-            // 9xy0 - SNE Vx, Vy: if Vx != Vy, PC += 2 
-            V[opInsX] != V[opInsY] ? PC += 4 : PC += 2; 
-        break;
+    static bool resolution(chip8& c, bool high)
+    {
+        // 00FE/00FF - LOW/HIGH: switch resolution, the two row layouts don't mix so the display is cleared
+        c.highRes = high; 
+        memset(c.graphics, 0, sizeof(c.graphics)); 
+        c.dirtyRows = ~0ULL; 
+        c.drawFlag = true; 
+        c.PC += 2; 
+        return true;
+    }
 
-        case 0xA000:
-            // Annn - LD I, addr: set index register to value nnn
-            I = opInsLong; 
-            PC += 2; 
-        break;
+    static bool low(chip8& c, const chip8::instruction& in)
+    {
+        return resolution(c, false);
+    }
 
-        case 0xB000:
-            // Bnnn - JP V0, addr: PC set to nnn + V0 
-            PC = V[0x0] + opInsLong; 
-        break;
-            
-        case 0xC000:
-            // Cxkk - RND Vx, byte: generate rand number 0-255, & w/ kk, st in Vx 
-            V[opInsX] = (rand() & 0xFF) & (opInsByte); 
-            PC += 2; 
-        break;
+    static bool high(chip8& c, const chip8::instruction& in)
+    {
+        return resolution(c, true);
+    }
+
+    static bool ldHf(chip8& c, const chip8::instruction& in)
+    {
+        // Fx30 - LD HF, Vx: point I at the 8x10 font sprite for digit Vx
+        c.I = 0x0A0 + (c.V[in.x] & 0xF) * 10;
+        c.PC += 2;
+        return true;
+    }
+
+    static bool ldR(chip8& c, const chip8::instruction& in)
+    {
+        // Fx75 - LD R, Vx: save V0..Vx to the RPL user flags
+        memcpy(c.rplFlags, c.V, in.x + 1);
+        c.PC += 2;
+        return true;
+    }
+
+    static bool ldVxR(chip8& c, const chip8::instruction& in)
+    {
+        // Fx85 - LD Vx, R: restore V0..Vx from the RPL user flags
+        memcpy(c.V, c.rplFlags, in.x + 1);
+        c.PC += 2;
+        return true;
+    }
+};
+
+// Indexed by chip8::instruction::handler, in the order of the chip8_ops enum, one table per quirk profile
+template <class Q>
+struct chip8_handlers
+{
+    static const chip8::handler_fn table[chip8_ops::COUNT];
+};
+
+template <class Q>
+const chip8::handler_fn chip8_handlers<Q>::table[chip8_ops::COUNT] = {
+    NULL, chip8_ops::cls, chip8_ops::ret, chip8_ops::unknown0, chip8_ops::jp, chip8_ops::call,
+    chip8_ops::seByte, chip8_ops::sneByte, chip8_ops::seReg, chip8_ops::ldByte, chip8_ops::addByte,
+    chip8_ops::ldReg, chip8_ops::orReg, chip8_ops::andReg, chip8_ops::xorReg, chip8_ops::addReg,
+    chip8_ops::sub, chip8_ops::shr<Q>, chip8_ops::subn, chip8_ops::shl<Q>, chip8_ops::unknown8,
+    chip8_ops::sneReg, chip8_ops::ldI, chip8_ops::jpV0<Q>, chip8_ops::rnd, chip8_ops::drw<Q>,
+    chip8_ops::skp, chip8_ops::sknp, chip8_ops::unknownE, chip8_ops::ldVxDt, chip8_ops::ldVxK,
+    chip8_ops::ldDt, chip8_ops::ldSt, chip8_ops::addI, chip8_ops::ldF, chip8_ops::ldB,
+    chip8_ops::ldMemVx<Q>, chip8_ops::ldVxMem<Q>, chip8_ops::unknownF, chip8_ops::scd, chip8_ops::scu,
+    chip8_ops::scr, chip8_ops::scl, chip8_ops::exit, chip8_ops::low, chip8_ops::high, chip8_ops::ldHf,
+    chip8_ops::ldR, chip8_ops::ldVxR, chip8_ops::breakpoint, chip8_ops::watch<Q>
+};
+
+const chip8::handler_fn* chip8::handlerTable(quirk_profile profile)
+{
+    switch (profile){
+        case QUIRKS_SCHIP: return chip8_handlers<quirks_schip>::table;
+        case QUIRKS_XOCHIP: return chip8_handlers<quirks_xochip>::table;
+        default: return chip8_handlers<quirks_vip>::table;
+    }
+}
+
+void chip8::setQuirks(quirk_profile profile)
+{
+    quirkProfile = profile < QUIRK_PROFILES ? profile : QUIRKS_VIP; 
+    handlers = handlerTable(quirkProfile); 
+
+    // Translated blocks have the old profile's shifts and jumps baked in
+    if (jit) {
+        jit->flush(); 
+    }
+}
 
-        case 0xD000:{
-            /*
-            Dxyn - DRW Vx, Vy, nibble
-            Display an n-byte sprite starting at the mem location at I, set VF = collision 
-            Read N bytes from memory starting at I. Bytes are displayed at Vx, Vy on screen
-            */
-            uint16_t height = opIns1;  
-            uint16_t xCord = V[opInsX]; 
-            uint16_t yCord = V[opInsY]; 
-            uint16_t pixel; 
-
-            V[0xF] = 0; 
-
-            for (int y = 0; y < height; y++) {
-                pixel = memory[I + y];  
-                for (int x = 0; x < 8; x++) {
-                    if ((pixel & (0x80 >> x)) != 0) {
-                        if (graphics[xCord + x + ((yCord + y) * 64)] == 1) {
-                            V[0xF] = 1; 
-                        }
-                        graphics[xCord + x + ((yCord + y) * 64)] ^= 1; 
+#ifdef CHIP8_PROFILE
+// Mnemonics for the profile, in the order of the chip8_ops enum
+static const char* const handlerNames[chip8_ops::COUNT] = {
+    "DECODE", "CLS", "RET", "UNKNOWN_0", "JP", "CALL", "SE_BYTE", "SNE_BYTE", "SE_REG", "LD_BYTE",
+    "ADD_BYTE", "LD_REG", "OR", "AND", "XOR", "ADD_REG", "SUB", "SHR", "SUBN", "SHL", "UNKNOWN_8",
+    "SNE_REG", "LD_I", "JP_V0", "RND", "DRW", "SKP", "SKNP", "UNKNOWN_E", "LD_VX_DT", "LD_VX_K",
+    "LD_DT", "LD_ST", "ADD_I", "LD_F", "LD_B", "LD_MEM_VX", "LD_VX_MEM", "UNKNOWN_F", "SCD", "SCU",
+    "SCR", "SCL", "EXIT", "LOW", "HIGH", "LD_HF", "LD_R", "LD_VX_R", "BREAK",
+    "WATCH"
+};
+static_assert(chip8_ops::COUNT <= chip8_profile::HANDLERS, "profile has too few handler counters");
+
+bool chip8::writeProfile(const char* file) const
+{
+    return profile.write(file, handlerNames, chip8_ops::COUNT); 
+}
+#endif
+
+chip8::instruction chip8::decode(uint16_t opcode)
+{
+    instruction in;
+    in.opcode = opcode;
+    in.nnn = opcode & 0x0FFF;
+    in.x = (opcode & 0x0F00) >> 8;
+    in.y = (opcode & 0x00F0) >> 4;
+    in.kk = opcode & 0x00FF;
+
+    switch (opcode & 0xF000){
+        case 0x0000: 
+            switch (opcode){
+                case 0x00FB: in.handler = chip8_ops::SCR; break;
+                case 0x00FC: in.handler = chip8_ops::SCL; break;
+                case 0x00FD: in.handler = chip8_ops::EXIT; break;
+                case 0x00FE: in.handler = chip8_ops::LOW; break;
+                case 0x00FF: in.handler = chip8_ops::HIGH; break;
+                default:
+                    if ((opcode & 0xFFF0) == 0x00C0) {
+                        in.handler = chip8_ops::SCD; 
+                    } else if ((opcode & 0xFFF0) == 0x00D0) {
+                        in.handler = chip8_ops::SCU; 
+                    } else if ((opcode & 0x000F) == 0x0000) {
+                        in.handler = chip8_ops::CLS; 
+                    } else if ((opcode & 0x000F) == 0x000E) {
+                        in.handler = chip8_ops::RET; 
+                    } else {
+                        in.handler = chip8_ops::UNKNOWN_0; 
                     }
-                }
+                break;
+            }
+        break;
+        case 0x1000: in.handler = chip8_ops::JP; break;
+        case 0x2000: in.handler = chip8_ops::CALL; break;
+        case 0x3000: in.handler = chip8_ops::SE_BYTE; break;
+        case 0x4000: in.handler = chip8_ops::SNE_BYTE; break;
+        case 0x5000: in.handler = chip8_ops::SE_REG; break;
+        case 0x6000: in.handler = chip8_ops::LD_BYTE; break;
+        case 0x7000: in.handler = chip8_ops::ADD_BYTE; break;
+        case 0x8000: 
+            switch (opcode & 0x000F){
+                case 0x0000: in.handler = chip8_ops::LD_REG; break;
+                case 0x0001: in.handler = chip8_ops::OR; break;
+                case 0x0002: in.handler = chip8_ops::AND; break;
+                case 0x0003: in.handler = chip8_ops::XOR; break;
+                case 0x0004: in.handler = chip8_ops::ADD_REG; break;
+                case 0x0005: in.handler = chip8_ops::SUB; break;
+                case 0x0006: in.handler = chip8_ops::SHR; break;
+                case 0x0007: in.handler = chip8_ops::SUBN; break;
+                case 0x000E: in.handler = chip8_ops::SHL; break;
+                default:     in.handler = chip8_ops::UNKNOWN_8; break;
+            }
+        break;
+        case 0x9000: in.handler = chip8_ops::SNE_REG; break;
+        case 0xA000: in.handler = chip8_ops::LD_I; break;
+        case 0xB000: in.handler = chip8_ops::JP_V0; break;
+        case 0xC000: in.handler = chip8_ops::RND; break;
+        case 0xD000: in.handler = chip8_ops::DRW; break;
+        case 0xE000: 
+            switch (opcode & 0x00FF){
+                case 0x009E: in.handler = chip8_ops::SKP; break;
+                case 0x00A1: in.handler = chip8_ops::SKNP; break;
+                default:     in.handler = chip8_ops::UNKNOWN_E; break;
+            }
+        break;
+        default: 
+            switch (opcode & 0x00FF){
+                case 0x0007: in.handler = chip8_ops::LD_VX_DT; break;
+                case 0x000A: in.handler = chip8_ops::LD_VX_K; break;
+                case 0x0015: in.handler = chip8_ops::LD_DT; break;
+                case 0x0018: in.handler = chip8_ops::LD_ST; break;
+                case 0x001E: in.handler = chip8_ops::ADD_I; break;
+                case 0x0029: in.handler = chip8_ops::LD_F; break;
+                case 0x0030: in.handler = chip8_ops::LD_HF; break;
+                case 0x0033: in.handler = chip8_ops::LD_B; break;
+                case 0x0055: in.handler = chip8_ops::LD_MEM_VX; break;
+                case 0x0065: in.handler = chip8_ops::LD_VX_MEM; break;
+                case 0x0075: in.handler = chip8_ops::LD_R; break;
+                case 0x0085: in.handler = chip8_ops::LD_VX_R; break;
+                default:     in.handler = chip8_ops::UNKNOWN_F; break;
             }
-             
-            drawFlag = true; 
-            PC += 2; 
+        break;
+    }
+    return in;
+}
+
+void chip8::invalidate(uint16_t addr)
+{
+    dirtyPages |= 1ULL << ((addr >> PAGE_SHIFT) & 63); 
+
+    // Both the instruction starting at addr and the one overlapping it from addr - 1
+    if (addr >= PROGRAM_START + 1 && addr <= PROGRAM_END) {
+        decoded[addr - 1 - PROGRAM_START].handler = chip8_ops::DECODE;
+    }
+    if (addr >= PROGRAM_START && addr < PROGRAM_END) {
+        decoded[addr - PROGRAM_START].handler = chip8_ops::DECODE;
+    }
+    if (jit) {
+        jit->invalidate(addr);
+    }
+}
+
+inline const chip8::instruction* chip8::fetch(instruction& slow)
+{
+    /*
+    Instructions in the program area are decoded once and cached per address,
+    anything outside of it (or at the last byte) is decoded on the fly
+    */ 
+    if (PC >= PROGRAM_START && PC < PROGRAM_END) {
+        instruction* in = &decoded[PC - PROGRAM_START];
+        if (in->handler == chip8_ops::DECODE) {
+            // Beacuse we are fetching two bytes for each instruction, 
+            // the firSt byte is shifted left 8-bits before performing bitwise or
+            *in = decode(memory[PC] << 8 | memory[PC + 1]);
+            patchDebug(*in, PC); 
         }
-        break; 
+        return in; 
+    }
+    slow = decode(memory[PC & 0xFFF] << 8 | memory[(PC + 1) & 0xFFF]);
+    patchDebug(slow, PC & 0xFFF); 
+    return &slow; 
+}
 
-        case 0xE000:{ 
-            switch (opInsByte){
-                case 0x009E: 
-                // Ex9E - SKP Vx: skip instruction if key with val Vx is pressed
-                    key[V[opInsX]] == 1 ? PC += 4 : PC += 2; 
-                break;
-            
-                case 0x00A1:
-                // ExA1 - SKPN Vx: skip instruction if key with val Vx ~ pressed
-                    key[V[opInsX]] != 1 ? PC += 4 : PC += 2; 
-                break;
-            
-                default:
-                    printf ("Unkown opcode: Ex%X\n", opcode);
+inline void chip8::patchDebug(instruction& in, uint16_t addr)
+{
+    // Only on decoding, instructions run from the cache afterwards pay nothing
+    if (breakpoints[addr >> 6] >> (addr & 63) & 1) {
+        in.handler = chip8_ops::BREAK; 
+    } else if (watchpointCount && (in.handler == chip8_ops::LD_B || in.handler == chip8_ops::LD_MEM_VX)) {
+        in.handler = chip8_ops::WATCH; 
+    }
+}
+
+void chip8::runCycle()
+{
+    instruction slow;
+    const instruction* in = fetch(slow);
+    opcode = in->opcode;
+#ifdef CHIP8_PROFILE
+    profile.instruction(PC, in->handler); 
+#endif
+
+    breakAt = -1; 
+    if (!handlers[in->handler](*this, *in) && chip8_ops::trap(in->handler)) {
+        // Breakpoints and watchpoints only stop run(), a single cycle goes through them
+        instruction real = decode(in->opcode); 
+        handlers[real.handler](*this, real); 
+    }
+}
+
+// Why run() stopped, given the handler that didn't retire
+static chip8::run_exit stopReason(uint8_t handler)
+{
+    switch (handler) {
+        case chip8_ops::LD_VX_K: return chip8::RUN_KEY_WAIT; 
+        case chip8_ops::UNKNOWN_0: 
+        case chip8_ops::UNKNOWN_8: 
+        case chip8_ops::UNKNOWN_E: 
+        case chip8_ops::UNKNOWN_F: return chip8::RUN_INVALID_OPCODE; 
+        case chip8_ops::BREAK: 
+        case chip8_ops::WATCH: return chip8::RUN_BREAKPOINT; 
+        default: return chip8::RUN_HALTED; 
+    }
+}
+
+chip8::run_exit chip8::run(uint64_t maxCycles, uint64_t* cycles, uint64_t* skipped)
+{
+    // Skipping a whole idle loop could jump over a breakpoint inside it
+    bool skip = breakpointCount == 0; 
+    run_exit why = RUN_BUDGET; 
+    watchHit = -1; 
+    uint64_t done = 0; 
+    uint64_t idleDone = 0; 
+    while (done < maxCycles) {
+        instruction slow;
+        const instruction* in = fetch(slow);
+        // skipIdle()'s filter from the decoded handler, less Fx0A which stops the run instead
+        if (skip && ((in->handler == chip8_ops::JP && in->nnn == PC) || in->handler == chip8_ops::LD_VX_DT)) {
+            uint64_t idle = idleCycles(maxCycles - done); 
+            if (idle) {
+                done += idle; 
+                idleDone += idle; 
+                continue; 
+            }
+        }
+        opcode = in->opcode;
+#ifdef CHIP8_PROFILE
+        profile.instruction(PC, in->handler); 
+#endif
+        if (!handlers[in->handler](*this, *in)) {
+            if (!chip8_ops::trap(in->handler) || PC != breakAt) {
+                why = stopReason(in->handler); 
                 break; 
             }
+            // Carrying on from the breakpoint the last run() stopped at
+            instruction real = decode(in->opcode); 
+            if (!handlers[real.handler](*this, real)) {
+                why = stopReason(real.handler); 
+                break; 
+            }
+            breakAt = -1; 
         }
-        break;
-        
-        case 0xF000:{
-            switch (opcode & 0x00FF){
-                case 0x0007: 
-                // Fx07 - LD Vx, DT: value of DT is placed in Vx
-                    V[(opcode & 0x0F00) >> 8] = delay_timer;
-                    PC += 2;
-                break;
-            
-                case 0x000A:{ 
-                // Fx0A - LD Vx, K: wait for key press. store value of key in Vx
-                    bool keypress = false;
-                    for(int i = 0; i< 16; ++i){
-                        if (key[i] == 1) {
-                            V[(opcode & 0x0F00) >> 8] = i;
-                            keypress = true;
-                        }
-                    }
-                
-                    if(!keypress)
-                        return; 
-                    PC += 2;
-                } 
-                break;
-            
-              case 0x0015: // opcode fx15
-                 delay_timer = V[(opcode & 0x0F00) >> 8];
-                 PC += 2;
-              break;
-                  
-              case 0x0018: //opcode fx18
-                sound_timer = V[(opcode & 0x0F00) >> 8];
-                PC += 2;
-              break;
-                  
-              case 0x001E: //opcode fx1e
-                if( I + V[(opcode & 0x0F00) >> 8] > 0xFFF){
-                  V[0xF] = 1;
-                }
-                else {
-                  V[0xF] = 0;
-                }
-                I = I + V[(opcode & 0x0F00) >> 8];
-                PC += 2;
-              break;
-                
-              case 0x0029: //opcode fx29
-                I = V[(opcode & 0x0F00) >> 8] *5;
-                PC += 2;
-              break;
-            
-              case 0x0033: //opcode fx33
-                memory[I]  = V[(opcode & 0x0F00) >> 8] / 100;
-                memory[I+1] = (V[(opcode & 0x0F00) >> 8] /10) % 10;
-                memory[I+2] = (V[(opcode & 0xF00) >> 8] % 100) % 10;
-                PC += 2;
-              break;
-            
-              case 0x0055:{  //opcode fx55
-                unsigned char X = ((opcode & 0x0F00) >> 8);
-                for (unsigned char r = 0; r <= X; r++) {
-                    memory[I+r] = V[r];
-                }
-                
-                I = I + X + 1;
-                PC += 2;
-              }
-              break;
-            
-              case 0x0065:{ //opcode fx65
-                unsigned char X = ((opcode & 0x0F00) >> 8);
-                for (unsigned char r = 0; r <= X; r++) {
-                    V[r] = memory [I+r];  
-                }
-                
-                I = I + X + 1;
-                PC += 2;
-              }
-              break;
-            
-              default:
-              printf ("Unkown opcode: Fx%X\n", opcode);
-                
+        done++; 
+    }
+    if (why == RUN_BREAKPOINT) {
+        breakAt = PC; 
+    }
+    if (cycles) {
+        *cycles = done; 
+    }
+    if (skipped) {
+        *skipped = idleDone; 
+    }
+    return why; 
+}
+
+chip8::run_exit chip8::step()
+{
+    instruction slow;
+    const instruction* in = fetch(slow);
+    opcode = in->opcode;
+#ifdef CHIP8_PROFILE
+    profile.instruction(PC, in->handler); 
+#endif
+    watchHit = -1; 
+    instruction real = chip8_ops::trap(in->handler) ? decode(in->opcode) : *in; 
+    if (!handlers[real.handler](*this, real)) {
+        return stopReason(real.handler); 
+    }
+    breakAt = -1; 
+    return RUN_BUDGET; 
+}
+
+chip8::run_exit chip8::runUntilFrame(unsigned ipf)
+{
+    uint64_t done = 0; 
+    run_exit why = frameCycles < ipf ? run(ipf - frameCycles, &done) : RUN_BUDGET; 
+    if (why != RUN_BUDGET && why != RUN_KEY_WAIT) {
+        frameCycles += done; 
+        return why; 
+    }
+    // Fx0A would retry, unchanged, for the rest of the frame
+    frameCycles = 0; 
+    tickTimers(); 
+    return why == RUN_KEY_WAIT ? RUN_KEY_WAIT : RUN_FRAME; 
+}
+
+const char* chip8::exitName(run_exit why)
+{
+    static const char* const names[] = { "frame", "key-wait", "budget", "invalid-opcode", "breakpoint", "halted" }; 
+    return why <= RUN_HALTED ? names[why] : "unknown"; 
+}
+
+void chip8::setBreakpoint(uint16_t addr, bool enabled)
+{
+    addr &= 0xFFF; 
+    uint64_t bit = 1ULL << (addr & 63); 
+    if (((breakpoints[addr >> 6] & bit) != 0) == enabled) {
+        return; 
+    }
+    breakpoints[addr >> 6] ^= bit; 
+    breakpointCount += enabled ? 1 : -1; 
+    // The next fetch decodes the address again, patching BREAK in or out
+    if (addr >= PROGRAM_START && addr < PROGRAM_END) {
+        decoded[addr - PROGRAM_START].handler = chip8_ops::DECODE; 
+    }
+}
+
+void chip8::setWatchpoint(uint16_t addr, bool enabled)
+{
+    addr &= 0xFFF; 
+    uint64_t bit = 1ULL << (addr & 63); 
+    if (((watchpoints[addr >> 6] & bit) != 0) == enabled) {
+        return; 
+    }
+    watchpoints[addr >> 6] ^= bit; 
+    watchpointCount += enabled ? 1 : -1; 
+    // The first watchpoint has every Fx33 and Fx55 decoded again with WATCH patched in, the last one without
+    if (watchpointCount == (enabled ? 1u : 0u)) {
+        for (int i = 0; i < PROGRAM_END - PROGRAM_START; i++) {
+            uint8_t handler = decoded[i].handler; 
+            if (handler == chip8_ops::LD_B || handler == chip8_ops::LD_MEM_VX || handler == chip8_ops::WATCH) {
+                decoded[i].handler = chip8_ops::DECODE; 
             }
         }
-        break;
     }
+}
+
+bool chip8::stoppedAtWatchpoint(uint16_t* addr) const
+{
+    if (watchHit < 0) {
+        return false; 
+    }
+    if (addr) {
+        *addr = watchHit; 
+    }
+    return true; 
+}
 
+void chip8::tickTimers()
+{
     //Update Timers
     if(delay_timer > 0)
         --delay_timer;
             
-    if(sound_timer > 0){
-        if (sound_timer == 1)
+    if(sound_timer > 0)
         --sound_timer;
+
+#ifdef CHIP8_PROFILE
+    if (profile.endFrame()) {
+        writeProfile(profile.outputFile()); 
     }
+#endif
+}
+
+void chip8::seedRandom(uint64_t seed)
+{
+    // splitmix64 spreads any seed, 0 included, into a usable xorshift state
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL; 
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL; 
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL; 
+    z ^= z >> 31; 
+    randomSeed = z ? z : 1; 
+    randomState = randomSeed; 
+}
+
+uint8_t chip8::nextRandom()
+{
+    // xorshift64*, the top byte of the product has the best bits
+    randomState ^= randomState >> 12; 
+    randomState ^= randomState << 25; 
+    randomState ^= randomState >> 27; 
+    return (randomState * 0x2545F4914F6CDD1DULL) >> 56; 
+}
+
+bool chip8::getPixel(int x, int y) const
+{
+    return (graphics[y][x >> 6] >> (63 - (x & 63))) & 1;
+}
+
+size_t chip8::copyFrame(uint64_t* rows) const
+{
+    if (highRes) {
+        memcpy(rows, graphics, sizeof(graphics));
+        return FRAME_WORDS;
+    }
+    // Low resolution rows only use the first word
+    for (int y = 0; y < PIXEL_H; y++) {
+        rows[y] = graphics[y][0];
+    }
+    return PIXEL_H;
+}
+
+uint64_t chip8::takeDirtyRows()
+{
+    uint64_t rows = dirtyRows;
+    dirtyRows = 0;
+    return rows;
 }
 
 bool chip8::loadGame(const char* file) {
+    mapped_file rom; 
+    if (!rom.open(file)) {
+        return false; 
+    }
+    return loadBuffer(rom.data(), rom.size()); 
+}
+
+bool chip8::loadBuffer(const uint8_t* data, size_t size) {
+    if (!romFits(size)) {
+        return false; 
+    }
     initialize(); 
-    
-    // game starts at mem[0x200]     
-    std::ifstream rom;
+    return bootImage(memory, data, size); 
+}
 
-    rom.open(file, std::ios::in |  std::ios::ate | std::ios::binary);  
-    std::streamsize bufferSize = rom.tellg(); 
-    rom.seekg(0, std::ios::beg); 
+// Little-endian cursor over a save state image
+struct state_writer
+{
+    uint8_t* p;
 
-    std::vector<char> buffer(bufferSize); 
+    void u8(uint8_t v) { *p++ = v; }
+    void u16(uint16_t v) { u8(v & 0xFF); u8(v >> 8); }
+    void u32(uint32_t v) { u16(v & 0xFFFF); u16(v >> 16); }
+    void u64(uint64_t v) { u32(v & 0xFFFFFFFF); u32(v >> 32); }
+    void bytes(const uint8_t* data, size_t size) { memcpy(p, data, size); p += size; }
+};
 
-    if (rom.read(buffer.data(), bufferSize)) {
-        
-        for (int i = 0; i <= buffer.size(); i++) {
-            memory[0x200 + i] = buffer[i]; 
-        }
-    } else {
-        std::cout << "Couldn't read file. Exiting..." << "\n"; 
+struct state_reader
+{
+    const uint8_t* p;
+
+    uint8_t u8() { return *p++; }
+    uint16_t u16() { uint16_t lo = u8(); return lo | u8() << 8; }
+    uint32_t u32() { uint32_t lo = u16(); return lo | (uint32_t)u16() << 16; }
+    uint64_t u64() { uint64_t lo = u32(); return lo | (uint64_t)u32() << 32; }
+    void bytes(uint8_t* data, size_t size) { memcpy(data, p, size); p += size; }
+};
+
+static const uint32_t STATE_MAGIC = 0x54533843; // "C8ST"
+
+void chip8::saveState(uint8_t* out) const {
+    state_writer w = { out };
+    w.u32(STATE_MAGIC);
+    w.u32(STATE_VERSION);
+    w.u16(PC);
+    w.u16(I);
+    w.u16(opcode);
+    w.u16(sp);
+    w.bytes(V, sizeof(V));
+    for (int i = 0; i < 16; i++) {
+        w.u16(stack[i]);
+    }
+    w.u8(delay_timer);
+    w.u8(sound_timer);
+    w.u8(drawFlag);
+    w.bytes(key, sizeof(key));
+    for (int i = 0; i < HIRES_PIXEL_H; i++) {
+        w.u64(graphics[i][0]);
+        w.u64(graphics[i][1]);
+    }
+    w.u8(highRes);
+    w.bytes(memory, sizeof(memory));
+    w.u64(randomState);
+    w.bytes(rplFlags, sizeof(rplFlags));
+}
+
+bool chip8::loadState(const uint8_t* data, size_t size) {
+    state_reader r = { data };
+    if (size != STATE_SIZE || r.u32() != STATE_MAGIC) {
+        std::cout << "Not a save state. Exiting..." << "\n"; 
+        return false; 
+    }
+    uint32_t version = r.u32();
+    if (version != STATE_VERSION) {
+        std::cout << "Save state version " << version << " isn't supported. Exiting..." << "\n"; 
+        return false; 
+    }
+
+    uint16_t savedPC = r.u16();
+    uint16_t savedI = r.u16();
+    uint16_t savedOpcode = r.u16();
+    uint16_t savedSp = r.u16();
+    if (savedPC > 0xFFF || savedSp > 16) {
+        std::cout << "Save state is corrupt. Exiting..." << "\n"; 
         return false; 
     }
 
-    rom.close();
+    PC = savedPC;
+    I = savedI;
+    opcode = savedOpcode;
+    sp = savedSp;
+    r.bytes(V, sizeof(V));
+    for (int i = 0; i < 16; i++) {
+        stack[i] = r.u16();
+    }
+    delay_timer = r.u8();
+    sound_timer = r.u8();
+    drawFlag = r.u8() != 0;
+    r.bytes(key, sizeof(key));
+    for (int i = 0; i < HIRES_PIXEL_H; i++) {
+        graphics[i][0] = r.u64();
+        graphics[i][1] = r.u64();
+    }
+    highRes = r.u8() != 0;
+    r.bytes(memory, sizeof(memory));
+    randomState = r.u64();
+    r.bytes(rplFlags, sizeof(rplFlags));
+
+    // Memory was replaced wholesale, so is everything derived from it
+    booted = false; 
+    forgetCode(); 
+    dirtyRows = ~0ULL; 
+    // States are taken between frames
+    frameCycles = 0; 
+    breakAt = -1; 
+    watchHit = -1; 
+    return true; 
+}
+
+bool chip8::saveStateFile(const char* file) const {
+    std::vector<uint8_t> image(STATE_SIZE); 
+    saveState(image.data()); 
+
+    std::ofstream out(file, std::ios::out | std::ios::binary); 
+    if (!out.write((const char*)image.data(), image.size())) {
+        std::cout << "Couldn't write " << file << "\n"; 
+        return false; 
+    }
     return true; 
 }
+
+bool chip8::loadStateFile(const char* file) {
+    std::ifstream in(file, std::ios::in | std::ios::binary); 
+    if (!in.is_open()) {
+        std::cout << "Couldn't open " << file << "\n"; 
+        return false; 
+    }
+    std::vector<uint8_t> image((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>()); 
+    return loadState(image.data(), image.size()); 
+}
@@ -1,6 +1,14 @@
 #ifndef CHIP8
 #define CHIP8
+#include <stddef.h>
 #include <stdint.h>
+#include "quirks.h"
+#ifdef CHIP8_PROFILE
+#include "profile.h"
+#endif
+
+class chip8_jit;
+struct rom_image;
 
 class chip8
 {
@@ -14,21 +22,255 @@ class chip8
 
         bool loadGame(const char* file); 
 
+        // Load a ROM image that is already in memory
+        bool loadBuffer(const uint8_t* data, size_t size); 
+
+        // Start over from a cached boot image, restoring only the memory the last run wrote
+        void restart(const rom_image& image); 
+
+        // loadBuffer() for a ROM that replaces the previous one, e.g. the next fuzz input:
+        // only what the last run wrote and the two ROMs' extents are rewritten
+        bool reload(const uint8_t* data, size_t size); 
+
+        // Fill 4096 bytes of out with fonts and the ROM at 0x200, false if it doesn't fit
+        static bool bootImage(uint8_t* out, const uint8_t* data, size_t size); 
+
+        // Execute one instruction, timers are left to tickTimers()
         void runCycle(); 
 
-        const uint8_t PIXEL_W = 32;
+        /*
+        Instructions out of the next cycles that can be skipped because they
+        are whole iterations of an idle loop: a jump to itself, Fx0A with no
+        key down, or Fx07/3xkk(4xkk)/1nnn polling a delay timer that can't
+        reach kk before the next tick. The machine is left exactly as running
+        them would leave it. Only valid while keys and timers hold still, so
+        drivers call it between runCycle()s within a frame.
+        */
+        uint64_t skipIdle(uint64_t cycles)
+        {
+            // Idle loops start with a jump to here, Fx0A or Fx07, everything else is rejected here
+            uint16_t op = memory[PC & 0xFFF] << 8 | memory[(PC + 1) & 0xFFF]; 
+            bool candidate = op == (0x1000 | PC) || (op & 0xF0FF) == 0xF007 || (op & 0xF0FF) == 0xF00A; 
+            return candidate ? idleCycles(cycles) : 0; 
+        }
+
+        // Why run() or runUntilFrame() returned, PC is left on the instruction that stopped it
+        enum run_exit {
+            RUN_FRAME,          // runUntilFrame() finished the frame and ticked the timers
+            RUN_KEY_WAIT,       // Fx0A is waiting for a key
+            RUN_BUDGET,         // run() executed maxCycles instructions
+            RUN_INVALID_OPCODE, // an unknown opcode, the machine can't get past it
+            RUN_BREAKPOINT,     // a breakpoint, the next run() executes it and goes on
+            RUN_HALTED          // 00FD, or a stack over/underflow in hardened builds
+        };
+
+        static const char* exitName(run_exit why); 
+
+        /*
+        Execute up to maxCycles instructions, skipping idle loops as
+        skipIdle() does unless breakpoints are set, and store how many were
+        executed or skipped in cycles, and how many of those were skipped in
+        skipped. Keys and timers hold still for the whole call. Always
+        interprets, an attached JIT is not used.
+        */
+        run_exit run(uint64_t maxCycles, uint64_t* cycles = NULL, uint64_t* skipped = NULL); 
+
+        /*
+        The rest of the current 60 Hz frame of ipf instructions, then a timer
+        tick: RUN_FRAME, or RUN_KEY_WAIT when Fx0A spent the end of the frame
+        waiting. After an early stop the frame is only part done and the next
+        call carries on with it.
+        */
+        run_exit runUntilFrame(unsigned ipf); 
+
+        // Stop run() before the instruction at addr, kept across loads
+        void setBreakpoint(uint16_t addr, bool enabled); 
+
+        // Stop run() before an Fx33 or Fx55 that would write addr, kept across loads. It
+        // returns RUN_BREAKPOINT, and the next run() carries on with the write
+        void setWatchpoint(uint16_t addr, bool enabled); 
+
+        // Whether the last run() or step() stopped at a watchpoint, and the watched address it was about to write
+        bool stoppedAtWatchpoint(uint16_t* addr) const; 
+
+        /*
+        Execute one instruction, going through a breakpoint or watchpoint at
+        PC: RUN_BUDGET once it retired, otherwise why it didn't as run()
+        would say it. Timers are left to tickTimers().
+        */
+        run_exit step(); 
+
+        // Decrement the delay and sound timers, called once per 60 Hz frame
+        void tickTimers(); 
+
+        // The buzzer sounds for as long as the sound timer is non-zero
+        bool soundOn() const { return sound_timer > 0; }
 
-        const uint8_t PIXEL_H = 64;
+        // What setErrorHandler()'s callback can be told about
+        enum error { UNKNOWN_OPCODE = 1, ROM_TOO_LARGE }; 
+
+        // pc and opcode are where the machine was, opcode is 0 for ROM_TOO_LARGE
+        typedef void (*error_fn)(void* context, error kind, uint16_t pc, uint16_t opcode); 
+
+        // Report errors to fn instead of printing them, NULL goes back to printing
+        void setErrorHandler(error_fn fn, void* context); 
+
+        // Seed Cxkk's generator, kept across initialize() so reloads replay identically
+        void seedRandom(uint64_t seed); 
+
+        // Variant behaviour for the ROM about to be loaded, kept across loads (default VIP)
+        void setQuirks(quirk_profile profile); 
+
+        quirk_profile quirks() const { return quirkProfile; }
+
+        /*
+        Save states: the whole machine as a fixed-size little-endian image,
+        starting with a magic and STATE_VERSION. Bump the version whenever
+        the layout changes, older images are then rejected by loadState().
+        */
+        static const uint32_t STATE_VERSION = 3;
+        static const size_t STATE_SIZE = 5228;
+
+        // Write STATE_SIZE bytes to out
+        void saveState(uint8_t* out) const; 
+
+        // Restore an image written by saveState(), false if it's invalid
+        bool loadState(const uint8_t* data, size_t size); 
+
+        bool saveStateFile(const char* file) const; 
+
+        bool loadStateFile(const char* file); 
+
+        // Display size in low resolution, and in SCHIP high resolution (00FF)
+        static const uint8_t PIXEL_W = 64;
+        static const uint8_t PIXEL_H = 32;
+        static const uint8_t HIRES_PIXEL_W = 128;
+        static const uint8_t HIRES_PIXEL_H = 64;
+
+        // Words copyFrame() may write, a full high resolution frame
+        static const size_t FRAME_WORDS = HIRES_PIXEL_W / 64 * HIRES_PIXEL_H;
 
         bool drawFlag = true;  
 
-        // Array to store state of pixels
-        uint8_t graphics[64 * 32]; 
+        /*
+        Display rows of two words, bit 63 of word 0 is the leftmost pixel and
+        word 1 holds pixels 64-127. Low resolution only uses word 0 of rows
+        0-31, switching modes clears the display.
+        */
+        uint64_t graphics[HIRES_PIXEL_H][2]; 
+
+        bool hires() const { return highRes; }
+        int width() const { return highRes ? HIRES_PIXEL_W : PIXEL_W; }
+        int height() const { return highRes ? HIRES_PIXEL_H : PIXEL_H; }
+
+        // State of pixel x, y for frontends
+        bool getPixel(int x, int y) const; 
+
+        // Byte at addr of memory, e.g. a score read out as a reward signal
+        uint8_t read(uint16_t addr) const { return memory[addr & 0xFFF]; }
+
+        // Copy the display as height() rows of width() / 64 words, returns the words written
+        size_t copyFrame(uint64_t* rows) const; 
+
+        // Rows changed since the last call, bit n set for row n
+        uint64_t takeDirtyRows(); 
 
         // Array to store state of key inputs
         uint8_t key[16];
 
+        // Pre-decoded instruction, operands are extracted once per address
+        struct instruction
+        {
+            uint16_t opcode;
+            uint16_t nnn;
+            uint8_t handler;
+            uint8_t x;
+            uint8_t y;
+            uint8_t kk;
+        };
+
+        typedef bool (*handler_fn)(chip8&, const instruction&);
+
+#ifdef CHIP8_PROFILE
+        // Instruction, draw and frame counters, only in CHIP8_PROFILE builds
+        chip8_profile profile;
+
+        // Write profile as JSON, or as CSV if file ends in .csv
+        bool writeProfile(const char* file) const;
+#endif
+
     private:
+        friend struct chip8_ops;
+        friend class chip8_jit;
+        template <size_t N> friend class chip8_batch;
+        friend class chip8_pool;
+        friend class chip8_debugger;
+
+        // Translated code to invalidate on memory writes, if a JIT is attached
+        chip8_jit* jit = NULL;
+
+        // setErrorHandler()'s callback, kept across loads
+        error_fn errorHandler = NULL; 
+        void* errorContext = NULL; 
+
+        // One bit per address with a breakpoint, decoded entries there get the BREAK handler
+        uint64_t breakpoints[4096 / 64] = {}; 
+        unsigned breakpointCount = 0; 
+
+        // Same for watched addresses, decoded Fx33 and Fx55 get the WATCH handler while any are set
+        uint64_t watchpoints[4096 / 64] = {}; 
+        unsigned watchpointCount = 0; 
+
+        // Address the last stop at a watchpoint was for, -1 if it wasn't one
+        int watchHit = -1; 
+
+        // Address run() last returned RUN_BREAKPOINT at, -1 once anything ran since.
+        // The next run() goes through the breakpoint or watchpoint there, and only there
+        int breakAt = -1; 
+
+        // Instructions runUntilFrame() has run of the current frame
+        unsigned frameCycles = 0; 
+
+        // Decode cache covers the program area 0x200-0xFFF
+        static const uint16_t PROGRAM_START = 0x200;
+        static const uint16_t PROGRAM_END = 0xFFF;
+
+        static instruction decode(uint16_t opcode);
+
+        // The instruction at PC, decoded into slow if it's outside the cache
+        const instruction* fetch(instruction& slow);
+
+        // Swap the BREAK or WATCH handler into in, just decoded from addr, where they apply
+        void patchDebug(instruction& in, uint16_t addr);
+
+        // Power-on state of everything but memory and the code derived from it
+        void reset();
+
+        // Drop every decoded and translated instruction
+        void forgetCode();
+
+        // Drop what was decoded or translated from a page that was just rewritten
+        void forgetPage(unsigned page);
+
+        // Whether a ROM of size bytes fits, reporting ROM_TOO_LARGE as errors are if not
+        bool romFits(size_t size); 
+
+        // Bring memory back to bootImage(data, size), rewriting the ROM's pages unless same.
+        // Registers are left to reset()
+        void reboot(const uint8_t* data, size_t size, bool same);
+
+        // restart() without the reset()
+        void rebootImage(const rom_image& image);
+
+        // Next byte for Cxkk from this instance's generator
+        uint8_t nextRandom(); 
+
+        // Drop cached decodes overlapping a memory write at addr
+        void invalidate(uint16_t addr);
+
+        // skipIdle() once the instruction at PC could start an idle loop, inline for run() and chip8_jit
+        uint64_t idleCycles(uint64_t cycles);
+
         // Program counter
         uint16_t PC;
 
@@ -44,14 +286,95 @@ class chip8
         // Memory
         uint8_t memory[4096];
 
+        /*
+        While booted, memory is bootImage(bootData, bootSize) except for the
+        64-byte pages in dirtyPages, which were written since. Anything that
+        replaces memory some other way clears booted.
+        */
+        static const int PAGE_SHIFT = 6;
+        bool booted = false;
+        const uint8_t* bootData;
+        uint16_t bootSize;
+        uint64_t dirtyPages;
+
         // Timers for sound and game delay
         uint8_t sound_timer; 
         uint8_t delay_timer; 
 
+        // Display rows whose pixels changed since takeDirtyRows()
+        uint64_t dirtyRows; 
+
+        // SCHIP 128x64 mode, set by 00FF and cleared by 00FE
+        bool highRes; 
+
+        // SCHIP RPL user flags, saved and restored by Fx75/Fx85
+        uint8_t rplFlags[16]; 
+
         // Stack for subroutines and stack pointer
         uint16_t stack[16];
         uint16_t sp; 
 
+        // Cxkk generator, restarted from randomSeed by initialize()
+        uint64_t randomSeed = 0x9E3779B97F4A7C15ULL; 
+        uint64_t randomState; 
+
+        // Handlers instantiated for each quirk profile
+        static const handler_fn* handlerTable(quirk_profile profile);
+
+        // Table for quirkProfile, bound once by setQuirks()
+        quirk_profile quirkProfile = QUIRKS_VIP; 
+        const handler_fn* handlers = handlerTable(QUIRKS_VIP); 
+
+        // One entry per address in the program area, handler 0 means not decoded
+        instruction decoded[PROGRAM_END - PROGRAM_START];
+
 
 }; 
+
+inline uint64_t chip8::idleCycles(uint64_t cycles)
+{
+#ifdef CHIP8_PROFILE
+    // Skipped instructions would be missing from the counters
+    return 0; 
+#endif
+    if (PC > 0xFFA) {
+        return 0; 
+    }
+    uint16_t op = memory[PC] << 8 | memory[PC + 1]; 
+    uint16_t last = op; 
+    int length = 0; 
+    if (op == (0x1000 | PC)) {
+        // 1nnn to itself
+        length = 1; 
+    } else if ((op & 0xF0FF) == 0xF00A) {
+        // Fx0A with nothing held retries without advancing
+        length = 1; 
+        for (int i = 0; i < 16; i++) {
+            if (key[i] == 1) {
+                return 0; 
+            }
+        }
+    } else if ((op & 0xF0FF) == 0xF007) {
+        // Fx07, 3xkk/4xkk, 1nnn back to the Fx07: the timer only moves on the next tick
+        uint16_t test = memory[PC + 2] << 8 | memory[PC + 3]; 
+        last = memory[PC + 4] << 8 | memory[PC + 5]; 
+        uint8_t x = (op & 0x0F00) >> 8; 
+        bool sameVx = (test & 0x0F00) >> 8 == x; 
+        bool equal = delay_timer == (test & 0x00FF); 
+        bool spins = ((test & 0xF000) == 0x3000 && !equal) || ((test & 0xF000) == 0x4000 && equal); 
+        if (last == (0x1000 | PC) && sameVx && spins) {
+            length = 3; 
+        }
+    }
+    if (!length || cycles < (uint64_t)length) {
+        return 0; 
+    }
+
+    // Leave the machine as the last skipped iteration would have
+    if (length == 3) {
+        V[(op & 0x0F00) >> 8] = delay_timer; 
+    }
+    opcode = last; 
+    return cycles / length * length; 
+}
 #endif
\ No newline at end of file
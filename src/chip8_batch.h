@@ -0,0 +1,714 @@
+#ifndef CHIP8_BATCH
+#define CHIP8_BATCH
+#include "chip8.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CHIP8_BATCH_AVX2 1
+#include <immintrin.h>
+#else
+#define CHIP8_BATCH_AVX2 0
+#endif
+
+/*
+Byte-wise lane kernels for chip8_batch. Each computes op(a, b) for every lane
+and stores it to dst where mask is 0xFF, leaving the other lanes untouched.
+The AVX2 version handles 32 lanes per instruction and is picked at runtime.
+*/
+struct chip8_lanes
+{
+    enum op
+    {
+        MOV, OR, AND, XOR, ADD, SUB,
+        CARRY,  // a + b > 255
+        GT,     // a > b
+        SHR1, LSB, SHL1, MSB
+    };
+
+    static uint8_t apply(int op, uint8_t a, uint8_t b)
+    {
+        switch (op){
+            case MOV: return b;
+            case OR: return a | b;
+            case AND: return a & b;
+            case XOR: return a ^ b;
+            case ADD: return a + b;
+            case SUB: return a - b;
+            case CARRY: return a + b > 255 ? 1 : 0;
+            case GT: return a > b ? 1 : 0;
+            case SHR1: return a >> 1;
+            case LSB: return a & 1;
+            case SHL1: return a << 1;
+            case MSB: return a >> 7;
+        }
+        return a;
+    }
+
+    static void scalar(int op, uint8_t* dst, const uint8_t* a, const uint8_t* b, const uint8_t* mask, size_t n)
+    {
+        for (size_t l = 0; l < n; l++) {
+            if (mask[l]) {
+                dst[l] = apply(op, a[l], b[l]);
+            }
+        }
+    }
+
+#if CHIP8_BATCH_AVX2
+    __attribute__((target("avx2")))
+    static __m256i gt(__m256i a, __m256i b)
+    {
+        // Unsigned a > b is min(a, b) != a
+        __m256i le = _mm256_cmpeq_epi8(_mm256_min_epu8(a, b), a);
+        return _mm256_andnot_si256(le, _mm256_set1_epi8(1));
+    }
+
+    __attribute__((target("avx2")))
+    static void avx2(int op, uint8_t* dst, const uint8_t* a, const uint8_t* b, const uint8_t* mask, size_t n)
+    {
+        const __m256i one = _mm256_set1_epi8(1);
+        size_t l = 0;
+        for (; l + 32 <= n; l += 32) {
+            __m256i va = _mm256_loadu_si256((const __m256i*)(a + l));
+            __m256i vb = _mm256_loadu_si256((const __m256i*)(b + l));
+            __m256i r;
+            switch (op){
+                case MOV: r = vb; break;
+                case OR: r = _mm256_or_si256(va, vb); break;
+                case AND: r = _mm256_and_si256(va, vb); break;
+                case XOR: r = _mm256_xor_si256(va, vb); break;
+                case ADD: r = _mm256_add_epi8(va, vb); break;
+                case SUB: r = _mm256_sub_epi8(va, vb); break;
+                case CARRY: r = gt(va, _mm256_add_epi8(va, vb)); break;
+                case GT: r = gt(va, vb); break;
+                case SHR1: r = _mm256_and_si256(_mm256_srli_epi16(va, 1), _mm256_set1_epi8(0x7F)); break;
+                case LSB: r = _mm256_and_si256(va, one); break;
+                case SHL1: r = _mm256_add_epi8(va, va); break;
+                default: r = _mm256_and_si256(_mm256_srli_epi16(va, 7), one); break;
+            }
+            __m256i old = _mm256_loadu_si256((const __m256i*)(dst + l));
+            __m256i m = _mm256_loadu_si256((const __m256i*)(mask + l));
+            _mm256_storeu_si256((__m256i*)(dst + l), _mm256_blendv_epi8(old, r, m));
+        }
+        scalar(op, dst + l, a + l, b + l, mask + l, n - l);
+    }
+#endif
+
+    static bool hasAvx2()
+    {
+#if CHIP8_BATCH_AVX2
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+#else
+        return false;
+#endif
+    }
+
+    static void run(int op, uint8_t* dst, const uint8_t* a, const uint8_t* b, const uint8_t* mask, size_t n)
+    {
+#if CHIP8_BATCH_AVX2
+        if (hasAvx2()) {
+            avx2(op, dst, a, b, mask, n);
+            return;
+        }
+#endif
+        scalar(op, dst, a, b, mask, n);
+    }
+};
+
+/*
+N copies of one ROM stepped in lock-step, e.g. for RL rollouts or fuzzing with
+different seeds and inputs. V registers, PC, I, the last opcode and the timers
+are kept as structure-of-arrays, one contiguous row of N lanes per register.
+run() groups the lanes that sit at the same PC with the same code once per
+block, a straight run of ALU and load instructions up to a skip or jump, and
+runs the block for the whole group at once. Every other instruction, and
+every lane that sits alone, runs through its own chip8::runCycle(), so
+memory, the stack, the display and keys stay in each lane's chip8 and
+semantics can't drift from the interpreter. It pays off while lanes stay
+together in arithmetic; lanes that split up, or code that mostly draws or
+touches memory, run no faster than N plain chip8s.
+*/
+template <size_t N>
+class chip8_batch
+{
+
+    public:
+        chip8_batch() : lanes(new chip8[N]), vectorLaneSteps(0), scalarLaneSteps(0)
+        {
+            memset(written, 0, sizeof(written));
+            memset(parked, 0, sizeof(parked));
+            memset(member, 0, sizeof(member));
+            memset(left, 0, sizeof(left));
+            parkedLanes = 0;
+            everyLane = false;
+            regroupIn = 0;
+            shiftVy = quirk_flags::of(QUIRKS_VIP).shiftVy;
+            for (size_t l = 0; l < N; l++) {
+                order[l] = l;
+                lanes[l].initialize();
+                gather(l);
+            }
+        }
+
+        ~chip8_batch() { delete[] lanes; }
+
+        static const size_t LANES = N;
+
+        // Lane numbers are kept in bytes
+        static_assert(N > 0 && N <= 256, "chip8_batch supports 1 to 256 lanes");
+
+        // Lanes that must share a PC before the grouped path is worth it
+        static const size_t MIN_GROUP = N / 4 > 2 ? N / 4 : 2;
+
+        // Instructions run without grouping after a pass in which no group formed
+        static const unsigned REGROUP_INTERVAL = 16;
+
+        // Longest block a group runs before the lanes are grouped again
+        static const int MAX_BLOCK = 16;
+
+        // Load the same ROM, under the same quirk profile, into every lane
+        bool load(const uint8_t* data, size_t size, quirk_profile profile = QUIRKS_VIP)
+        {
+            memset(written, 0, sizeof(written));
+            shiftVy = quirk_flags::of(profile).shiftVy;
+            for (size_t l = 0; l < N; l++) {
+                lanes[l].setQuirks(profile);
+                if (!lanes[l].loadBuffer(data, size)) {
+                    return false;
+                }
+                gather(l);
+                parked[l] = 0;
+                regroupIn = 0;
+            }
+            parkedLanes = 0;
+            return true;
+        }
+
+        // Restart lane's Cxkk generator from seed
+        void seed(size_t lane, uint64_t value) { lanes[lane].seedRandom(value); }
+
+        // Key state of a lane, written directly by the caller
+        uint8_t* keys(size_t lane) { return lanes[lane].key; }
+
+        // The lane as a plain chip8, registers brought up to date first
+        const chip8& lane(size_t l)
+        {
+            park(l);
+            return lanes[l];
+        }
+
+        // One instruction in every lane, exactly like one runCycle() each
+        void step() { run(1); }
+
+        // steps instructions in every lane, exactly like as many step()s
+        void run(unsigned steps)
+        {
+            for (size_t l = 0; l < N; l++) {
+                left[l] = steps;
+            }
+            unsigned pending = steps;
+            while (pending > 0) {
+                // Lanes that drifted apart tend to stay apart, don't look for groups for a while
+                if (regroupIn > 0) {
+                    unsigned n = regroupIn < pending ? regroupIn : pending;
+                    for (size_t l = 0; l < N; l++) {
+                        for (unsigned i = n < left[l] ? n : left[l]; i > 0; i--) {
+                            runLane(l);
+                            left[l]--;
+                        }
+                    }
+                    regroupIn -= n;
+                } else {
+                    pass();
+                }
+                pending = 0;
+                for (size_t l = 0; l < N; l++) {
+                    pending = left[l] > pending ? left[l] : pending;
+                }
+            }
+        }
+
+        // Decrement every lane's timers, as chip8::tickTimers() does
+        void tickTimers()
+        {
+            for (size_t l = 0; l < N; l++) {
+                delay[l] -= delay[l] > 0;
+                sound[l] -= sound[l] > 0;
+            }
+            for (size_t l = 0; l < N; l++) {
+                if (parked[l]) {
+                    lanes[l].tickTimers();
+                }
+            }
+        }
+
+        // Lane-instructions run by the grouped path and by runCycle()
+        uint64_t vectorSteps() const { return vectorLaneSteps; }
+        uint64_t scalarSteps() const { return scalarLaneSteps; }
+
+    private:
+        chip8_batch(const chip8_batch&);
+        chip8_batch& operator=(const chip8_batch&);
+
+        uint16_t fetch(size_t l, uint16_t pc) const
+        {
+            return lanes[l].memory[pc] << 8 | lanes[l].memory[pc + 1];
+        }
+
+        // Opcodes the grouped path implements, see execute()
+        static bool vectorizable(uint16_t op)
+        {
+#ifdef CHIP8_PROFILE
+            // Vector steps would bypass the lanes' counters
+            return false;
+#endif
+            switch (op & 0xF000){
+                case 0x1000: case 0x3000: case 0x4000: case 0x5000: case 0x6000:
+                case 0x7000: case 0x9000: case 0xA000:
+                    return true;
+                case 0x8000:
+                    switch (op & 0x000F){
+                        case 0x0: case 0x1: case 0x2: case 0x3: case 0x4:
+                        case 0x5: case 0x6: case 0x7: case 0xE:
+                            return true;
+                    }
+                    return false;
+                case 0xF000:
+                    switch (op & 0x00FF){
+                        case 0x07: case 0x15: case 0x18: case 0x1E: case 0x29:
+                            return true;
+                    }
+                    return false;
+            }
+            return false;
+        }
+
+        // Registers in and out of a lane's chip8 around runCycle()
+        void scatter(size_t l)
+        {
+            chip8& c = lanes[l];
+            for (int r = 0; r < 16; r++) {
+                c.V[r] = V[r][l];
+            }
+            c.PC = PC[l];
+            c.I = I[l];
+            c.opcode = opcode[l];
+            c.delay_timer = delay[l];
+            c.sound_timer = sound[l];
+        }
+
+        void gather(size_t l)
+        {
+            const chip8& c = lanes[l];
+            for (int r = 0; r < 16; r++) {
+                V[r][l] = c.V[r];
+            }
+            PC[l] = c.PC;
+            I[l] = c.I;
+            opcode[l] = c.opcode;
+            delay[l] = c.delay_timer;
+            sound[l] = c.sound_timer;
+        }
+
+        /*
+        Copying a lane's registers across the structure-of-arrays is a transpose,
+        so a lane that runs through its chip8 stays parked there, with only PC
+        mirrored for grouping, until it joins a group again
+        */
+        void park(size_t l)
+        {
+            if (!parked[l]) {
+                scatter(l);
+                parked[l] = 1;
+                parkedLanes++;
+            }
+        }
+
+        void unpark(size_t l)
+        {
+            if (parked[l]) {
+                gather(l);
+                parked[l] = 0;
+                parkedLanes--;
+            }
+        }
+
+        // Jumps and skips, which end a block
+        static bool branches(uint16_t op)
+        {
+            switch (op & 0xF000){
+                case 0x1000: case 0x3000: case 0x4000: case 0x5000: case 0x9000:
+                    return true;
+            }
+            return false;
+        }
+
+        // The grouped opcodes in lane l's code from pc into ops, up to and including the first branch
+        int block(size_t l, uint16_t pc, uint16_t* ops) const
+        {
+            int count = 0;
+            while (count < MAX_BLOCK && pc < 0xFFF) {
+                uint16_t op = fetch(l, pc);
+                if (op == 0 || !vectorizable(op)) {
+                    break;
+                }
+                ops[count++] = op;
+                if (branches(op)) {
+                    break;
+                }
+                pc += 2;
+            }
+            return count;
+        }
+
+        // Groups the lanes by PC once and runs a block of each group, or of each lane on its own
+        void pass()
+        {
+            // Every lane at the same PC and as far along: one group, whatever the order
+            uint32_t diverged = 0;
+            for (size_t l = 0; l < N; l++) {
+                diverged |= (PC[l] ^ PC[0]) | (left[l] ^ left[0]);
+            }
+            if (!diverged) {
+                runGroup(0, N, PC[0], true);
+                return;
+            }
+
+            // Keep the lanes ordered by PC, lanes sharing one end up next to each
+            // other. Converged lanes barely move, so insertion sort is near linear
+            for (size_t i = 1; i < N; i++) {
+                uint8_t lane = order[i];
+                uint16_t pc = PC[lane];
+                size_t j = i;
+                while (j > 0 && PC[order[j - 1]] > pc) {
+                    order[j] = order[j - 1];
+                    j--;
+                }
+                order[j] = lane;
+            }
+
+            bool grouped = false;
+            size_t first = 0;
+            while (first < N) {
+                uint16_t pc = PC[order[first]];
+                size_t end = first;
+                size_t active = 0;
+                while (end < N && PC[order[end]] == pc) {
+                    active += left[order[end]] > 0;
+                    end++;
+                }
+
+                // Small groups are cheaper through the interpreter than across all N
+                if (active >= MIN_GROUP) {
+                    grouped |= runGroup(first, end, pc, false);
+                } else {
+                    for (size_t i = first; i < end; i++) {
+                        runLaneBlock(order[i]);
+                    }
+                }
+                first = end;
+            }
+            if (!grouped) {
+                regroupIn = REGROUP_INTERVAL;
+            }
+        }
+
+        /*
+        Runs the block at pc for the lanes order[first, end) that still owe
+        instructions, as one group if it holds grouped opcodes. together says
+        that's every lane, all as far along
+        */
+        bool runGroup(size_t first, size_t end, uint16_t pc, bool together)
+        {
+            size_t lead = first;
+            while (!left[order[lead]]) {
+                lead++;
+            }
+            uint16_t ops[MAX_BLOCK];
+            int count = pc >= 0x200 && pc < 0xFFF ? block(order[lead], pc, ops) : 0;
+            if (count == 0) {
+                // Just the one instruction, so lanes that are together stay together
+                for (size_t i = first; i < end; i++) {
+                    uint8_t l = order[i];
+                    if (left[l]) {
+                        runLane(l);
+                        left[l]--;
+                    }
+                }
+                return false;
+            }
+
+            // Unless some lane stored to these bytes, every lane still has the lead lane's code
+            bool shared = true;
+            for (int a = 0; a < 2 * count; a++) {
+                shared &= !written[pc + a];
+            }
+
+            // Nothing to sort out when every lane was a member last time and still is
+            unsigned most = count;
+            if (!(together && shared && everyLane && !parkedLanes)) {
+                memset(member, 0, sizeof(member));
+                size_t members = 0;
+                const uint8_t* code = lanes[order[lead]].memory + pc;
+                for (size_t i = first; i < end; i++) {
+                    uint8_t l = order[i];
+                    if (!left[l]) {
+                        continue;
+                    }
+                    if (shared || memcmp(lanes[l].memory + pc, code, 2 * count) == 0) {
+                        unpark(l);
+                        member[l] = 0xFF;
+                        most = left[l] < most ? left[l] : most;
+                        members++;
+                    } else {
+                        runLaneBlock(l);
+                    }
+                }
+                everyLane = members == N;
+            } else {
+                most = left[0] < most ? left[0] : most;
+            }
+
+            // A block that jumps back to its start goes round again for the same lanes
+            bool loops = ops[count - 1] == (0x1000 | pc);
+            while (most > 0) {
+                // PC only moves for the lanes once the block's straight part is done
+                uint16_t advance = 0;
+                for (unsigned i = 0; i < most; i++) {
+                    if (branches(ops[i]) && advance) {
+                        for (size_t l = 0; l < N; l++) {
+                            PC[l] += member[l] ? advance : 0;
+                        }
+                        advance = 0;
+                    }
+                    advance += execute(ops[i]);
+                }
+                size_t members = 0;
+                for (size_t l = 0; l < N; l++) {
+                    PC[l] += member[l] ? advance : 0;
+                    opcode[l] = member[l] ? ops[most - 1] : opcode[l];
+                    left[l] -= member[l] ? most : 0;
+                    members += member[l] & 1;
+                }
+                vectorLaneSteps += members * most;
+
+                if (!loops || most < (unsigned)count) {
+                    break;
+                }
+                for (size_t l = 0; l < N; l++) {
+                    most = member[l] && left[l] < most ? left[l] : most;
+                }
+            }
+            return true;
+        }
+
+        void runLane(size_t l)
+        {
+            park(l);
+            chip8& c = lanes[l];
+            uint16_t start = c.I;
+            c.runCycle();
+            PC[l] = c.PC;
+            scalarLaneSteps++;
+
+            // Fx33 and Fx55 are the only stores, note what they touched
+            uint16_t op = c.opcode & 0xF0FF;
+            if (op == 0xF033 || op == 0xF055) {
+                int count = op == 0xF033 ? 3 : ((c.opcode & 0x0F00) >> 8) + 1;
+                for (int i = 0; i < count; i++) {
+                    written[(start + i) & 0xFFF] = 1;
+                }
+            }
+        }
+
+        // Lane l through its chip8 until it jumps or skips, or owes nothing more
+        void runLaneBlock(size_t l)
+        {
+            for (int i = 0; i < MAX_BLOCK && left[l] > 0; i++) {
+                uint16_t pc = PC[l];
+                runLane(l);
+                left[l]--;
+                // Fx0A and other instructions that don't retire stay where they are
+                if (PC[l] != pc + 2 && PC[l] != pc) {
+                    break;
+                }
+            }
+        }
+
+        void lanesOp(int op, int dst, const uint8_t* a, const uint8_t* b)
+        {
+            chip8_lanes::run(op, V[dst], a, b, member, N);
+        }
+
+        /*
+        Same operations, in the same order, as the chip8_ops handlers, for the
+        lanes in member. Returns how far PC moves on, which is left to the
+        caller, 0 for jumps and skips that already moved it
+        */
+        uint16_t execute(uint16_t op)
+        {
+            int x = (op & 0x0F00) >> 8;
+            int y = (op & 0x00F0) >> 4;
+            int s = shiftVy ? y : x;
+            uint8_t kk = op & 0x00FF;
+            uint16_t nnn = op & 0x0FFF;
+            uint8_t imm[N];
+            uint16_t advance = 2;
+
+            switch (op & 0xF000){
+                case 0x1000:
+                    for (size_t l = 0; l < N; l++) {
+                        PC[l] = member[l] ? nnn : PC[l];
+                    }
+                    advance = 0;
+                break;
+
+                case 0x3000:
+                    for (size_t l = 0; l < N; l++) {
+                        PC[l] += member[l] ? (V[x][l] == kk ? 4 : 2) : 0;
+                    }
+                    advance = 0;
+                break;
+
+                case 0x4000:
+                    for (size_t l = 0; l < N; l++) {
+                        PC[l] += member[l] ? (V[x][l] != kk ? 4 : 2) : 0;
+                    }
+                    advance = 0;
+                break;
+
+                case 0x5000:
+                    for (size_t l = 0; l < N; l++) {
+                        PC[l] += member[l] ? (V[x][l] == V[y][l] ? 4 : 2) : 0;
+                    }
+                    advance = 0;
+                break;
+
+                case 0x9000:
+                    for (size_t l = 0; l < N; l++) {
+                        PC[l] += member[l] ? (V[x][l] != V[y][l] ? 4 : 2) : 0;
+                    }
+                    advance = 0;
+                break;
+
+                case 0x6000:
+                    memset(imm, kk, N);
+                    lanesOp(chip8_lanes::MOV, x, V[x], imm);
+                break;
+
+                case 0x7000:
+                    memset(imm, kk, N);
+                    lanesOp(chip8_lanes::ADD, x, V[x], imm);
+                break;
+
+                case 0x8000:
+                    // VF is written first and re-read, which matters when x or y is F
+                    switch (op & 0x000F){
+                        case 0x0: lanesOp(chip8_lanes::MOV, x, V[x], V[y]); break;
+                        case 0x1: lanesOp(chip8_lanes::OR, x, V[x], V[y]); break;
+                        case 0x2: lanesOp(chip8_lanes::AND, x, V[x], V[y]); break;
+                        case 0x3: lanesOp(chip8_lanes::XOR, x, V[x], V[y]); break;
+                        case 0x4:
+                            lanesOp(chip8_lanes::CARRY, 0xF, V[x], V[y]);
+                            lanesOp(chip8_lanes::ADD, x, V[x], V[y]);
+                        break;
+                        case 0x5:
+                            lanesOp(chip8_lanes::GT, 0xF, V[x], V[y]);
+                            lanesOp(chip8_lanes::SUB, x, V[x], V[y]);
+                        break;
+                        case 0x6:
+                            lanesOp(chip8_lanes::LSB, 0xF, V[s], V[s]);
+                            lanesOp(chip8_lanes::SHR1, x, V[s], V[s]);
+                        break;
+                        case 0x7:
+                            lanesOp(chip8_lanes::GT, 0xF, V[y], V[x]);
+                            lanesOp(chip8_lanes::SUB, x, V[y], V[x]);
+                        break;
+                        case 0xE:
+                            lanesOp(chip8_lanes::MSB, 0xF, V[s], V[s]);
+                            lanesOp(chip8_lanes::SHL1, x, V[s], V[s]);
+                        break;
+                    }
+                break;
+
+                case 0xA000:
+                    for (size_t l = 0; l < N; l++) {
+                        I[l] = member[l] ? nnn : I[l];
+                    }
+                break;
+
+                case 0xF000:
+                    switch (kk){
+                        case 0x07:
+                            lanesOp(chip8_lanes::MOV, x, V[x], delay);
+                        break;
+                        case 0x15:
+                            for (size_t l = 0; l < N; l++) {
+                                delay[l] = member[l] ? V[x][l] : delay[l];
+                            }
+                        break;
+                        case 0x18:
+                            for (size_t l = 0; l < N; l++) {
+                                sound[l] = member[l] ? V[x][l] : sound[l];
+                            }
+                        break;
+                        case 0x1E:
+                            for (size_t l = 0; l < N; l++) {
+                                if (member[l]) {
+                                    V[0xF][l] = I[l] + V[x][l] > 0xFFF ? 1 : 0;
+                                    I[l] = I[l] + V[x][l];
+                                }
+                            }
+                        break;
+                        case 0x29:
+                            for (size_t l = 0; l < N; l++) {
+                                I[l] = member[l] ? 0x050 + V[x][l] * 5 : I[l];
+                            }
+                        break;
+                    }
+                break;
+            }
+
+            return advance;
+        }
+
+        // Memory, stack, display, keys and the Cxkk generator of every lane
+        chip8* lanes;
+
+        // Steps left to run lane by lane before grouping is tried again
+        unsigned regroupIn;
+
+        // 8xy6/8xyE shift Vy under the lanes' quirk profile
+        bool shiftVy;
+
+        // Lane numbers sorted by PC as of the last step
+        uint8_t order[N];
+
+        // Lanes whose registers currently live in their chip8 rather than the arrays below
+        uint8_t parked[N];
+        size_t parkedLanes;
+
+        // Addresses any lane has stored to since load(), where lanes' code may differ
+        uint8_t written[4096];
+
+        // Lanes taking part in the current group, 0xFF or 0, and whether that's all of them
+        uint8_t member[N];
+        bool everyLane;
+
+        // Instructions each lane still owes the current run()
+        uint32_t left[N];
+
+        uint8_t V[16][N];
+        uint16_t PC[N];
+        uint16_t I[N];
+        uint16_t opcode[N];
+        uint8_t delay[N];
+        uint8_t sound[N];
+
+        uint64_t vectorLaneSteps;
+        uint64_t scalarLaneSteps;
+
+};
+#endif
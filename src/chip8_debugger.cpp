@@ -0,0 +1,277 @@
+#include "chip8_debugger.h"
+#include <stdio.h>
+#include <string.h>
+
+chip8_debugger::chip8_debugger(chip8& machine) : machine(machine), watched(0)
+{
+    memset(unconditional, 0, sizeof(unconditional));
+    memset(watchRanges, 0, sizeof(watchRanges));
+}
+
+const char* chip8_debugger::stopName(stop why)
+{
+    static const char* const names[] = { "stepped", "breakpoint", "watchpoint", "budget", "key-wait", "invalid-opcode", "halted" };
+    return why <= HALTED ? names[why] : "unknown";
+}
+
+void chip8_debugger::setBreakpoint(uint16_t addr, bool enabled)
+{
+    addr &= 0xFFF;
+    uint64_t bit = 1ULL << (addr & 63);
+    if (enabled) {
+        unconditional[addr >> 6] |= bit;
+    } else {
+        unconditional[addr >> 6] &= ~bit;
+        size_t kept = 0;
+        for (size_t i = 0; i < conditions.size(); i++) {
+            if (conditions[i].addr != addr) {
+                conditions[kept++] = conditions[i];
+            }
+        }
+        conditions.resize(kept);
+    }
+    machine.setBreakpoint(addr, enabled);
+}
+
+void chip8_debugger::addCondition(uint16_t addr, int reg, compare op, uint16_t value)
+{
+    addr &= 0xFFF;
+    condition c = { addr, reg, op, value };
+    conditions.push_back(c);
+    machine.setBreakpoint(addr, true);
+}
+
+void chip8_debugger::setWatchpoint(uint16_t addr, uint16_t length, bool enabled)
+{
+    for (unsigned i = 0; i < length && i < 4096; i++) {
+        uint16_t a = (addr + i) & 0xFFF;
+        if (enabled) {
+            if (watchRanges[a]++ == 0) {
+                machine.setWatchpoint(a, true);
+            }
+        } else if (watchRanges[a] > 0 && --watchRanges[a] == 0) {
+            machine.setWatchpoint(a, false);
+        }
+    }
+}
+
+uint16_t chip8_debugger::read(int r) const
+{
+    switch (r) {
+        case REG_I: return machine.I;
+        case REG_DT: return machine.delay_timer;
+        case REG_ST: return machine.sound_timer;
+        case REG_SP: return machine.sp;
+        default: return r >= 0 && r < 16 ? machine.V[r] : 0;
+    }
+}
+
+bool chip8_debugger::shouldStop(uint16_t addr) const
+{
+    if (unconditional[addr >> 6] >> (addr & 63) & 1) {
+        return true;
+    }
+    // Breakpoints set on the machine directly have no conditions and always stop
+    bool conditional = false;
+    for (size_t i = 0; i < conditions.size(); i++) {
+        const condition& c = conditions[i];
+        if (c.addr != addr) {
+            continue;
+        }
+        conditional = true;
+        uint16_t v = read(c.reg);
+        bool holds = false;
+        switch (c.op) {
+            case EQ: holds = v == c.value; break;
+            case NE: holds = v != c.value; break;
+            case LT: holds = v < c.value; break;
+            case LE: holds = v <= c.value; break;
+            case GT: holds = v > c.value; break;
+            case GE: holds = v >= c.value; break;
+        }
+        if (holds) {
+            return true;
+        }
+    }
+    return !conditional;
+}
+
+chip8_debugger::stop chip8_debugger::reason(chip8::run_exit why)
+{
+    switch (why) {
+        case chip8::RUN_BREAKPOINT: return machine.stoppedAtWatchpoint(&watched) ? WATCHPOINT : BREAKPOINT;
+        case chip8::RUN_KEY_WAIT: return KEY_WAIT;
+        case chip8::RUN_INVALID_OPCODE: return INVALID_OPCODE;
+        case chip8::RUN_HALTED: return HALTED;
+        default: return BUDGET;
+    }
+}
+
+chip8_debugger::stop chip8_debugger::resume(uint64_t maxCycles, uint64_t* cycles)
+{
+    return resumeUntil(maxCycles, cycles, -1, 0, false);
+}
+
+chip8_debugger::stop chip8_debugger::resumeUntil(uint64_t maxCycles, uint64_t* cycles, int stopAt, uint16_t depth, bool userBreakpoint)
+{
+    uint64_t done = 0;
+    chip8::run_exit why;
+    for (;;) {
+        uint64_t ran = 0;
+        why = machine.run(maxCycles - done, &ran);
+        done += ran;
+        if (why != chip8::RUN_BREAKPOINT || machine.stoppedAtWatchpoint(NULL)) {
+            break;
+        }
+        // A breakpoint whose conditions don't hold: the next run() goes through it
+        uint16_t at = machine.PC & 0xFFF;
+        if (at == stopAt ? machine.sp == depth || (userBreakpoint && shouldStop(at)) : shouldStop(at)) {
+            break;
+        }
+    }
+    if (cycles) {
+        *cycles = done;
+    }
+    return reason(why);
+}
+
+chip8_debugger::stop chip8_debugger::step()
+{
+    chip8::run_exit why = machine.step();
+    return why == chip8::RUN_BUDGET ? STEPPED : reason(why);
+}
+
+chip8_debugger::stop chip8_debugger::stepOver(uint64_t maxCycles)
+{
+    uint16_t pc = machine.PC & 0xFFF;
+    uint16_t op = machine.memory[pc] << 8 | machine.memory[(pc + 1) & 0xFFF];
+    if ((op & 0xF000) != 0x2000) {
+        return step();
+    }
+    uint16_t back = (pc + 2) & 0xFFF;
+    uint16_t depth = machine.sp;
+    stop why = step();
+    if (why != STEPPED) {
+        return why;
+    }
+
+    // A breakpoint after the call for the duration, unless there is one already
+    bool temporary = !(machine.breakpoints[back >> 6] >> (back & 63) & 1);
+    if (temporary) {
+        machine.setBreakpoint(back, true);
+    }
+    why = resumeUntil(maxCycles > 1 ? maxCycles - 1 : 0, NULL, back, depth, !temporary);
+    // Back after the call, and not in a recursive call of the same subroutine
+    if (why == BREAKPOINT && (machine.PC & 0xFFF) == back && machine.sp == depth) {
+        why = STEPPED;
+    }
+    if (temporary) {
+        machine.setBreakpoint(back, false);
+        if (why == STEPPED) {
+            // Nothing to pass at PC any more
+            machine.breakAt = -1;
+        }
+    }
+    return why;
+}
+
+std::string chip8_debugger::disassembleOpcode(uint16_t opcode)
+{
+    unsigned x = (opcode >> 8) & 0xF;
+    unsigned y = (opcode >> 4) & 0xF;
+    unsigned n = opcode & 0xF;
+    unsigned kk = opcode & 0xFF;
+    unsigned nnn = opcode & 0xFFF;
+    char text[32];
+
+    // The same split as chip8::decode()
+    switch (opcode & 0xF000) {
+        case 0x0000:
+            if (opcode == 0x00FB) {
+                snprintf(text, sizeof(text), "SCR");
+            } else if (opcode == 0x00FC) {
+                snprintf(text, sizeof(text), "SCL");
+            } else if (opcode == 0x00FD) {
+                snprintf(text, sizeof(text), "EXIT");
+            } else if (opcode == 0x00FE) {
+                snprintf(text, sizeof(text), "LOW");
+            } else if (opcode == 0x00FF) {
+                snprintf(text, sizeof(text), "HIGH");
+            } else if ((opcode & 0xFFF0) == 0x00C0) {
+                snprintf(text, sizeof(text), "SCD %u", n);
+            } else if ((opcode & 0xFFF0) == 0x00D0) {
+                snprintf(text, sizeof(text), "SCU %u", n);
+            } else if (n == 0x0) {
+                snprintf(text, sizeof(text), "CLS");
+            } else if (n == 0xE) {
+                snprintf(text, sizeof(text), "RET");
+            } else {
+                snprintf(text, sizeof(text), "DW 0x%04X", opcode);
+            }
+        break;
+        case 0x1000: snprintf(text, sizeof(text), "JP 0x%03X", nnn); break;
+        case 0x2000: snprintf(text, sizeof(text), "CALL 0x%03X", nnn); break;
+        case 0x3000: snprintf(text, sizeof(text), "SE V%X, 0x%02X", x, kk); break;
+        case 0x4000: snprintf(text, sizeof(text), "SNE V%X, 0x%02X", x, kk); break;
+        case 0x5000: snprintf(text, sizeof(text), "SE V%X, V%X", x, y); break;
+        case 0x6000: snprintf(text, sizeof(text), "LD V%X, 0x%02X", x, kk); break;
+        case 0x7000: snprintf(text, sizeof(text), "ADD V%X, 0x%02X", x, kk); break;
+        case 0x8000: {
+            static const char* const names[16] = {
+                "LD", "OR", "AND", "XOR", "ADD", "SUB", "SHR", "SUBN", NULL, NULL, NULL, NULL, NULL, NULL, "SHL", NULL
+            };
+            if (names[n]) {
+                snprintf(text, sizeof(text), "%s V%X, V%X", names[n], x, y);
+            } else {
+                snprintf(text, sizeof(text), "DW 0x%04X", opcode);
+            }
+        }
+        break;
+        case 0x9000: snprintf(text, sizeof(text), "SNE V%X, V%X", x, y); break;
+        case 0xA000: snprintf(text, sizeof(text), "LD I, 0x%03X", nnn); break;
+        case 0xB000: snprintf(text, sizeof(text), "JP V0, 0x%03X", nnn); break;
+        case 0xC000: snprintf(text, sizeof(text), "RND V%X, 0x%02X", x, kk); break;
+        case 0xD000: snprintf(text, sizeof(text), "DRW V%X, V%X, %u", x, y, n); break;
+        case 0xE000:
+            if (kk == 0x9E) {
+                snprintf(text, sizeof(text), "SKP V%X", x);
+            } else if (kk == 0xA1) {
+                snprintf(text, sizeof(text), "SKNP V%X", x);
+            } else {
+                snprintf(text, sizeof(text), "DW 0x%04X", opcode);
+            }
+        break;
+        default:
+            switch (kk) {
+                case 0x07: snprintf(text, sizeof(text), "LD V%X, DT", x); break;
+                case 0x0A: snprintf(text, sizeof(text), "LD V%X, K", x); break;
+                case 0x15: snprintf(text, sizeof(text), "LD DT, V%X", x); break;
+                case 0x18: snprintf(text, sizeof(text), "LD ST, V%X", x); break;
+                case 0x1E: snprintf(text, sizeof(text), "ADD I, V%X", x); break;
+                case 0x29: snprintf(text, sizeof(text), "LD F, V%X", x); break;
+                case 0x30: snprintf(text, sizeof(text), "LD HF, V%X", x); break;
+                case 0x33: snprintf(text, sizeof(text), "LD B, V%X", x); break;
+                case 0x55: snprintf(text, sizeof(text), "LD [I], V%X", x); break;
+                case 0x65: snprintf(text, sizeof(text), "LD V%X, [I]", x); break;
+                case 0x75: snprintf(text, sizeof(text), "LD R, V%X", x); break;
+                case 0x85: snprintf(text, sizeof(text), "LD V%X, R", x); break;
+                default: snprintf(text, sizeof(text), "DW 0x%04X", opcode); break;
+            }
+        break;
+    }
+    return text;
+}
+
+std::string chip8_debugger::disassemble(uint16_t addr, unsigned count) const
+{
+    std::string out;
+    for (unsigned i = 0; i < count; i++) {
+        uint16_t a = (addr + 2 * i) & 0xFFF;
+        uint16_t op = machine.memory[a] << 8 | machine.memory[(a + 1) & 0xFFF];
+        char mark = a == (machine.PC & 0xFFF) ? '>' : (machine.breakpoints[a >> 6] >> (a & 63) & 1) ? '*' : ' ';
+        char line[64];
+        snprintf(line, sizeof(line), "%c %04X  %04X  %s\n", mark, a, op, disassembleOpcode(op).c_str());
+        out += line;
+    }
+    return out;
+}
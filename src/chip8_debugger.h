@@ -0,0 +1,111 @@
+#ifndef CHIP8_DEBUGGER
+#define CHIP8_DEBUGGER
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "chip8.h"
+
+/*
+Breakpoints, watchpoints and stepping for a chip8, on top of chip8::run().
+Breakpoints and watchpoints are patched into the machine's decoded
+instructions rather than checked before each one, so code that doesn't
+reach them runs as fast as without a debugger, and a machine with none set
+runs as if it had never been debugged. A condition is only evaluated when
+the machine stops at its address.
+
+Keys and timers hold still while the debugger runs the machine, as they do
+in run(); frontends tick the timers between calls.
+*/
+class chip8_debugger
+{
+
+    public:
+        explicit chip8_debugger(chip8& machine);
+
+        // Registers a condition can test, V0-VF are 0-15
+        enum reg { REG_I = 16, REG_DT, REG_ST, REG_SP };
+
+        enum compare { EQ, NE, LT, LE, GT, GE };
+
+        // Why resume(), step() or stepOver() returned, PC is left on the instruction that stopped it
+        enum stop {
+            STEPPED,        // step() or stepOver() got to the next instruction
+            BREAKPOINT,     // at a breakpoint whose condition, if any, holds
+            WATCHPOINT,     // Fx33/Fx55 about to write a watched address, see watchedAddress()
+            BUDGET,         // maxCycles ran out first
+            KEY_WAIT,       // Fx0A is waiting for a key
+            INVALID_OPCODE,
+            HALTED
+        };
+
+        static const char* stopName(stop why);
+
+        // Stop at addr whatever the registers hold; disabling also drops the address's conditions
+        void setBreakpoint(uint16_t addr, bool enabled);
+
+        // Stop at addr when reg op value holds, several conditions on one address stop when any does
+        void addCondition(uint16_t addr, int reg, compare op, uint16_t value);
+
+        // Stop before Fx33 or Fx55 writes any of length bytes from addr. Ranges are counted,
+        // an address stays watched until every range enabled over it is disabled
+        void setWatchpoint(uint16_t addr, uint16_t length, bool enabled);
+
+        // Run up to maxCycles instructions, going on past breakpoints whose conditions don't hold
+        stop resume(uint64_t maxCycles, uint64_t* cycles = NULL);
+
+        // One instruction, through a breakpoint or watchpoint at PC
+        stop step();
+
+        // step(), but a 2nnn runs until its subroutine returns, or something within stops it
+        stop stepOver(uint64_t maxCycles);
+
+        // The address the last WATCHPOINT stop was about to write
+        uint16_t watchedAddress() const { return watched; }
+
+        uint16_t pc() const { return machine.PC; }
+
+        // V0-VF, or one of reg
+        uint16_t read(int r) const;
+
+        // count instructions from addr, one "> 0200  6A02  LD VA, 0x02" line each,
+        // marked > at PC and * at a breakpoint
+        std::string disassemble(uint16_t addr, unsigned count) const;
+
+        // Mnemonic of one opcode, DW for words that aren't instructions
+        static std::string disassembleOpcode(uint16_t opcode);
+
+    private:
+        chip8_debugger(const chip8_debugger&);
+        chip8_debugger& operator=(const chip8_debugger&);
+
+        struct condition
+        {
+            uint16_t addr;
+            int reg;
+            compare op;
+            uint16_t value;
+        };
+
+        stop reason(chip8::run_exit why);
+
+        // resume(), also stopping at stopAt with depth on the stack whatever the breakpoint's conditions say.
+        // Elsewhere stopAt only stops if it is one of the user's breakpoints too
+        stop resumeUntil(uint64_t maxCycles, uint64_t* cycles, int stopAt, uint16_t depth, bool userBreakpoint);
+
+        // A breakpoint run() stopped at that has to stop the debugger too
+        bool shouldStop(uint16_t addr) const;
+
+        chip8& machine;
+
+        // Breakpoints set without a condition, one bit per address
+        uint64_t unconditional[4096 / 64];
+        std::vector<condition> conditions;
+
+        uint16_t watched;
+
+        // Enabled watch ranges covering each address
+        uint16_t watchRanges[4096];
+
+};
+#endif
@@ -0,0 +1,797 @@
+#include "chip8_jit.h"
+#include "chip8.h"
+#include <stddef.h>
+#include <string.h>
+#if CHIP8_JIT_X64
+#include <sys/mman.h>
+#endif
+
+// Whether the instruction at pc could start an idle loop run() skips: a jump to itself or Fx07.
+// Fx0A isn't one, run() stops there instead
+static bool idleStart(const uint8_t* memory, uint16_t pc)
+{
+    uint16_t op = memory[pc] << 8 | memory[pc + 1];
+    return op == (0x1000 | pc) || (op & 0xF0FF) == 0xF007;
+}
+
+#if CHIP8_JIT_X64
+
+namespace {
+
+// Host register numbers
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RBP = 5, RSI = 6, RDI = 7,
+       R8 = 8, R9, R10, R11, R12, R13, R14, R15 };
+
+// Condition codes for jcc/setcc
+enum { CC_B = 2, CC_E = 4, CC_NE = 5, CC_BE = 6, CC_A = 7 };
+
+// Registers V0-VF may be mapped to for the length of a block, rdi holds the machine
+// and edx the remaining instruction budget, which [rsp] holds at entry. Callee-saved
+// ones come first, handler calls only spill the rest
+const int HOST_REGS[] = { RBX, RBP, R12, R13, R14, R15, RSI, R8, R9, R10, R11 };
+const int HOST_REG_COUNT = sizeof(HOST_REGS) / sizeof(HOST_REGS[0]);
+const int SAVED_REGS[] = { RBX, RBP, R12, R13, R14, R15 };
+const int SAVED_REG_COUNT = sizeof(SAVED_REGS) / sizeof(SAVED_REGS[0]);
+
+// Worst case bytes a single block can emit
+const uint32_t MAX_BLOCK_BYTES = 16384;
+
+// Byte offsets of the machine fields generated code touches, relative to rdi
+struct layout
+{
+    int32_t V, I, PC, sp, stack, delay, sound, opcode;
+};
+
+// Minimal x86-64 encoder, every memory operand is [rdi + disp32]
+struct emitter
+{
+    uint8_t* p;
+
+    void byte(uint8_t b) { *p++ = b; }
+    void word(uint16_t w) { memcpy(p, &w, 2); p += 2; }
+    void dword(uint32_t d) { memcpy(p, &d, 4); p += 4; }
+
+    // Always emitting REX keeps sil/bpl addressable as byte registers
+    void rex(int reg, int rm) { byte(0x40 | ((reg >> 3) << 2) | (rm >> 3)); }
+    void modrm(int mod, int reg, int rm) { byte((mod << 6) | ((reg & 7) << 3) | (rm & 7)); }
+    void mem(int reg, int32_t disp) { modrm(2, reg, RDI); dword(disp); }
+    // [rdi + rax*2 + disp32]
+    void memStack(int reg, int32_t disp) { modrm(2, reg, 4); byte(0x47); dword(disp); }
+
+    // 8-bit register/memory forms
+    void movImm8(int r, uint8_t imm) { rex(0, r); byte(0xB0 + (r & 7)); byte(imm); }
+    void op8(uint8_t op, int dst, int src) { rex(src, dst); byte(op); modrm(3, src, dst); }
+    void opImm8(int digit, int r, uint8_t imm) { rex(0, r); byte(0x80); modrm(3, digit, r); byte(imm); }
+    void load8(int r, int32_t disp) { rex(r, RDI); byte(0x8A); mem(r, disp); }
+    void store8(int32_t disp, int r) { rex(r, RDI); byte(0x88); mem(r, disp); }
+    void setcc(int cc, int r) { rex(0, r); byte(0x0F); byte(0x90 | cc); modrm(3, 0, r); }
+    void shift8(int digit, int r, uint8_t count) { rex(0, r); byte(0xC0); modrm(3, digit, r); byte(count); }
+    void movzx8(int dst, int src) { rex(dst, src); byte(0x0F); byte(0xB6); modrm(3, dst, src); }
+
+    // 16/32-bit forms used for I, PC, sp and the stack
+    void load16(int r, int32_t disp) { rex(r, RDI); byte(0x0F); byte(0xB7); mem(r, disp); }
+    void store16(int32_t disp, int r) { byte(0x66); rex(r, RDI); byte(0x89); mem(r, disp); }
+    void storeImm16(int32_t disp, uint16_t imm) { byte(0x66); byte(0xC7); mem(0, disp); word(imm); }
+    void loadStack16(int r, int32_t disp) { rex(r, RDI); byte(0x0F); byte(0xB7); memStack(r, disp); }
+    void storeStackImm16(int32_t disp, uint16_t imm) { byte(0x66); byte(0xC7); memStack(0, disp); word(imm); }
+    void movImm32(int r, uint32_t imm) { byte(0xB8 + r); dword(imm); }
+    void movImm64(int r, uint64_t imm) { byte(0x48 | (r >> 3)); byte(0xB8 + (r & 7)); memcpy(p, &imm, 8); p += 8; }
+    void opImm32(int digit, int r, uint32_t imm) { byte(0x81); modrm(3, digit, r); dword(imm); }
+    void op32(uint8_t op, int dst, int src) { byte(op); modrm(3, src, dst); }
+    // lea eax, [rax + rax*4 + disp32]
+    void leaTimes5(int32_t disp) { byte(0x8D); modrm(2, RAX, 4); byte(0x80); dword(disp); }
+
+    void push(int r) { if (r >= 8) byte(0x41); byte(0x50 + (r & 7)); }
+    void pop(int r) { if (r >= 8) byte(0x41); byte(0x58 + (r & 7)); }
+    void ret() { byte(0xC3); }
+    // jmp rax, and jmp [base + index*8]
+    void jmpRax() { byte(0xFF); byte(0xE0); }
+    void callRax() { byte(0xFF); byte(0xD0); }
+    void jmpTable(int base, int index) { byte(0xFF); modrm(0, 4, 4); byte(0xC0 | ((index & 7) << 3) | (base & 7)); }
+
+    // Forward branches, patched once the target is known
+    uint8_t* jcc32(int cc) { byte(0x0F); byte(0x80 | cc); dword(0); return p - 4; }
+    uint8_t* jmp32() { byte(0xE9); dword(0); return p - 4; }
+    void patch32(uint8_t* at, uint8_t* target) { int32_t rel = (int32_t)(target - (at + 4)); memcpy(at, &rel, 4); }
+};
+
+/*
+How an opcode is translated. HANDLER ones call the interpreter's handler in
+place, which always retires them: HANDLER_BRANCH ones end the block at the
+PC the handler leaves, and HANDLER_STORE ones end it after a memory write,
+which may have rewritten the code that follows.
+*/
+enum op_kind { UNSUPPORTED, STRAIGHT, TERMINATOR, HANDLER, HANDLER_BRANCH, HANDLER_STORE };
+
+// Mirrors chip8::decode() so both backends agree on what every opcode means
+op_kind classify(uint16_t opcode)
+{
+    switch (opcode & 0xF000){
+        case 0x0000:
+            // 00Cn/00Dn scroll, 00FB-00FF but 00FD EXIT, then 0nn0 is CLS and 0nnE is RET
+            if ((opcode & 0xFFE0) == 0x00C0 || (opcode >= 0x00FB && opcode != 0x00FD && opcode <= 0x00FF)) {
+                return HANDLER;
+            }
+            if (opcode == 0x00FD) {
+                return UNSUPPORTED;
+            }
+            switch (opcode & 0x000F){
+                case 0x0: return HANDLER;
+                case 0xE: return TERMINATOR;
+            }
+            return UNSUPPORTED;
+        case 0x1000: case 0x2000: case 0x3000: case 0x4000: case 0x5000:
+        case 0x9000: case 0xB000:
+            return TERMINATOR;
+        case 0x6000: case 0x7000: case 0xA000:
+            return STRAIGHT;
+        case 0x8000:
+            switch (opcode & 0x000F){
+                case 0x0: case 0x1: case 0x2: case 0x3: case 0x4:
+                case 0x5: case 0x6: case 0x7: case 0xE:
+                    return STRAIGHT;
+            }
+            return UNSUPPORTED;
+        case 0xC000: case 0xD000:
+            return HANDLER;
+        case 0xE000:
+            switch (opcode & 0x00FF){
+                case 0x9E: case 0xA1:
+                    return HANDLER_BRANCH;
+            }
+            return UNSUPPORTED;
+        case 0xF000:
+            switch (opcode & 0x00FF){
+                case 0x07: case 0x15: case 0x18: case 0x1E: case 0x29:
+                    return STRAIGHT;
+                case 0x30: case 0x65: case 0x75: case 0x85:
+                    return HANDLER;
+                case 0x33: case 0x55:
+                    return HANDLER_STORE;
+            }
+            return UNSUPPORTED;
+    }
+    return UNSUPPORTED;
+}
+
+// V registers an opcode reads or writes under the machine's quirks, as a bitmask
+uint16_t registersUsed(uint16_t opcode, const quirk_flags& quirks)
+{
+    uint16_t x = 1 << ((opcode & 0x0F00) >> 8);
+    uint16_t y = 1 << ((opcode & 0x00F0) >> 4);
+    switch (opcode & 0xF000){
+        case 0x3000: case 0x4000: case 0x6000: case 0x7000:
+            return x;
+        case 0x5000: case 0x9000:
+            return x | y;
+        case 0x8000:
+            switch (opcode & 0x000F){
+                case 0x0: case 0x1: case 0x2: case 0x3: return x | y;
+                case 0x6: case 0xE: return (quirks.shiftVy ? x | y : x) | 0x8000;
+            }
+            return x | y | 0x8000;
+        case 0xB000:
+            return quirks.jumpVx ? x : 1;
+        case 0xF000:
+            return (opcode & 0x00FF) == 0x1E ? (x | 0x8000) : x;
+    }
+    return 0;
+}
+
+// V registers a handler reads and writes in memory, as bitmasks
+void handlerRegisters(uint16_t opcode, uint16_t& reads, uint16_t& writes)
+{
+    uint16_t x = 1 << ((opcode & 0x0F00) >> 8);
+    uint16_t y = 1 << ((opcode & 0x00F0) >> 4);
+    // V0 up to Vx
+    uint16_t upTo = (x << 1) - 1;
+    reads = 0;
+    writes = 0;
+    switch (opcode & 0xF000){
+        case 0xC000: writes = x; break;
+        case 0xD000: reads = x | y; writes = 0x8000; break;
+        case 0xE000: reads = x; break;
+        case 0xF000:
+            switch (opcode & 0x00FF){
+                case 0x30: case 0x33: reads = x; break;
+                case 0x55: case 0x75: reads = upTo; break;
+                case 0x65: case 0x85: writes = upTo; break;
+            }
+        break;
+    }
+}
+
+// Generates one block, see chip8_jit::compile
+struct translator
+{
+    emitter e;
+    layout at;
+    int host[16];
+    const uint16_t* opcodes;
+
+    // Branches to the epilogue that goes on to the block at PC, and to the one back to run()
+    uint8_t* exits[4 * 32 + 8];
+    int exitCount;
+    uint8_t* bails[3 * 32 + 8];
+    int bailCount;
+
+    // Where the careful copy runs out of budget, before the instruction at pc
+    struct budget_exit { uint8_t* branch; uint16_t pc; uint32_t retired; };
+    budget_exit budgetExits[32];
+    int budgetExitCount;
+
+    int R(int v) const { return host[v]; }
+
+    void lastOpcode(uint32_t retired)
+    {
+        if (retired > 0) {
+            e.storeImm16(at.opcode, opcodes[retired - 1]);
+        }
+    }
+
+    // On to whatever runs at the PC already stored
+    void leave(uint32_t retired)
+    {
+        lastOpcode(retired);
+        exits[exitCount++] = e.jmp32();
+    }
+
+    void exitTo(uint16_t pc, uint32_t retired)
+    {
+        e.storeImm16(at.PC, pc);
+        leave(retired);
+    }
+
+    // Back to run() at pc, handing refund instructions of budget back
+    void bail(uint16_t pc, uint32_t retired, uint32_t refund)
+    {
+        e.opImm32(0, RDX, refund);
+        e.storeImm16(at.PC, pc);
+        lastOpcode(retired);
+        bails[bailCount++] = e.jmp32();
+    }
+
+    // Emits the skip pair for 3xkk/4xkk/5xy0/9xy0 after the compare
+    void skip(int cc, uint16_t pc, uint32_t retired)
+    {
+        uint8_t* taken = e.jcc32(cc);
+        exitTo(pc + 2, retired);
+        e.patch32(taken, e.p);
+        exitTo(pc + 4, retired);
+    }
+
+    // Calls fn(machine, *in) for the instruction at pc, with the V registers it uses in memory
+    void callHandler(chip8::handler_fn fn, const chip8::instruction* in, uint16_t pc)
+    {
+        uint16_t reads, writes;
+        handlerRegisters(in->opcode, reads, writes);
+        // Mapped registers the call clobbers go through memory too
+        uint16_t clobbered = 0;
+        for (int v = 0; v < 16; v++) {
+            if (host[v] == RSI || (host[v] >= R8 && host[v] <= R11)) {
+                clobbered |= 1 << v;
+            }
+        }
+        for (int v = 0; v < 16; v++) {
+            if (host[v] >= 0 && ((reads | writes | clobbered) >> v & 1)) {
+                e.store8(at.V + v, host[v]);
+            }
+        }
+        e.storeImm16(at.PC, pc);
+        e.push(RDI);
+        e.push(RDX);
+        e.movImm64(RSI, (uint64_t)(uintptr_t)in);
+        e.movImm64(RAX, (uint64_t)(uintptr_t)fn);
+        e.callRax();
+        e.pop(RDX);
+        e.pop(RDI);
+        for (int v = 0; v < 16; v++) {
+            if (host[v] >= 0 && ((writes | clobbered) >> v & 1)) {
+                e.load8(host[v], at.V + v);
+            }
+        }
+    }
+
+    // Counts the instruction at pc against the budget, leaving before it once there is none
+    void charge(uint16_t pc, uint32_t retired)
+    {
+        e.opImm32(5, RDX, 1);
+        budget_exit& out = budgetExits[budgetExitCount++];
+        out.branch = e.jcc32(CC_B);
+        out.pc = pc;
+        out.retired = retired;
+    }
+};
+
+// Straight-line translatable code from start up to the first branch, into opcodes, with
+// the V registers it uses in used
+int findBlock(const uint8_t* memory, uint16_t start, const quirk_flags& quirks, uint16_t* opcodes, uint16_t& used)
+{
+    int count = 0;
+    uint16_t pc = start;
+    bool terminated = false;
+    used = 0;
+    while (count < 32 && pc < 0xFFF && !terminated) {
+        uint16_t opcode = memory[pc] << 8 | memory[pc + 1];
+        op_kind kind = classify(opcode);
+        if (kind == UNSUPPORTED) {
+            break;
+        }
+        bool handled = kind == HANDLER || kind == HANDLER_BRANCH || kind == HANDLER_STORE;
+        uint16_t regs = used | (handled ? 0 : registersUsed(opcode, quirks));
+        if (__builtin_popcount(regs) > HOST_REG_COUNT) {
+            break;
+        }
+        used = regs;
+        opcodes[count++] = opcode;
+        terminated = kind != STRAIGHT && kind != HANDLER;
+        pc += 2;
+    }
+    return count;
+}
+
+}
+
+void chip8_jit::emitStubs()
+{
+    emitter e;
+    e.p = arena;
+
+    // enter: save callee-saved registers and the budget, then jump to the block in rdx
+    enter = (enter_fn)e.p;
+    for (int i = 0; i < SAVED_REG_COUNT; i++) {
+        e.push(SAVED_REGS[i]);
+    }
+    e.push(RSI);
+    e.byte(0x48);
+    e.op32(0x89, RAX, RDX);
+    e.op32(0x89, RDX, RSI);
+    e.jmpRax();
+
+    // leave: return the budget spent, edx being what's left of it
+    leave = e.p;
+    // mov eax, [rsp]; sub eax, edx; add rsp, 8
+    e.byte(0x8B); e.byte(0x04); e.byte(0x24);
+    e.op32(0x29, RAX, RDX);
+    e.byte(0x48); e.byte(0x83); e.byte(0xC4); e.byte(0x08);
+    for (int i = SAVED_REG_COUNT - 1; i >= 0; i--) {
+        e.pop(SAVED_REGS[i]);
+    }
+    e.ret();
+
+    arenaUsed = (uint32_t)(e.p - arena);
+    for (int i = 0; i < 4096; i++) {
+        links[i] = leave;
+    }
+}
+
+void chip8_jit::compile(uint16_t start)
+{
+    uint16_t opcodes[MAX_BLOCK];
+    uint16_t used;
+    quirk_flags quirks = quirk_flags::of(machine.quirks());
+    int count = findBlock(machine.memory, start, quirks, opcodes, used);
+    op_kind last = count > 0 ? classify(opcodes[count - 1]) : UNSUPPORTED;
+    bool terminated = last != STRAIGHT && last != HANDLER;
+
+    // What can't be translated goes to run() together with whatever follows it up to the next
+    // instruction that can
+    if (count == 0) {
+        int length = 1;
+        uint16_t ignored[MAX_BLOCK];
+        while (length < MAX_BLOCK && start + 2 * length < 0xFFF &&
+               findBlock(machine.memory, start + 2 * length, quirks, ignored, used) == 0) {
+            length++;
+        }
+        interpret(start, length);
+        return;
+    }
+
+    if (ARENA_SIZE - arenaUsed < MAX_BLOCK_BYTES) {
+        flush();
+    }
+
+    translator t;
+    t.e.p = arena + arenaUsed;
+    t.opcodes = opcodes;
+    t.exitCount = 0;
+    t.bailCount = 0;
+    t.budgetExitCount = 0;
+    t.at.V = (int32_t)((uint8_t*)machine.V - (uint8_t*)&machine);
+    t.at.I = (int32_t)((uint8_t*)&machine.I - (uint8_t*)&machine);
+    t.at.PC = (int32_t)((uint8_t*)&machine.PC - (uint8_t*)&machine);
+    t.at.sp = (int32_t)((uint8_t*)&machine.sp - (uint8_t*)&machine);
+    t.at.stack = (int32_t)((uint8_t*)machine.stack - (uint8_t*)&machine);
+    t.at.delay = (int32_t)((uint8_t*)&machine.delay_timer - (uint8_t*)&machine);
+    t.at.sound = (int32_t)((uint8_t*)&machine.sound_timer - (uint8_t*)&machine);
+    t.at.opcode = (int32_t)((uint8_t*)&machine.opcode - (uint8_t*)&machine);
+
+    emitter& e = t.e;
+    uint8_t* entry = e.p;
+    int next = 0;
+    for (int v = 0; v < 16; v++) {
+        t.host[v] = (used & (1 << v)) ? HOST_REGS[next++] : -1;
+    }
+
+    // With budget for the whole block it's charged once and the fast copy runs, otherwise
+    // the careful copy charges every instruction and stops where the budget does
+    e.opImm32(7, RDX, count);
+    uint8_t* shortBudget = e.jcc32(CC_B);
+    e.opImm32(5, RDX, count);
+    for (int careful = 0; careful < 2; careful++) {
+        if (careful) {
+            e.patch32(shortBudget, e.p);
+        }
+        for (int v = 0; v < 16; v++) {
+            if (t.host[v] >= 0) {
+                e.load8(t.host[v], t.at.V + v);
+            }
+        }
+
+        for (int i = 0; i < count; i++) {
+            uint16_t opcode = opcodes[i];
+            uint16_t addr = start + 2 * i;
+            int x = (opcode & 0x0F00) >> 8;
+            int y = (opcode & 0x00F0) >> 4;
+            uint8_t kk = opcode & 0x00FF;
+            uint16_t nnn = opcode & 0x0FFF;
+            // Register 8xy6/8xyE shift, per the quirk profile
+            int s = quirks.shiftVy ? y : x;
+            uint32_t retired = i + 1;
+            // Budget charged for this instruction and the ones after it
+            uint32_t unspent = careful ? 1 : count - i;
+
+            if (careful) {
+                t.charge(addr, i);
+            }
+
+            op_kind kind = classify(opcode);
+            if (kind == HANDLER || kind == HANDLER_BRANCH || kind == HANDLER_STORE) {
+                chip8::instruction& in = handled[addr];
+                in = chip8::decode(opcode);
+                t.callHandler(machine.handlers[in.handler], &in, addr);
+                if (kind == HANDLER_BRANCH) {
+                    t.leave(retired);
+                } else if (kind == HANDLER_STORE) {
+                    t.exitTo(addr + 2, retired);
+                }
+                continue;
+            }
+
+            switch (opcode & 0xF000){
+                case 0x0000:{
+                    // 00EE - RET, bail to the interpreter if sp would leave the stack
+                    e.load16(RAX, t.at.sp);
+                    e.opImm32(5, RAX, 1);
+                    e.opImm32(7, RAX, 15);
+                    uint8_t* inRange = e.jcc32(CC_BE);
+                    t.bail(addr, i, unspent);
+                    e.patch32(inRange, e.p);
+                    e.store16(t.at.sp, RAX);
+                    e.loadStack16(RCX, t.at.stack);
+                    e.opImm32(0, RCX, 2);
+                    e.store16(t.at.PC, RCX);
+                    t.leave(retired);
+                }
+                break;
+
+                case 0x1000:
+                    t.exitTo(nnn, retired);
+                break;
+
+                case 0x2000:{
+                    // 2nnn - CALL, bail to the interpreter on stack overflow
+                    e.load16(RAX, t.at.sp);
+                    e.opImm32(7, RAX, 16);
+                    uint8_t* inRange = e.jcc32(CC_B);
+                    t.bail(addr, i, unspent);
+                    e.patch32(inRange, e.p);
+                    e.storeStackImm16(t.at.stack, addr);
+                    e.opImm32(0, RAX, 1);
+                    e.store16(t.at.sp, RAX);
+                    t.exitTo(nnn, retired);
+                }
+                break;
+
+                case 0x3000:
+                    e.opImm8(7, t.R(x), kk);
+                    t.skip(CC_E, addr, retired);
+                break;
+
+                case 0x4000:
+                    e.opImm8(7, t.R(x), kk);
+                    t.skip(CC_NE, addr, retired);
+                break;
+
+                case 0x5000:
+                    e.op8(0x38, t.R(x), t.R(y));
+                    t.skip(CC_E, addr, retired);
+                break;
+
+                case 0x6000:
+                    e.movImm8(t.R(x), kk);
+                break;
+
+                case 0x7000:
+                    e.opImm8(0, t.R(x), kk);
+                break;
+
+                case 0x8000:
+                    // VF is written before Vx, exactly as the interpreter does when x or y is F
+                    switch (opcode & 0x000F){
+                        case 0x0: e.op8(0x88, t.R(x), t.R(y)); break;
+                        case 0x1: e.op8(0x08, t.R(x), t.R(y)); break;
+                        case 0x2: e.op8(0x20, t.R(x), t.R(y)); break;
+                        case 0x3: e.op8(0x30, t.R(x), t.R(y)); break;
+                        case 0x4:
+                            e.op8(0x88, RAX, t.R(x));
+                            e.op8(0x00, RAX, t.R(y));
+                            e.setcc(CC_B, t.R(15));
+                            e.op8(0x00, t.R(x), t.R(y));
+                        break;
+                        case 0x5:
+                            e.op8(0x38, t.R(x), t.R(y));
+                            e.setcc(CC_A, t.R(15));
+                            e.op8(0x28, t.R(x), t.R(y));
+                        break;
+                        case 0x6:
+                            e.op8(0x88, RAX, t.R(s));
+                            e.opImm8(4, RAX, 1);
+                            e.op8(0x88, t.R(15), RAX);
+                            if (s != x) {
+                                e.op8(0x88, t.R(x), t.R(s));
+                            }
+                            e.shift8(5, t.R(x), 1);
+                        break;
+                        case 0x7:
+                            e.op8(0x38, t.R(y), t.R(x));
+                            e.setcc(CC_A, t.R(15));
+                            e.op8(0x88, RAX, t.R(y));
+                            e.op8(0x28, RAX, t.R(x));
+                            e.op8(0x88, t.R(x), RAX);
+                        break;
+                        case 0xE:
+                            e.op8(0x88, RAX, t.R(s));
+                            e.shift8(5, RAX, 7);
+                            e.op8(0x88, t.R(15), RAX);
+                            if (s != x) {
+                                e.op8(0x88, t.R(x), t.R(s));
+                            }
+                            e.shift8(4, t.R(x), 1);
+                        break;
+                    }
+                break;
+
+                case 0x9000:
+                    e.op8(0x38, t.R(x), t.R(y));
+                    t.skip(CC_NE, addr, retired);
+                break;
+
+                case 0xA000:
+                    e.storeImm16(t.at.I, nnn);
+                break;
+
+                case 0xB000:
+                    e.movzx8(RAX, t.R(quirks.jumpVx ? x : 0));
+                    e.opImm32(0, RAX, nnn);
+                    e.store16(t.at.PC, RAX);
+                    t.leave(retired);
+                break;
+
+                case 0xF000:
+                    switch (kk){
+                        case 0x07:
+                            e.load8(t.R(x), t.at.delay);
+                        break;
+                        case 0x15:
+                            e.store8(t.at.delay, t.R(x));
+                        break;
+                        case 0x18:
+                            e.store8(t.at.sound, t.R(x));
+                        break;
+                        case 0x1E:
+                            e.load16(RAX, t.at.I);
+                            e.movzx8(RCX, t.R(x));
+                            e.op32(0x01, RCX, RAX);
+                            e.opImm32(7, RCX, 0xFFF);
+                            e.setcc(CC_A, t.R(15));
+                            e.movzx8(RCX, t.R(x));
+                            e.op32(0x01, RAX, RCX);
+                            e.store16(t.at.I, RAX);
+                        break;
+                        case 0x29:
+                            e.movzx8(RAX, t.R(x));
+                            e.leaTimes5(0x050);
+                            e.store16(t.at.I, RAX);
+                        break;
+                    }
+                break;
+            }
+
+        }
+
+        // Fell off the end of a straight-line block
+        if (!terminated) {
+            t.exitTo(start + 2 * count, count);
+        }
+    }
+    for (int i = 0; i < t.budgetExitCount; i++) {
+        e.patch32(t.budgetExits[i].branch, e.p);
+        t.bail(t.budgetExits[i].pc, t.budgetExits[i].retired, 1);
+    }
+
+    // Epilogues: write V registers back, then go on to the block at PC or back to run()
+    for (int i = 0; i < t.exitCount; i++) {
+        e.patch32(t.exits[i], e.p);
+    }
+    for (int v = 0; v < 16; v++) {
+        if (t.host[v] >= 0) {
+            e.store8(t.at.V + v, t.host[v]);
+        }
+    }
+    e.load16(RCX, t.at.PC);
+    e.opImm32(4, RCX, 0xFFF);
+    e.movImm64(RAX, (uint64_t)(uintptr_t)links);
+    e.jmpTable(RAX, RCX);
+
+    for (int i = 0; i < t.bailCount; i++) {
+        e.patch32(t.bails[i], e.p);
+    }
+    for (int v = 0; v < 16; v++) {
+        if (t.host[v] >= 0) {
+            e.store8(t.at.V + v, t.host[v]);
+        }
+    }
+    e.patch32(e.jmp32(), (uint8_t*)leave);
+
+    arenaUsed = (uint32_t)(e.p - arena);
+    blocks[start].code = entry;
+    blocks[start].length = count;
+    blocks[start].idle = idleStart(machine.memory, start);
+    // Blocks run() should check for an idle loop first are only ever reached through it
+    links[start] = blocks[start].idle ? leave : entry;
+    memset(translated + start, 1, 2 * count);
+}
+
+#else
+
+void chip8_jit::emitStubs()
+{
+}
+
+void chip8_jit::compile(uint16_t start)
+{
+    interpret(start, 1);
+}
+
+#endif
+
+void chip8_jit::interpret(uint16_t start, uint8_t length)
+{
+    blocks[start].code = NULL;
+    blocks[start].length = length;
+    blocks[start].idle = idleStart(machine.memory, start);
+    memset(translated + start, 1, 2 * length);
+}
+
+chip8_jit::chip8_jit(chip8& machine) : machine(machine), enter(NULL), leave(NULL), arena(NULL), arenaUsed(0)
+{
+#if CHIP8_JIT_X64
+    void* memory = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory != MAP_FAILED) {
+        arena = (uint8_t*)memory;
+    }
+#endif
+    memset(blocks, 0, sizeof(blocks));
+    memset(translated, 0, sizeof(translated));
+    if (arena) {
+        emitStubs();
+    }
+    machine.jit = this;
+}
+
+chip8_jit::~chip8_jit()
+{
+    if (machine.jit == this) {
+        machine.jit = NULL;
+    }
+#if CHIP8_JIT_X64
+    if (arena) {
+        munmap(arena, ARENA_SIZE);
+    }
+#endif
+}
+
+bool chip8_jit::supported()
+{
+    return CHIP8_JIT_X64 != 0;
+}
+
+void chip8_jit::flush()
+{
+    memset(blocks, 0, sizeof(blocks));
+    memset(translated, 0, sizeof(translated));
+    if (arena) {
+        emitStubs();
+    }
+}
+
+void chip8_jit::invalidate(uint16_t addr)
+{
+    // Most stores hit data, not code, and never reach the scan
+    if (!translated[addr]) {
+        return;
+    }
+
+    // Any block starting up to MAX_BLOCK instructions before addr may cover it
+    int first = addr - 2 * MAX_BLOCK + 1;
+    for (int start = first < 0 ? 0 : first; start <= addr && start < 4096; start++) {
+        if (blocks[start].length && start + 2 * blocks[start].length > addr) {
+            blocks[start].code = NULL;
+            blocks[start].length = 0;
+            links[start] = leave;
+        }
+    }
+}
+
+chip8::run_exit chip8_jit::run(uint64_t cycles, uint64_t* ran, uint64_t* skipped)
+{
+    // Generated code can't stop at breakpoints or watchpoints
+    if (!arena || machine.breakpointCount || machine.watchpointCount) {
+        return machine.run(cycles, ran, skipped);
+    }
+
+    chip8::run_exit why = chip8::RUN_BUDGET;
+    uint64_t done = 0;
+    uint64_t idleDone = 0;
+    while (done < cycles) {
+        uint64_t left = cycles - done;
+        uint16_t pc = machine.PC;
+        uint64_t interpreted = 1;
+        if (pc >= 0x200 && pc < 0xFFF) {
+            block& b = blocks[pc];
+            if (!b.length) {
+                compile(pc);
+            }
+
+            // Blocks only come back here at one that could be an idle loop, run() skips it there too
+            if (b.idle) {
+                uint64_t idle = machine.idleCycles(left);
+                if (idle) {
+                    done += idle;
+                    idleDone += idle;
+                    continue;
+                }
+            }
+
+            // Blocks stop early once the budget is spent, so frames end exactly
+            if (b.code) {
+                uint32_t retired = enter(&machine, left > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)left, b.code);
+                done += retired;
+                // Nothing retired when the first instruction bailed on the stack, run() reports it
+                if (retired) {
+                    continue;
+                }
+            } else {
+                interpreted = b.length;
+            }
+        }
+
+        // The stretch of untranslated code in the interpreter's own loop
+        uint64_t executed = 0;
+        uint64_t idle = 0;
+        why = machine.run(interpreted < left ? interpreted : left, &executed, &idle);
+        done += executed;
+        idleDone += idle;
+        if (why != chip8::RUN_BUDGET) {
+            break;
+        }
+    }
+    if (ran) {
+        *ran = done;
+    }
+    if (skipped) {
+        *skipped = idleDone;
+    }
+    return why;
+}
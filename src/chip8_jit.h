@@ -0,0 +1,92 @@
+#ifndef CHIP8_JIT
+#define CHIP8_JIT
+#include <stdint.h>
+#include "chip8.h"
+
+// Translated blocks don't go through runCycle(), so profiling builds only interpret
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__)) && !defined(CHIP8_PROFILE)
+#define CHIP8_JIT_X64 1
+#else
+#define CHIP8_JIT_X64 0
+#endif
+
+/*
+Optional x86-64 backend. CHIP-8 basic blocks are translated to native code
+the first time they are reached, with the V registers a block touches held in
+host registers while it runs. Blocks end at jumps, calls, returns and skips,
+and go straight on into the block at their target without coming back to
+run(), unless that block starts an idle loop run() would skip. Drawing,
+memory access, RND and key skips call the interpreter's handlers from the
+block. Stretches the translator doesn't handle (Fx0A, 00FD, unknown opcodes)
+are handed to chip8::run() as a whole, so results and exit reasons match the
+interpreter instruction for instruction. With breakpoints or watchpoints set,
+or on other hosts, run() simply interprets.
+*/
+class chip8_jit
+{
+
+    public:
+        // Attaches to machine so its memory writes invalidate translated code
+        explicit chip8_jit(chip8& machine);
+        ~chip8_jit();
+
+        // True when this host can execute generated code
+        static bool supported();
+
+        // Runs up to cycles instructions and says why it stopped as chip8::run() does
+        chip8::run_exit run(uint64_t cycles, uint64_t* ran = NULL, uint64_t* skipped = NULL);
+
+        // Drop every translated block, e.g. after a new ROM is loaded
+        void flush();
+
+        // Drop translated blocks covering a written address
+        void invalidate(uint16_t addr);
+
+    private:
+        chip8_jit(const chip8_jit&);
+        chip8_jit& operator=(const chip8_jit&);
+
+        // Runs generated code from code with at most budget instructions, returns the number retired
+        typedef uint32_t (*enter_fn)(chip8*, uint32_t budget, const uint8_t* code);
+
+        // What runs from a start address: translated code, or length instructions for chip8::run()
+        // when code is NULL. Length 0 means it hasn't been looked at yet
+        struct block
+        {
+            const uint8_t* code;
+            uint8_t length;
+
+            // Starts on an instruction that can begin an idle loop, see chip8::skipIdle()
+            bool idle;
+        };
+
+        static const int MAX_BLOCK = 32;
+        static const uint32_t ARENA_SIZE = 1 << 20;
+
+        void compile(uint16_t start);
+        void interpret(uint16_t start, uint8_t length);
+
+        // The shared entry and exit of generated code, at the start of the arena
+        void emitStubs();
+
+        chip8& machine;
+
+        block blocks[4096];
+
+        // Where generated code goes on to once it has set PC: the block at PC & 0xFFF, or leave
+        // back to run() when that isn't translated or starts an idle loop
+        const uint8_t* links[4096];
+        enter_fn enter;
+        const uint8_t* leave;
+
+        // Decoded instructions generated code passes to the interpreter's handlers, by address
+        chip8::instruction handled[4096];
+
+        // Non-zero for addresses some block was built from, so stores to data are cheap
+        uint8_t translated[4096];
+
+        uint8_t* arena;
+        uint32_t arenaUsed;
+
+};
+#endif
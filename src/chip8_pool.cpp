@@ -0,0 +1,326 @@
+#include "chip8_pool.h"
+#include "rom_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+
+static_assert(sizeof(rom_image::memory) == 4096, "chip8_pool pages cover a rom_image's memory");
+
+// posix_memalign, plain new doesn't align past 16 bytes before C++17
+static void* allocateAligned(size_t bytes)
+{
+    void* p = NULL;
+    if (posix_memalign(&p, 64, bytes) != 0) {
+        return NULL;
+    }
+    return p;
+}
+
+// Worst case per instance: every page, a display, a table, and the pages skipped lining their runs up
+static const size_t MOST_PAGES = 64 + 2 * 16 + 2 * 4;
+
+chip8_pool::chip8_pool(size_t capacity)
+    : slots(capacity), count(0), chunks((capacity * MOST_PAGES + CHUNK_PAGES - 1) / CHUNK_PAGES, (uint8_t*)NULL), nextPage(0)
+{
+    static_assert(PAGES + 2 * DISPLAY_PAGES + 2 * TABLE_PAGES == MOST_PAGES, "MOST_PAGES covers an instance");
+    static_assert(CHUNK_PAGES % DISPLAY_PAGES == 0 && CHUNK_PAGES % TABLE_PAGES == 0, "runs never straddle chunks");
+    instances = (instance*)allocateAligned(capacity * sizeof(instance));
+    if (!instances) {
+        std::cout << "Couldn't allocate a pool of " << capacity << " instances" << "\n";
+        slots = 0;
+    }
+}
+
+chip8_pool::~chip8_pool()
+{
+    for (size_t i = 0; i < chunks.size(); i++) {
+        free(chunks[i]);
+    }
+    free(instances);
+}
+
+size_t chip8_pool::instanceBytes()
+{
+    return sizeof(instance);
+}
+
+size_t chip8_pool::add(const rom_image& image, quirk_profile profile, uint64_t seed)
+{
+    if (count == slots) {
+        return FULL;
+    }
+    instance& s = instances[count];
+    memset(&s, 0, sizeof(s));
+    s.image = &image;
+    s.quirks = profile;
+    s.seed = seed;
+    s.table = NONE;
+    s.display = NONE;
+    s.dirtyRows = ~0ULL;
+    s.fresh = true;
+    return count++;
+}
+
+void chip8_pool::restart(size_t id)
+{
+    instance& s = instances[id];
+    releasePages(s);
+    memset(s.rows, 0, sizeof(s.rows));
+    memset(s.key, 0, sizeof(s.key));
+    s.highRes = false;
+    s.sound = 0;
+    s.dirtyRows = ~0ULL;
+    s.fresh = true;
+}
+
+uint32_t chip8_pool::allocateRun(uint32_t length)
+{
+    std::vector<uint32_t>& free = length == 1 ? freePages : length == DISPLAY_PAGES ? freeDisplays : freeTables;
+    if (!free.empty()) {
+        uint32_t first = free.back();
+        free.pop_back();
+        return first;
+    }
+    // Lined up on length, so a run stays in one chunk; the pages skipped are handed out singly
+    while (nextPage % length) {
+        freePages.push_back(nextPage++);
+    }
+    uint32_t first = nextPage;
+    nextPage += length;
+    uint8_t*& chunk = chunks[first / CHUNK_PAGES];
+    if (!chunk) {
+        chunk = (uint8_t*)allocateAligned(CHUNK_PAGES * PAGE);
+    }
+    return first;
+}
+
+void chip8_pool::freeRun(uint32_t first, uint32_t length)
+{
+    std::vector<uint32_t>& free = length == 1 ? freePages : length == DISPLAY_PAGES ? freeDisplays : freeTables;
+    free.push_back(first);
+}
+
+uint32_t chip8_pool::pageOf(const instance& s, unsigned p) const
+{
+    if (s.table != NONE) {
+        return ((const uint32_t*)page(s.table))[p];
+    }
+    return s.pages[__builtin_popcountll(s.ownPages & ((1ULL << p) - 1))];
+}
+
+void chip8_pool::allocatePages(instance& s, uint64_t wanted)
+{
+    std::lock_guard<std::mutex> hold(pageLock);
+    uint64_t owned = s.ownPages | wanted;
+    // Every page's place by page number, then back into the record or a table
+    uint32_t where[PAGES];
+    for (unsigned p = 0; p < PAGES; p++) {
+        if (wanted >> p & 1) {
+            where[p] = allocateRun(1);
+        } else if (s.ownPages >> p & 1) {
+            where[p] = pageOf(s, p);
+        }
+    }
+    if (s.table == NONE && __builtin_popcountll(owned) > INLINE_PAGES) {
+        s.table = allocateRun(TABLE_PAGES);
+    }
+    if (s.table != NONE) {
+        uint32_t* table = (uint32_t*)page(s.table);
+        for (unsigned p = 0; p < PAGES; p++) {
+            if (owned >> p & 1) {
+                table[p] = where[p];
+            }
+        }
+    } else {
+        unsigned rank = 0;
+        for (unsigned p = 0; p < PAGES; p++) {
+            if (owned >> p & 1) {
+                s.pages[rank++] = where[p];
+            }
+        }
+    }
+    s.ownPages = owned;
+}
+
+void chip8_pool::releasePages(instance& s)
+{
+    if (!s.ownPages && s.display == NONE) {
+        return;
+    }
+    std::lock_guard<std::mutex> hold(pageLock);
+    for (unsigned p = 0; p < PAGES; p++) {
+        if (s.ownPages >> p & 1) {
+            freeRun(pageOf(s, p), 1);
+        }
+    }
+    if (s.table != NONE) {
+        freeRun(s.table, TABLE_PAGES);
+    }
+    if (s.display != NONE) {
+        freeRun(s.display, DISPLAY_PAGES);
+    }
+    s.ownPages = 0;
+    s.table = NONE;
+    s.display = NONE;
+}
+
+void chip8_pool::load(size_t id, chip8& machine)
+{
+    const instance& s = instances[id];
+    if (machine.quirks() != (quirk_profile)s.quirks) {
+        machine.setQuirks((quirk_profile)s.quirks);
+    }
+    if (s.fresh) {
+        machine.seedRandom(s.seed);
+        machine.restart(*s.image);
+        memcpy(machine.key, s.key, sizeof(s.key));
+        // From here on it tracks the rows store() has to copy back
+        machine.dirtyRows = 0;
+        return;
+    }
+
+    // Same image as last time: only the pages the previous instance wrote are put back.
+    // Everything reset() would clear is overwritten below
+    machine.rebootImage(*s.image);
+    uint64_t pages = s.ownPages;
+    for (unsigned p = 0; pages; p++, pages >>= 1) {
+        if (pages & 1) {
+            memcpy(machine.memory + p * PAGE, page(pageOf(s, p)), PAGE);
+            machine.forgetPage(p);
+        }
+    }
+    // So the next restart() puts them back too
+    machine.dirtyPages |= s.ownPages;
+
+    machine.PC = s.PC;
+    machine.I = s.I;
+    machine.opcode = s.opcode;
+    machine.sp = s.sp;
+    memcpy(machine.stack, s.stack, sizeof(s.stack));
+    memcpy(machine.V, s.V, sizeof(s.V));
+    memcpy(machine.rplFlags, s.rplFlags, sizeof(s.rplFlags));
+    memcpy(machine.key, s.key, sizeof(s.key));
+    machine.delay_timer = s.delay;
+    machine.sound_timer = s.sound;
+    if (s.highRes) {
+        memcpy(machine.graphics, page(s.display), sizeof(machine.graphics));
+    } else {
+        // Low resolution leaves the second word and the bottom half blank
+        for (int y = 0; y < chip8::PIXEL_H; y++) {
+            machine.graphics[y][0] = s.rows[y];
+            machine.graphics[y][1] = 0;
+        }
+        memset(machine.graphics[chip8::PIXEL_H], 0, sizeof(machine.graphics) - sizeof(machine.graphics[0]) * chip8::PIXEL_H);
+    }
+    machine.highRes = s.highRes;
+    machine.drawFlag = s.drawFlag;
+    machine.dirtyRows = 0;
+    machine.randomState = s.randomState;
+    machine.frameCycles = s.frameCycles;
+    machine.breakAt = -1;
+}
+
+void chip8_pool::store(size_t id, const chip8& machine)
+{
+    instance& s = instances[id];
+    // Copy on first write: pages the machine wrote that aren't the instance's yet
+    uint64_t written = machine.dirtyPages & ~s.ownPages;
+    if (written) {
+        allocatePages(s, written);
+    }
+    uint64_t pages = machine.dirtyPages;
+    for (unsigned p = 0; pages; p++, pages >>= 1) {
+        if (pages & 1) {
+            memcpy(page(pageOf(s, p)), machine.memory + p * PAGE, PAGE);
+        }
+    }
+
+    s.PC = machine.PC;
+    s.I = machine.I;
+    s.opcode = machine.opcode;
+    s.sp = machine.sp;
+    memcpy(s.stack, machine.stack, sizeof(s.stack));
+    memcpy(s.V, machine.V, sizeof(s.V));
+    memcpy(s.rplFlags, machine.rplFlags, sizeof(s.rplFlags));
+    s.delay = machine.delay_timer;
+    s.sound = machine.sound_timer;
+    memcpy(s.key, machine.key, sizeof(s.key));
+    // Rows that didn't change are still what load() put in, unless the resolution changed
+    uint64_t rows = machine.dirtyRows;
+    if (machine.highRes) {
+        if (s.display == NONE) {
+            std::lock_guard<std::mutex> hold(pageLock);
+            s.display = allocateRun(DISPLAY_PAGES);
+            rows = ~0ULL;
+        }
+        uint64_t* display = (uint64_t*)page(s.display);
+        for (int y = 0; rows; y++, rows >>= 1) {
+            if (rows & 1) {
+                display[2 * y] = machine.graphics[y][0];
+                display[2 * y + 1] = machine.graphics[y][1];
+            }
+        }
+    } else {
+        if (s.display != NONE) {
+            std::lock_guard<std::mutex> hold(pageLock);
+            freeRun(s.display, DISPLAY_PAGES);
+            s.display = NONE;
+            rows = ~0ULL;
+        }
+        rows &= 0xFFFFFFFFULL;
+        for (int y = 0; rows; y++, rows >>= 1) {
+            if (rows & 1) {
+                s.rows[y] = machine.graphics[y][0];
+            }
+        }
+    }
+    s.dirtyRows |= machine.dirtyRows;
+    s.highRes = machine.highRes;
+    s.drawFlag = machine.drawFlag;
+    s.randomState = machine.randomState;
+    s.frameCycles = machine.frameCycles;
+    s.fresh = false;
+}
+
+chip8::run_exit chip8_pool::runFrame(size_t id, chip8& machine, unsigned ipf)
+{
+    load(id, machine);
+    chip8::run_exit why = machine.runUntilFrame(ipf);
+    store(id, machine);
+    return why;
+}
+
+size_t chip8_pool::copyFrame(size_t id, uint64_t* rows) const
+{
+    const instance& s = instances[id];
+    if (s.highRes) {
+        memcpy(rows, page(s.display), chip8::FRAME_WORDS * sizeof(uint64_t));
+        return chip8::FRAME_WORDS;
+    }
+    memcpy(rows, s.rows, sizeof(s.rows));
+    return chip8::PIXEL_H;
+}
+
+uint64_t chip8_pool::takeDirtyRows(size_t id)
+{
+    uint64_t rows = instances[id].dirtyRows;
+    instances[id].dirtyRows = 0;
+    return rows;
+}
+
+uint8_t chip8_pool::read(size_t id, uint16_t addr) const
+{
+    const instance& s = instances[id];
+    addr &= 0xFFF;
+    unsigned p = addr >> PAGE_SHIFT;
+    if (s.ownPages >> p & 1) {
+        return page(pageOf(s, p))[addr & (PAGE - 1)];
+    }
+    return s.image->memory[addr];
+}
+
+size_t chip8_pool::privatePages()
+{
+    std::lock_guard<std::mutex> hold(pageLock);
+    return nextPage - freePages.size() - freeDisplays.size() * DISPLAY_PAGES - freeTables.size() * TABLE_PAGES;
+}
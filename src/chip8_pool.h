@@ -0,0 +1,165 @@
+#ifndef CHIP8_POOL
+#define CHIP8_POOL
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+#include "chip8.h"
+
+struct rom_image;
+
+/*
+Many parked machines in little memory, e.g. hundreds of thousands of
+sessions of a few ROMs. An instance only holds what differs between
+instances: registers, stack, timers, keys and a low resolution display,
+packed into one cache-aligned record in a single array. Its memory is the
+rom_image it booted from, shared read-only with every other instance of that
+ROM, plus a private copy of each 64-byte page it has written to (Fx33, Fx55).
+A page is copied on its first write and instances that never write one never
+pay for it. The same page storage holds what few instances need: a high
+resolution display from 00FF until 00FE, and the table of an instance's
+pages once it has written more than fit in its record.
+
+Instances run in a chip8 of the caller's, one per thread: load() restores an
+instance into it, store() takes it back. Loading an instance of the ROM the
+machine ran last only rewrites the pages either of them changed, so the
+machine's decode cache stays warm across instances.
+
+add() is not thread safe. Everything else is, as long as no two threads use
+the same instance or the same machine.
+*/
+class chip8_pool
+{
+
+    public:
+        explicit chip8_pool(size_t capacity);
+        ~chip8_pool();
+
+        // add() once capacity instances exist
+        static const size_t FULL = (size_t)-1;
+
+        // New instance booted from image, which must outlive the pool (a rom_cache's do)
+        size_t add(const rom_image& image, quirk_profile profile = QUIRKS_VIP, uint64_t seed = 0);
+
+        // Power an instance back on with its ROM, handing its private pages back to the pool
+        void restart(size_t id);
+
+        size_t size() const { return count; }
+        size_t capacity() const { return slots; }
+
+        // Put instance id into machine, replacing whatever ran there. Until store(),
+        // the machine's takeDirtyRows() only covers rows changed since this call
+        void load(size_t id, chip8& machine);
+
+        // Take instance id back from machine after it ran, copying the pages it wrote
+        void store(size_t id, const chip8& machine);
+
+        // load(), runUntilFrame(ipf), store()
+        chip8::run_exit runFrame(size_t id, chip8& machine, unsigned ipf);
+
+        // Key state of an instance, written directly by the caller
+        uint8_t* keys(size_t id) { return instances[id].key; }
+
+        // As chip8::copyFrame() and friends, for a stored instance
+        size_t copyFrame(size_t id, uint64_t* rows) const;
+        bool hires(size_t id) const { return instances[id].highRes; }
+        bool soundOn(size_t id) const { return instances[id].sound > 0; }
+        uint64_t takeDirtyRows(size_t id);
+
+        // Byte at addr of an instance's memory
+        uint8_t read(size_t id, uint16_t addr) const;
+
+        // Bytes one instance takes, not counting its private pages
+        static size_t instanceBytes();
+
+        // Pages handed out, 64 bytes each, high resolution displays and page tables included
+        size_t privatePages();
+
+    private:
+        chip8_pool(const chip8_pool&);
+        chip8_pool& operator=(const chip8_pool&);
+
+        static const unsigned PAGE_SHIFT = chip8::PAGE_SHIFT;
+        static const size_t PAGE = (size_t)1 << PAGE_SHIFT;
+        static const size_t PAGES = 4096 / PAGE;
+
+        // Pages allocated this many at a time, and never move once handed out
+        static const size_t CHUNK_PAGES = 1024;
+
+        // Runs of pages for a high resolution display and for a spilled page table
+        static const uint32_t DISPLAY_PAGES = sizeof(chip8::graphics) / PAGE;
+        static const uint32_t TABLE_PAGES = PAGES * sizeof(uint32_t) / PAGE;
+
+        // Private pages kept in the record, in the order of their page numbers
+        static const unsigned INLINE_PAGES = 4;
+
+        static const uint32_t NONE = (uint32_t)-1;
+
+        struct alignas(64) instance
+        {
+            // Low resolution rows, the first word of chip8::graphics
+            uint64_t rows[chip8::PIXEL_H];
+
+            // Pages written, where each one is kept: pages[] holds them by rank among ownPages
+            // until there are more than INLINE_PAGES, then table indexes a run of TABLE_PAGES
+            // holding one entry per page number
+            uint64_t ownPages;
+            uint32_t pages[INLINE_PAGES];
+            uint32_t table;
+
+            // First of DISPLAY_PAGES holding chip8::graphics while highRes, NONE otherwise
+            uint32_t display;
+
+            const rom_image* image;
+            uint64_t seed;
+            uint64_t randomState;
+            uint64_t dirtyRows;
+            uint32_t frameCycles;
+
+            uint16_t PC;
+            uint16_t I;
+            uint16_t opcode;
+            uint16_t sp;
+            uint16_t stack[16];
+            uint8_t V[16];
+            uint8_t key[16];
+            uint8_t rplFlags[16];
+            uint8_t delay;
+            uint8_t sound;
+            uint8_t quirks;
+            bool highRes;
+            bool drawFlag;
+
+            // Not run since add() or restart(), load() boots it instead
+            bool fresh;
+        };
+
+        uint8_t* page(uint32_t n) const { return chunks[n / CHUNK_PAGES] + (n % CHUNK_PAGES) * PAGE; }
+
+        // Where the instance keeps page p, which must be in ownPages
+        uint32_t pageOf(const instance& s, unsigned p) const;
+
+        // Give an instance a private copy of every page in wanted it doesn't have yet
+        void allocatePages(instance& s, uint64_t wanted);
+
+        // length consecutive pages, within one chunk, and back. Callers hold pageLock
+        uint32_t allocateRun(uint32_t length);
+        void freeRun(uint32_t first, uint32_t length);
+
+        // Every page the instance holds back to the pool
+        void releasePages(instance& s);
+
+        instance* instances;
+        size_t slots;
+        size_t count;
+
+        // Sized for every page of every instance up front, so readers never see it move
+        std::vector<uint8_t*> chunks;
+        std::vector<uint32_t> freePages;
+        std::vector<uint32_t> freeDisplays;
+        std::vector<uint32_t> freeTables;
+        uint32_t nextPage;
+        std::mutex pageLock;
+
+};
+#endif
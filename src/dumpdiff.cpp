@@ -0,0 +1,96 @@
+#include "frame_dump.h"
+#include <iostream>
+
+/*
+Compares a frame dump against a golden one. A dump only has records for
+frames that changed, so at any frame number each side shows its latest
+record at or before it. Records with equal hashes are taken as equal, only
+the frames where the hashes differ are decoded and compared pixel by pixel.
+Exits with 0 when the dumps match, 1 when they differ and 2 on errors.
+*/
+
+// Differing frames listed before the summary
+static const int MAX_LISTED = 10;
+
+static int popcount(uint64_t v)
+{
+    int n = 0;
+    for (; v; v &= v - 1) {
+        n++;
+    }
+    return n;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3) {
+        std::cout << "Usage ./chip8-dumpdiff golden.c8fd actual.c8fd" << std::endl;
+        return 2;
+    }
+    frame_reader golden;
+    frame_reader actual;
+    if (!golden.load(argv[1]) || !actual.load(argv[2])) {
+        return 2;
+    }
+    if (golden.dropped() || actual.dropped()) {
+        std::cout << "Warning: frames were dropped while capturing (" << golden.dropped() << " golden, "
+                  << actual.dropped() << " actual)" << std::endl;
+    }
+
+    const std::vector<frame_index_entry>& g = golden.entries();
+    const std::vector<frame_index_entry>& a = actual.entries();
+    // Next unvisited record on each side, and each side's record as of the current frame
+    const size_t NONE = (size_t)-1;
+    size_t gi = 0;
+    size_t ai = 0;
+    size_t gr = NONE;
+    size_t ar = NONE;
+    uint64_t differing = 0;
+    uint64_t decoded = 0;
+    while (gi < g.size() || ai < a.size()) {
+        uint32_t frame = ai == a.size() || (gi < g.size() && g[gi].frame <= a[ai].frame) ? g[gi].frame : a[ai].frame;
+        while (gi < g.size() && g[gi].frame <= frame) {
+            gr = gi++;
+        }
+        while (ai < a.size() && a[ai].frame <= frame) {
+            ar = ai++;
+        }
+
+        // Before a side's first record it has nothing to show
+        bool gHas = gr != NONE;
+        bool aHas = ar != NONE;
+        if (gHas && aHas && g[gr].hash == a[ar].hash && g[gr].hires == a[ar].hires) {
+            continue;
+        }
+        differing++;
+        if (differing > MAX_LISTED) {
+            continue;
+        }
+        if (!gHas || !aHas) {
+            std::cout << "frame " << frame << ": only in " << (gHas ? "golden" : "actual") << std::endl;
+            continue;
+        }
+        uint64_t gRows[chip8::FRAME_WORDS];
+        uint64_t aRows[chip8::FRAME_WORDS];
+        size_t gWords = golden.decode(gr, gRows);
+        size_t aWords = actual.decode(ar, aRows);
+        decoded += 2;
+        if (!gWords || !aWords) {
+            std::cout << "frame " << frame << ": couldn't be decoded" << std::endl;
+            return 2;
+        }
+        if (gWords != aWords) {
+            std::cout << "frame " << frame << ": resolution differs" << std::endl;
+            continue;
+        }
+        int pixels = 0;
+        for (size_t w = 0; w < gWords; w++) {
+            pixels += popcount(gRows[w] ^ aRows[w]);
+        }
+        std::cout << "frame " << frame << ": " << pixels << " pixels differ" << std::endl;
+    }
+
+    std::cout << g.size() << " golden and " << a.size() << " actual records, " << differing
+              << " frames differ, " << decoded << " records decoded" << std::endl;
+    return differing ? 1 : 0;
+}
@@ -0,0 +1,325 @@
+#include "frame_dump.h"
+#include <string.h>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+static const uint8_t DUMP_MAGIC[4] = { 'C', '8', 'F', 'D' };
+static const uint8_t INDEX_MAGIC[4] = { 'C', '8', 'F', 'I' };
+static const uint32_t DUMP_VERSION = 1;
+static const size_t HEADER_SIZE = 16;
+static const size_t RECORD_SIZE = 12;
+static const size_t ENTRY_SIZE = 24;
+static const size_t FOOTER_SIZE = 28;
+
+// Record flags
+static const uint8_t KEYFRAME = 0x01;
+static const uint8_t HIRES = 0x02;
+
+static const size_t FRAME_BYTES = chip8::FRAME_WORDS * 8;
+
+// How long the writer sleeps when nothing is queued
+static const std::chrono::microseconds WRITER_IDLE(100);
+
+static void putLE(uint8_t* p, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        p[i] = (v >> (8 * i)) & 0xFF;
+    }
+}
+
+static uint64_t getLE(const uint8_t* p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++) {
+        v |= (uint64_t)p[i] << (8 * i);
+    }
+    return v;
+}
+
+uint64_t hashFrameWords(const uint64_t* rows, size_t words)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t w = 0; w < words; w++) {
+        for (int b = 0; b < 8; b++) {
+            hash ^= (rows[w] >> (8 * b)) & 0xFF;
+            hash *= 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+// A literal run only ends at two zeros in a row, a lone zero is cheaper kept in it
+void encodeRuns(const uint8_t* data, size_t size, std::vector<uint8_t>& out)
+{
+    out.clear();
+    size_t i = 0;
+    while (i < size) {
+        size_t start = i;
+        if (data[i] == 0) {
+            while (i < size && data[i] == 0 && i - start < 128) {
+                i++;
+            }
+            out.push_back((uint8_t)(i - start - 1));
+            continue;
+        }
+        while (i < size && i - start < 128 && !(data[i] == 0 && (i + 1 == size || data[i + 1] == 0))) {
+            i++;
+        }
+        out.push_back((uint8_t)(0x7F + i - start));
+        out.insert(out.end(), data + start, data + i);
+    }
+}
+
+bool decodeRuns(const uint8_t* data, size_t size, uint8_t* out, size_t outSize)
+{
+    size_t o = 0;
+    size_t i = 0;
+    while (i < size) {
+        uint8_t c = data[i++];
+        if (c < 0x80) {
+            if (o + c + 1 > outSize) {
+                return false;
+            }
+            memset(out + o, 0, c + 1);
+            o += c + 1;
+        } else {
+            size_t n = c - 0x7F;
+            if (o + n > outSize || i + n > size) {
+                return false;
+            }
+            memcpy(out + o, data + i, n);
+            o += n;
+            i += n;
+        }
+    }
+    return o == outSize;
+}
+
+frame_dump::frame_dump()
+    : closing(false), started(false), waitForSlots(false), droppedFrames(0), out(NULL), interval(1), sinceKeyframe(0), offset(0), failed(false)
+{
+}
+
+frame_dump::~frame_dump()
+{
+    close();
+}
+
+bool frame_dump::open(const char* file, unsigned keyframeInterval, bool lossless)
+{
+    close();
+    out = fopen(file, "wb");
+    if (!out) {
+        std::cout << "Couldn't open " << file << " for writing" << "\n";
+        return false;
+    }
+
+    uint8_t header[HEADER_SIZE];
+    memcpy(header, DUMP_MAGIC, 4);
+    putLE(header + 4, DUMP_VERSION, 4);
+    putLE(header + 8, keyframeInterval, 4);
+    putLE(header + 12, 0, 4);
+    failed = fwrite(header, 1, sizeof(header), out) != sizeof(header);
+    offset = sizeof(header);
+
+    // Slots all come back to freeSlots by close(), so the pool is only filled once
+    if (pool.empty()) {
+        pool.resize(POOL_FRAMES);
+        for (uint32_t i = 0; i < POOL_FRAMES; i++) {
+            freeSlots.write(&i, 1);
+        }
+    }
+    interval = keyframeInterval ? keyframeInterval : 1;
+    sinceKeyframe = 0;
+    started = false;
+    waitForSlots = lossless;
+    droppedFrames = 0;
+    index.clear();
+    closing.store(false, std::memory_order_relaxed);
+    writer = std::thread(&frame_dump::drain, this);
+    return true;
+}
+
+void frame_dump::capture(chip8& machine, uint32_t frame)
+{
+    if (!out || (started && !machine.drawFlag)) {
+        return;
+    }
+    started = true;
+    machine.drawFlag = false;
+
+    uint32_t i;
+    while (!freeSlots.read(&i, 1)) {
+        if (!waitForSlots) {
+            droppedFrames++;
+            return;
+        }
+        std::this_thread::yield();
+    }
+    slot& s = pool[i];
+    s.frame = frame;
+    s.hires = machine.hires();
+    s.words = machine.copyFrame(s.rows);
+    fullSlots.write(&i, 1);
+}
+
+void frame_dump::drain()
+{
+    for (;;) {
+        // Read before draining: once it's set, everything capture() queued is already visible
+        bool last = closing.load(std::memory_order_acquire);
+        uint32_t i;
+        while (fullSlots.read(&i, 1)) {
+            write(pool[i]);
+            freeSlots.write(&i, 1);
+        }
+        if (last) {
+            return;
+        }
+        std::this_thread::sleep_for(WRITER_IDLE);
+    }
+}
+
+void frame_dump::write(const slot& s)
+{
+    bool first = index.empty();
+    if (!first && s.hires == previous.hires && memcmp(s.rows, previous.rows, s.words * 8) == 0) {
+        // Drawn over with the same pixels
+        return;
+    }
+    bool key = first || sinceKeyframe == 0 || s.hires != previous.hires;
+
+    uint8_t bytes[FRAME_BYTES];
+    for (uint32_t w = 0; w < s.words; w++) {
+        putLE(bytes + 8 * w, key ? s.rows[w] : s.rows[w] ^ previous.rows[w], 8);
+    }
+    encodeRuns(bytes, s.words * 8, encoded);
+
+    frame_index_entry entry = { s.frame, key, s.hires, offset, hashFrameWords(s.rows, s.words) };
+    index.push_back(entry);
+
+    uint8_t record[RECORD_SIZE];
+    putLE(record, s.frame, 4);
+    record[4] = (key ? KEYFRAME : 0) | (s.hires ? HIRES : 0);
+    record[5] = 0;
+    putLE(record + 6, 0, 2);
+    putLE(record + 8, encoded.size(), 4);
+    failed |= fwrite(record, 1, sizeof(record), out) != sizeof(record);
+    failed |= fwrite(encoded.data(), 1, encoded.size(), out) != encoded.size();
+    offset += sizeof(record) + encoded.size();
+
+    sinceKeyframe = (key ? 1 : sinceKeyframe + 1) % interval;
+    previous = s;
+}
+
+bool frame_dump::close()
+{
+    if (!out) {
+        return true;
+    }
+    closing.store(true, std::memory_order_release);
+    writer.join();
+
+    uint64_t indexOffset = offset;
+    for (size_t i = 0; i < index.size(); i++) {
+        uint8_t entry[ENTRY_SIZE];
+        putLE(entry, index[i].frame, 4);
+        entry[4] = index[i].keyframe;
+        entry[5] = index[i].hires;
+        putLE(entry + 6, 0, 2);
+        putLE(entry + 8, index[i].offset, 8);
+        putLE(entry + 16, index[i].hash, 8);
+        failed |= fwrite(entry, 1, sizeof(entry), out) != sizeof(entry);
+    }
+    uint8_t footer[FOOTER_SIZE];
+    putLE(footer, indexOffset, 8);
+    putLE(footer + 8, index.size(), 4);
+    putLE(footer + 12, 0, 4);
+    putLE(footer + 16, droppedFrames, 8);
+    memcpy(footer + 24, INDEX_MAGIC, 4);
+    failed |= fwrite(footer, 1, sizeof(footer), out) != sizeof(footer);
+
+    failed |= fclose(out) != 0;
+    out = NULL;
+    return !failed;
+}
+
+bool frame_reader::load(const char* file)
+{
+    std::ifstream in(file, std::ios::in | std::ios::binary);
+    if (!in.is_open()) {
+        std::cout << "Couldn't open " << file << "\n";
+        return false;
+    }
+    data.assign((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    index.clear();
+    haveCurrent = false;
+
+    if (data.size() < HEADER_SIZE + FOOTER_SIZE || memcmp(data.data(), DUMP_MAGIC, 4) != 0) {
+        std::cout << file << " isn't a frame dump" << "\n";
+        return false;
+    }
+    uint32_t version = getLE(&data[4], 4);
+    if (version != DUMP_VERSION) {
+        std::cout << "Frame dump version " << version << " isn't supported" << "\n";
+        return false;
+    }
+    const uint8_t* footer = &data[data.size() - FOOTER_SIZE];
+    uint64_t indexOffset = getLE(footer, 8);
+    uint64_t count = getLE(footer + 8, 4);
+    if (memcmp(footer + 24, INDEX_MAGIC, 4) != 0 || indexOffset < HEADER_SIZE ||
+        indexOffset + count * ENTRY_SIZE != data.size() - FOOTER_SIZE) {
+        std::cout << file << " has no index, it was probably cut short" << "\n";
+        return false;
+    }
+    droppedFrames = getLE(footer + 16, 8);
+
+    for (uint64_t i = 0; i < count; i++) {
+        const uint8_t* p = &data[indexOffset + i * ENTRY_SIZE];
+        frame_index_entry e = { (uint32_t)getLE(p, 4), p[4], p[5], getLE(p + 8, 8), getLE(p + 16, 8) };
+        if (e.offset + RECORD_SIZE > indexOffset || (i == 0 && !e.keyframe)) {
+            std::cout << file << " is corrupt" << "\n";
+            return false;
+        }
+        index.push_back(e);
+    }
+    return true;
+}
+
+size_t frame_reader::decode(size_t n, uint64_t* out)
+{
+    if (n >= index.size()) {
+        return 0;
+    }
+    // Carry on from the last decode if no keyframe lies between, otherwise start at the keyframe
+    size_t start = n;
+    while (!index[start].keyframe) {
+        start--;
+    }
+    size_t from = haveCurrent && current >= start && current <= n ? current + 1 : start;
+
+    uint8_t bytes[FRAME_BYTES];
+    for (size_t r = from; r <= n; r++) {
+        const frame_index_entry& e = index[r];
+        const uint8_t* record = &data[e.offset];
+        size_t size = getLE(record + 8, 4);
+        size_t recordWords = (record[4] & HIRES) ? chip8::FRAME_WORDS : chip8::PIXEL_W / 64 * chip8::PIXEL_H;
+        bool key = (record[4] & KEYFRAME) != 0;
+        bool sized = e.offset + RECORD_SIZE + size <= data.size() && (key || recordWords == words);
+        if (!sized || !decodeRuns(record + RECORD_SIZE, size, bytes, recordWords * 8)) {
+            haveCurrent = false;
+            return 0;
+        }
+        for (size_t w = 0; w < recordWords; w++) {
+            uint64_t v = getLE(bytes + 8 * w, 8);
+            rows[w] = key ? v : rows[w] ^ v;
+        }
+        words = recordWords;
+    }
+    current = n;
+    haveCurrent = true;
+    memcpy(out, rows, words * sizeof(rows[0]));
+    return words;
+}
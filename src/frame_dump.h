@@ -0,0 +1,143 @@
+#ifndef FRAME_DUMP
+#define FRAME_DUMP
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "chip8.h"
+#include "spsc_ring.h"
+
+/*
+Display output of a headless run. A dump starts with a header, then holds
+one record per captured frame whose pixels differ from the previous record:
+the frame number, whether it's a keyframe, the resolution, and the frame's
+bytes (rows of little-endian 64-bit words, as chip8::copyFrame() lays them
+out) run-length encoded. Delta records encode the XOR with the previous
+record, which is mostly zeros; a keyframe every keyframeInterval records, and
+on every change of resolution, encodes the frame itself so decoding can
+start there.
+
+The file ends with an index: frame number, kind, offset and FNV-1a hash of
+every record. Comparing two dumps compares the hashes and only decodes the
+frames that differ.
+*/
+
+struct frame_index_entry
+{
+    uint32_t frame;
+    uint8_t keyframe;
+    uint8_t hires;
+    uint64_t offset;
+    uint64_t hash;
+};
+
+/*
+Run-length code for frame bytes that are mostly zero: a control byte c below
+0x80 stands for c + 1 zero bytes, from 0x80 up it's followed by c - 0x7F
+literal bytes. decodeRuns() is false unless data decodes to exactly outSize
+bytes.
+*/
+void encodeRuns(const uint8_t* data, size_t size, std::vector<uint8_t>& out);
+bool decodeRuns(const uint8_t* data, size_t size, uint8_t* out, size_t outSize);
+
+// FNV-1a over the bytes of a frame, the same hash chip8-batch reports on little-endian hosts
+uint64_t hashFrameWords(const uint64_t* rows, size_t words);
+
+/*
+Writer. The emulation thread copies each frame into a slot from a fixed pool
+and queues it; a writer thread encodes and writes it and hands the slot back.
+Capturing never waits: with every slot queued, the frame is dropped and
+counted, the next one is encoded against whatever was written last. Runs
+whose dumps are compared against golden ones open it lossless instead, and
+only then does capture() wait for the writer to free a slot.
+*/
+class frame_dump
+{
+
+    public:
+        frame_dump();
+        ~frame_dump();
+
+        bool open(const char* file, unsigned keyframeInterval = 60, bool lossless = false);
+
+        // Emulation thread, once per vblank: queue the display as frame if anything was drawn since the last call
+        void capture(chip8& machine, uint32_t frame);
+
+        // Write what's queued and the index, false if anything failed to write
+        bool close();
+
+        // Frames capture() couldn't queue, final once close() returns
+        uint64_t dropped() const { return droppedFrames; }
+
+        bool isOpen() const { return out != NULL; }
+
+    private:
+        frame_dump(const frame_dump&);
+        frame_dump& operator=(const frame_dump&);
+
+        static const uint32_t POOL_FRAMES = 256;
+
+        struct slot
+        {
+            uint32_t frame;
+            uint32_t words;
+            bool hires;
+            uint64_t rows[chip8::FRAME_WORDS];
+        };
+
+        // Writer thread
+        void drain();
+        void write(const slot& s);
+
+        std::vector<slot> pool;
+        spsc_ring<uint32_t, POOL_FRAMES> freeSlots;
+        spsc_ring<uint32_t, POOL_FRAMES> fullSlots;
+        std::thread writer;
+        std::atomic<bool> closing;
+        bool started;
+        bool waitForSlots;
+        uint64_t droppedFrames;
+
+        // Set by open() and cleared by close(), written to by the writer thread in between
+        FILE* out;
+
+        // Only touched by the writer thread until close() joins it
+        unsigned interval;
+        unsigned sinceKeyframe;
+        uint64_t offset;
+        bool failed;
+        slot previous;
+        std::vector<uint8_t> encoded;
+        std::vector<frame_index_entry> index;
+
+};
+
+// Reader, for comparing dumps
+class frame_reader
+{
+
+    public:
+        bool load(const char* file);
+
+        const std::vector<frame_index_entry>& entries() const { return index; }
+
+        // Decode record n of entries() into rows, returns the words written or 0 if it's corrupt
+        size_t decode(size_t n, uint64_t* rows);
+
+        uint64_t dropped() const { return droppedFrames; }
+
+    private:
+        std::vector<uint8_t> data;
+        std::vector<frame_index_entry> index;
+        uint64_t droppedFrames = 0;
+
+        // Last record decoded, sequential reads continue from it
+        size_t current = 0;
+        bool haveCurrent = false;
+        uint64_t rows[chip8::FRAME_WORDS];
+        size_t words = 0;
+
+};
+#endif
@@ -0,0 +1,282 @@
+#include "frame_server.h"
+#include "frame_dump.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <iostream>
+
+#ifdef MSG_NOSIGNAL
+static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+static const int SEND_FLAGS = 0;
+#endif
+
+static const size_t MESSAGE_SIZE = 4;
+
+// Kernel buffering per client, a few updates, so a stalled client's backlog stays small
+static const int CLIENT_SEND_BUFFER = 8192;
+static const size_t UPDATE_HEADER_SIZE = 18;
+
+// Update flags
+static const uint8_t HIRES = 0x01;
+static const uint8_t KEYFRAME = 0x02;
+
+static void putLE(uint8_t* p, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        p[i] = (v >> (8 * i)) & 0xFF;
+    }
+}
+
+static bool setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+frame_server::frame_server() : listener(-1)
+{
+}
+
+frame_server::~frame_server()
+{
+    for (size_t i = 0; i < clients.size(); i++) {
+        close(clients[i].fd);
+    }
+    if (listener >= 0) {
+        close(listener);
+        unlink(socketPath.c_str());
+    }
+}
+
+bool frame_server::listen(const char* path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        std::cout << "Socket path " << path << " is too long" << "\n";
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || !setNonBlocking(listener)) {
+        std::cout << "Couldn't create a socket" << "\n";
+        return false;
+    }
+    unlink(path);
+    if (bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(listener, 16) != 0) {
+        std::cout << "Couldn't listen on " << path << "\n";
+        close(listener);
+        listener = -1;
+        return false;
+    }
+    socketPath = path;
+    return true;
+}
+
+void frame_server::addSession(const std::string& name, chip8* machine)
+{
+    session s = { name, machine, 0, 0 };
+    sessions.push_back(s);
+}
+
+void frame_server::frameDone()
+{
+    for (size_t i = 0; i < sessions.size(); i++) {
+        sessions[i].frame++;
+        if (sessions[i].machine->takeDirtyRows()) {
+            sessions[i].version++;
+        }
+    }
+}
+
+void frame_server::accept()
+{
+    for (;;) {
+        int fd = ::accept(listener, NULL, NULL);
+        if (fd < 0) {
+            return;
+        }
+        if (!setNonBlocking(fd)) {
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &CLIENT_SEND_BUFFER, sizeof(CLIENT_SEND_BUFFER));
+        clients.push_back(client());
+        client& c = clients.back();
+        c.fd = fd;
+        c.session = -1;
+        c.sentVersion = 0;
+        c.sentAny = false;
+        c.sentHires = false;
+        c.outPos = 0;
+
+        // Session list
+        c.out.push_back('I');
+        c.out.push_back((uint8_t)sessions.size());
+        for (size_t i = 0; i < sessions.size(); i++) {
+            size_t length = sessions[i].name.size() < 255 ? sessions[i].name.size() : 255;
+            c.out.push_back((uint8_t)length);
+            c.out.insert(c.out.end(), sessions[i].name.begin(), sessions[i].name.begin() + length);
+        }
+    }
+}
+
+bool frame_server::receive(client& c)
+{
+    uint8_t buffer[256];
+    for (;;) {
+        ssize_t n = recv(c.fd, buffer, sizeof(buffer), 0);
+        if (n == 0) {
+            return false;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
+            }
+            return false;
+        }
+        c.in.insert(c.in.end(), buffer, buffer + n);
+    }
+
+    size_t i = 0;
+    for (; i + MESSAGE_SIZE <= c.in.size(); i += MESSAGE_SIZE) {
+        const uint8_t* m = &c.in[i];
+        if (m[0] == 'W') {
+            // A new watcher starts from a keyframe
+            c.session = m[1] < sessions.size() ? m[1] : -1;
+            c.sentAny = false;
+        } else if (m[0] == 'K' && c.session >= 0 && m[1] < 16) {
+            sessions[c.session].machine->key[m[1]] = m[2] ? 1 : 0;
+        }
+    }
+    c.in.erase(c.in.begin(), c.in.begin() + i);
+    return true;
+}
+
+bool frame_server::flush(client& c)
+{
+    while (c.outPos < c.out.size()) {
+        ssize_t n = send(c.fd, &c.out[c.outPos], c.out.size() - c.outPos, SEND_FLAGS);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        c.outPos += n;
+    }
+    c.out.clear();
+    c.outPos = 0;
+    return true;
+}
+
+void frame_server::update(client& c)
+{
+    // An update still in the socket is replaced by the latest frame once it drains
+    if (c.session < 0 || !c.out.empty()) {
+        return;
+    }
+    const session& s = sessions[c.session];
+    if (c.sentAny && c.sentVersion == s.version) {
+        return;
+    }
+    const chip8& m = *s.machine;
+    uint64_t rows[chip8::FRAME_WORDS];
+    m.copyFrame(rows);
+    int perRow = m.width() / 64;
+    bool key = !c.sentAny || c.sentHires != m.hires();
+
+    uint64_t changed = 0;
+    uint8_t bytes[chip8::FRAME_WORDS * 8];
+    size_t size = 0;
+    for (int y = 0; y < m.height(); y++) {
+        bool differs = key;
+        for (int w = 0; w < perRow && !differs; w++) {
+            differs = rows[y * perRow + w] != c.sent[y * perRow + w];
+        }
+        if (!differs) {
+            continue;
+        }
+        changed |= 1ULL << y;
+        for (int w = 0; w < perRow; w++) {
+            putLE(bytes + size, key ? rows[y * perRow + w] : rows[y * perRow + w] ^ c.sent[y * perRow + w], 8);
+            size += 8;
+        }
+    }
+    c.sentVersion = s.version;
+    if (!changed) {
+        // Drawn back to what this client already has
+        return;
+    }
+    encodeRuns(bytes, size, encoded);
+
+    uint8_t header[UPDATE_HEADER_SIZE];
+    header[0] = 'F';
+    header[1] = (uint8_t)c.session;
+    header[2] = (m.hires() ? HIRES : 0) | (key ? KEYFRAME : 0);
+    header[3] = 0;
+    putLE(header + 4, s.frame, 4);
+    putLE(header + 8, changed, 8);
+    putLE(header + 16, encoded.size(), 2);
+    c.out.insert(c.out.end(), header, header + sizeof(header));
+    c.out.insert(c.out.end(), encoded.begin(), encoded.end());
+
+    memcpy(c.sent, rows, sizeof(rows));
+    c.sentHires = m.hires();
+    c.sentAny = true;
+}
+
+void frame_server::poll(int timeoutMs)
+{
+    if (listener < 0) {
+        return;
+    }
+    // Updates for the frame that just ran go out before waiting
+    std::vector<bool> alive(clients.size(), true);
+    for (size_t i = 0; i < clients.size(); i++) {
+        update(clients[i]);
+        alive[i] = flush(clients[i]);
+    }
+
+    std::vector<pollfd> fds(clients.size() + 1);
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    for (size_t i = 0; i < clients.size(); i++) {
+        fds[i + 1].fd = clients[i].fd;
+        fds[i + 1].events = POLLIN | (clients[i].out.empty() ? 0 : POLLOUT);
+    }
+    if (::poll(fds.data(), fds.size(), timeoutMs) > 0) {
+        for (size_t i = 0; i < clients.size(); i++) {
+            short events = fds[i + 1].revents;
+            if (alive[i] && (events & (POLLIN | POLLHUP | POLLERR))) {
+                alive[i] = receive(clients[i]);
+            }
+            if (alive[i] && (events & POLLOUT)) {
+                alive[i] = flush(clients[i]);
+            }
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < clients.size(); i++) {
+        if (alive[i]) {
+            clients[kept++] = clients[i];
+        } else {
+            close(clients[i].fd);
+        }
+    }
+    clients.resize(kept);
+
+    if (fds[0].revents & POLLIN) {
+        accept();
+    }
+    // A client whose socket failed here is dropped by the next poll()
+    for (size_t i = 0; i < clients.size(); i++) {
+        update(clients[i]);
+        flush(clients[i]);
+    }
+}
@@ -0,0 +1,91 @@
+#ifndef FRAME_SERVER
+#define FRAME_SERVER
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "chip8.h"
+
+/*
+Streams the displays of running machines to local clients over a Unix domain
+socket, and takes their key presses back. Everything is little-endian.
+
+On connecting a client is sent the session list:
+    'I', session count, then per session its name's length and the name
+
+Clients send 4-byte messages:
+    'W', session, 0, 0          watch a session (and stop watching the last one)
+    'K', key, down, 0           press (down 1) or release a key of the watched session
+
+Watchers are sent frame updates:
+    'F', session, flags, 0, frame (u32), changed rows (u64), size (u16), data
+flags bit 0 is high resolution, bit 1 a keyframe. data is the XOR of each
+changed row (width / 64 words) with what the client was sent before,
+run-length coded with encodeRuns(); a keyframe XORs with a blank display,
+so it holds the changed rows' pixels directly.
+
+A session is only looked at after frames where DXYN, 00E0 or a scroll
+actually changed pixels. Each client has at most one update on its way: one
+that hasn't drained from the socket by the time the next change comes along
+is followed by a single update to the latest frame, never a backlog.
+*/
+class frame_server
+{
+
+    public:
+        frame_server();
+        ~frame_server();
+
+        // Listen at path, replacing a stale socket left there
+        bool listen(const char* path);
+
+        // Serve machine as the next session number, it stays owned by the caller
+        void addSession(const std::string& name, chip8* machine);
+
+        // After every session has run a frame: note which displays changed, takes their dirty rows
+        void frameDone();
+
+        // Accept clients, read keys and send updates for up to timeoutMs
+        void poll(int timeoutMs);
+
+        size_t clientCount() const { return clients.size(); }
+
+    private:
+        frame_server(const frame_server&);
+        frame_server& operator=(const frame_server&);
+
+        struct session
+        {
+            std::string name;
+            chip8* machine;
+            uint32_t frame;
+            // Bumped on each frame that changed pixels
+            uint64_t version;
+        };
+
+        struct client
+        {
+            int fd;
+            int session;
+            uint64_t sentVersion;
+            bool sentAny;
+            bool sentHires;
+            uint64_t sent[chip8::FRAME_WORDS];
+            std::vector<uint8_t> out;
+            size_t outPos;
+            std::vector<uint8_t> in;
+        };
+
+        void accept();
+        bool receive(client& c);
+        bool flush(client& c);
+        void update(client& c);
+
+        std::string socketPath;
+        int listener;
+        std::vector<session> sessions;
+        std::vector<client> clients;
+        std::vector<uint8_t> encoded;
+
+};
+#endif
@@ -0,0 +1,92 @@
+#include "chip8.h"
+#include "scheduler.h"
+#include <chrono>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+libFuzzer entry point over the hardened core (built with CHIP8_HARDENED).
+An input is:
+
+    byte 0          quirk profile, modulo the number of profiles
+    byte 1          frames to run, F
+    2 * F bytes     held keys per frame, a little-endian bitmask
+    the rest        the ROM
+
+Every execution reuses one machine. reload() only rewrites the memory the
+previous input wrote or loaded, so the cost of an execution is mostly the
+instructions it runs.
+*/
+
+static const unsigned FUZZ_IPF = 16;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    static chip8 machine;
+    if (size < 2) {
+        return 0;
+    }
+    quirk_profile quirks = (quirk_profile)(data[0] % QUIRK_PROFILES);
+    size_t frames = data[1];
+    size_t header = 2 + 2 * frames;
+    if (size < header) {
+        return 0;
+    }
+    const uint8_t* keys = data + 2;
+    if (quirks != machine.quirks()) {
+        machine.setQuirks(quirks);
+    }
+    if (!machine.reload(data + header, size - header)) {
+        return 0;
+    }
+
+    frame_scheduler scheduler(FUZZ_IPF, true);
+    for (size_t f = 0; f < frames; f++) {
+        uint16_t held = keys[2 * f] | keys[2 * f + 1] << 8;
+        for (int k = 0; k < 16; k++) {
+            machine.key[k] = (held >> k) & 1;
+        }
+        scheduler.runFrame(machine);
+    }
+    return 0;
+}
+
+#ifdef CHIP8_FUZZ_MAIN
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+// Plain driver for builds without libFuzzer: runs each file, repeatedly with --runs N
+int main(int argc, char** argv)
+{
+    unsigned long runs = 1;
+    std::vector<std::vector<uint8_t> > inputs;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = strtoul(argv[++i], NULL, 10);
+            continue;
+        }
+        std::ifstream in(argv[i], std::ios::in | std::ios::binary);
+        if (!in.is_open()) {
+            std::cout << "Couldn't open " << argv[i] << "\n";
+            return 1;
+        }
+        inputs.push_back(std::vector<uint8_t>((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>()));
+    }
+    if (inputs.empty()) {
+        std::cout << "Usage ./chip8-fuzz-replay [--runs N] input..." << std::endl;
+        return 1;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned long r = 0; r < runs; r++) {
+        for (size_t i = 0; i < inputs.size(); i++) {
+            LLVMFuzzerTestOneInput(inputs[i].data(), inputs[i].size());
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << runs * inputs.size() << " executions, " << (unsigned long)(runs * inputs.size() / seconds) << " per second" << std::endl;
+    return 0;
+}
+#endif
@@ -0,0 +1,176 @@
+#include "input_log.h"
+#include "rom_cache.h"
+#include <string.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+static const uint8_t LOG_MAGIC[4] = { 'C', '8', 'I', 'N' };
+static const uint32_t LOG_VERSION = 2;
+static const size_t HEADER_SIZE = 32;
+
+// Event byte: key number in the low nibble, 0x10 when pressed
+static const uint8_t KEY_DOWN = 0x10;
+static const uint8_t END_OF_LOG = 0xFF;
+
+static void putLE(uint8_t* p, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        p[i] = (v >> (8 * i)) & 0xFF;
+    }
+}
+
+static uint64_t getLE(const uint8_t* p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++) {
+        v |= (uint64_t)p[i] << (8 * i);
+    }
+    return v;
+}
+
+bool hashRomFile(const char* file, uint64_t& hash)
+{
+    mapped_file rom;
+    if (!rom.open(file)) {
+        return false;
+    }
+    hash = hashRom(rom.data(), rom.size());
+    return true;
+}
+
+input_recorder::input_recorder() : out(NULL), lastCycle(0)
+{
+    memset(last, 0, sizeof(last));
+}
+
+input_recorder::~input_recorder()
+{
+    if (out) {
+        fclose(out);
+    }
+}
+
+bool input_recorder::open(const char* file, const input_log_header& header)
+{
+    out = fopen(file, "wb");
+    if (!out) {
+        std::cout << "Couldn't open " << file << " for writing" << "\n";
+        return false;
+    }
+
+    uint8_t bytes[HEADER_SIZE];
+    memcpy(bytes, LOG_MAGIC, 4);
+    putLE(bytes + 4, LOG_VERSION, 4);
+    putLE(bytes + 8, header.romHash, 8);
+    putLE(bytes + 16, header.seed, 8);
+    putLE(bytes + 24, header.ipf, 4);
+    putLE(bytes + 28, header.quirks, 4);
+    fwrite(bytes, 1, sizeof(bytes), out);
+
+    lastCycle = 0;
+    memset(last, 0, sizeof(last));
+    return true;
+}
+
+void input_recorder::event(uint64_t cycle, uint8_t code)
+{
+    // Cycle delta as a LEB128 varint, most events are a byte or two apart
+    uint64_t delta = cycle - lastCycle;
+    do {
+        uint8_t b = delta & 0x7F;
+        delta >>= 7;
+        fputc(delta ? (b | 0x80) : b, out);
+    } while (delta);
+    fputc(code, out);
+    lastCycle = cycle;
+}
+
+void input_recorder::record(uint64_t cycle, const uint8_t* key)
+{
+    if (!out) {
+        return;
+    }
+    for (int i = 0; i < 16; i++) {
+        uint8_t down = key[i] != 0;
+        if (down != last[i]) {
+            event(cycle, i | (down ? KEY_DOWN : 0));
+            last[i] = down;
+        }
+    }
+}
+
+void input_recorder::finish(uint64_t cycle)
+{
+    if (!out) {
+        return;
+    }
+    event(cycle, END_OF_LOG);
+    fclose(out);
+    out = NULL;
+}
+
+bool input_player::load(const char* file)
+{
+    std::ifstream in(file, std::ios::in | std::ios::binary);
+    if (!in.is_open()) {
+        std::cout << "Couldn't open " << file << "\n";
+        return false;
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    if (data.size() < HEADER_SIZE || memcmp(data.data(), LOG_MAGIC, 4) != 0) {
+        std::cout << file << " isn't an input log" << "\n";
+        return false;
+    }
+    uint32_t version = getLE(&data[4], 4);
+    if (version != LOG_VERSION) {
+        std::cout << "Input log version " << version << " isn't supported" << "\n";
+        return false;
+    }
+    head.romHash = getLE(&data[8], 8);
+    head.seed = getLE(&data[16], 8);
+    head.ipf = getLE(&data[24], 4);
+    head.quirks = getLE(&data[28], 4);
+    if (head.ipf == 0) {
+        std::cout << file << " has no instructions per frame" << "\n";
+        return false;
+    }
+
+    events.clear();
+    next = 0;
+    uint64_t cycle = 0;
+    size_t i = HEADER_SIZE;
+    while (i < data.size()) {
+        uint64_t delta = 0;
+        int shift = 0;
+        while (i < data.size() && (data[i] & 0x80) && shift < 63) {
+            delta |= (uint64_t)(data[i++] & 0x7F) << shift;
+            shift += 7;
+        }
+        if (i + 1 >= data.size()) {
+            break;
+        }
+        delta |= (uint64_t)data[i++] << shift;
+        cycle += delta;
+
+        uint8_t code = data[i++];
+        if (code == END_OF_LOG) {
+            end = cycle;
+            return true;
+        }
+        event e = { cycle, (uint8_t)(code & 0x0F), (uint8_t)((code & KEY_DOWN) != 0) };
+        events.push_back(e);
+    }
+
+    std::cout << file << " is truncated" << "\n";
+    return false;
+}
+
+void input_player::apply(uint64_t cycle, uint8_t* key)
+{
+    while (next < events.size() && events[next].cycle <= cycle) {
+        key[events[next].key] = events[next].down;
+        next++;
+    }
+}
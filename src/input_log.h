@@ -0,0 +1,86 @@
+#ifndef INPUT_LOG
+#define INPUT_LOG
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+/*
+Recorded play sessions. A log starts with a header naming the ROM (by hash),
+the Cxkk seed, the instructions per frame and the quirk profile the session
+ran with, followed by one event per key press or release: the cycles since
+the previous event as a LEB128 varint, then one byte holding the key number
+and its new state. A final event marks the cycle the session ended on. Replaying the log against
+the same ROM reproduces the session exactly, at any speed.
+*/
+
+struct input_log_header
+{
+    uint64_t romHash;
+    uint64_t seed;
+    uint32_t ipf;
+    // quirk_profile the ROM ran under
+    uint32_t quirks;
+};
+
+// FNV-1a of a ROM file, ties a log to the ROM it was recorded with
+bool hashRomFile(const char* file, uint64_t& hash);
+
+class input_recorder
+{
+
+    public:
+        input_recorder();
+        ~input_recorder();
+
+        bool open(const char* file, const input_log_header& header);
+
+        // Log every key that differs from the previous call, as of cycle
+        void record(uint64_t cycle, const uint8_t* key);
+
+        // Write the end marker and close the file
+        void finish(uint64_t cycle);
+
+        bool isOpen() const { return out != NULL; }
+
+    private:
+        input_recorder(const input_recorder&);
+        input_recorder& operator=(const input_recorder&);
+
+        void event(uint64_t cycle, uint8_t code);
+
+        FILE* out;
+        uint64_t lastCycle;
+        uint8_t last[16];
+
+};
+
+class input_player
+{
+
+    public:
+        bool load(const char* file);
+
+        const input_log_header& header() const { return head; }
+
+        // Cycle the recorded session ended on
+        uint64_t endCycle() const { return end; }
+
+        // Apply every event recorded at or before cycle to key
+        void apply(uint64_t cycle, uint8_t* key);
+
+    private:
+        struct event
+        {
+            uint64_t cycle;
+            uint8_t key;
+            uint8_t down;
+        };
+
+        input_log_header head;
+        std::vector<event> events;
+        size_t next = 0;
+        uint64_t end = 0;
+
+};
+#endif
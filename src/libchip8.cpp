@@ -0,0 +1,220 @@
+#include "libchip8.h"
+#include "chip8.h"
+#include "rom_cache.h"
+#include "step_server.h"
+#include <new>
+
+static_assert(CHIP8_EXIT_HALTED == (int)chip8::RUN_HALTED, "chip8_exit must match chip8::run_exit");
+static_assert(sizeof(chip8_step_layout) == sizeof(step_layout), "chip8_step_layout must match step_layout");
+
+struct chip8_instance
+{
+    chip8 machine;
+    chip8_error_callback callback;
+    void* user;
+};
+
+struct chip8_steps
+{
+    chip8_steps(size_t instances, unsigned threads, unsigned ipf) : server(instances, threads, ipf) {}
+
+    // Before server, whose instances point into it
+    rom_cache roms;
+    step_server server;
+};
+
+// Installed on every instance, so the core never falls back to printing
+static void forwardError(void* context, chip8::error kind, uint16_t pc, uint16_t opcode)
+{
+    chip8_instance* c = (chip8_instance*)context;
+    if (c->callback) {
+        c->callback(c->user, (chip8_error)kind, pc, opcode);
+    }
+}
+
+int chip8_api_version(void)
+{
+    return CHIP8_API_VERSION;
+}
+
+chip8_instance* chip8_create(void)
+{
+    chip8_instance* c = new (std::nothrow) chip8_instance;
+    if (!c) {
+        return NULL;
+    }
+    c->callback = NULL;
+    c->user = NULL;
+    c->machine.setErrorHandler(forwardError, c);
+    c->machine.initialize();
+    return c;
+}
+
+void chip8_destroy(chip8_instance* c)
+{
+    delete c;
+}
+
+void chip8_set_error_callback(chip8_instance* c, chip8_error_callback callback, void* user)
+{
+    c->callback = callback;
+    c->user = user;
+}
+
+int chip8_set_quirks(chip8_instance* c, chip8_quirks quirks)
+{
+    if ((unsigned)quirks >= QUIRK_PROFILES) {
+        return -1;
+    }
+    c->machine.setQuirks((quirk_profile)quirks);
+    return 0;
+}
+
+void chip8_seed(chip8_instance* c, uint64_t seed)
+{
+    c->machine.seedRandom(seed);
+}
+
+int chip8_load_rom(chip8_instance* c, const uint8_t* data, size_t size)
+{
+    return c->machine.reload(data, size) ? 0 : -1;
+}
+
+void chip8_set_keys(chip8_instance* c, uint16_t keys)
+{
+    for (int k = 0; k < 16; k++) {
+        c->machine.key[k] = (keys >> k) & 1;
+    }
+}
+
+void chip8_step(chip8_instance* c, uint32_t instructions)
+{
+    // Same idle skipping as frame_scheduler::runFrame()
+    uint32_t i = 0;
+    while (i < instructions) {
+        i += c->machine.skipIdle(instructions - i);
+        if (i < instructions) {
+            c->machine.runCycle();
+            i++;
+        }
+    }
+}
+
+void chip8_tick_timers(chip8_instance* c)
+{
+    c->machine.tickTimers();
+}
+
+void chip8_run_frame(chip8_instance* c, uint32_t instructions)
+{
+    chip8_step(c, instructions);
+    c->machine.tickTimers();
+}
+
+chip8_exit chip8_run(chip8_instance* c, uint64_t max_cycles, uint64_t* cycles)
+{
+    return (chip8_exit)c->machine.run(max_cycles, cycles);
+}
+
+chip8_exit chip8_run_until_frame(chip8_instance* c, uint32_t instructions)
+{
+    return (chip8_exit)c->machine.runUntilFrame(instructions);
+}
+
+void chip8_set_breakpoint(chip8_instance* c, uint16_t addr, int enabled)
+{
+    c->machine.setBreakpoint(addr, enabled != 0);
+}
+
+int chip8_width(const chip8_instance* c)
+{
+    return c->machine.width();
+}
+
+int chip8_height(const chip8_instance* c)
+{
+    return c->machine.height();
+}
+
+size_t chip8_read_framebuffer(const chip8_instance* c, uint8_t* pixels, size_t size)
+{
+    size_t w = c->machine.width();
+    size_t h = c->machine.height();
+    if (size < w * h) {
+        return w * h;
+    }
+    for (size_t y = 0; y < h; y++) {
+        for (size_t x = 0; x < w; x++) {
+            pixels[y * w + x] = c->machine.graphics[y][x >> 6] >> (63 - (x & 63)) & 1;
+        }
+    }
+    return w * h;
+}
+
+int chip8_sound_on(const chip8_instance* c)
+{
+    return c->machine.soundOn() ? 1 : 0;
+}
+
+chip8_steps* chip8_steps_create(size_t instances, unsigned threads, uint32_t instructions_per_frame)
+{
+    // The server allocates its instances itself, which mustn't throw into C
+    try {
+        return new chip8_steps(instances, threads, instructions_per_frame);
+    } catch (const std::exception&) {
+        return NULL;
+    }
+}
+
+void chip8_steps_destroy(chip8_steps* s)
+{
+    delete s;
+}
+
+int chip8_steps_load_rom(chip8_steps* s, size_t instance, const uint8_t* data, size_t size, chip8_quirks quirks, uint64_t seed)
+{
+    if (instance >= s->server.size() || (unsigned)quirks >= QUIRK_PROFILES || size > 4096 - 0x200) {
+        return -1;
+    }
+    const rom_image* image;
+    try {
+        image = s->roms.insert(data, size);
+    } catch (const std::exception&) {
+        return -1;
+    }
+    if (!image) {
+        return -1;
+    }
+    s->server.load(instance, *image, (quirk_profile)quirks, seed);
+    return 0;
+}
+
+int chip8_steps_restart(chip8_steps* s, size_t instance, uint64_t seed)
+{
+    return s->server.restart(instance, seed) ? 0 : -1;
+}
+
+int chip8_steps_set_reward_addresses(chip8_steps* s, const uint16_t* addresses, size_t count)
+{
+    return s->server.setRewardAddresses(addresses, count) ? 0 : -1;
+}
+
+void chip8_steps_layout(const chip8_steps* s, chip8_step_layout* layout)
+{
+    step_layout l = s->server.bufferLayout();
+    layout->actions = l.actions;
+    layout->frames = l.frames;
+    layout->memory = l.memory;
+    layout->status = l.status;
+    layout->size = l.size;
+}
+
+int chip8_steps_attach(chip8_steps* s, void* buffer, size_t size)
+{
+    return s->server.attach(buffer, size) ? 0 : -1;
+}
+
+int chip8_steps_step(chip8_steps* s)
+{
+    return s->server.step() ? 0 : -1;
+}
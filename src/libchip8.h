@@ -0,0 +1,164 @@
+#ifndef LIBCHIP8
+#define LIBCHIP8
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+C API over the emulator core, built as libchip8.a and libchip8.so by
+make lib. Every call takes the instance it works on, the library keeps no
+state of its own, so separate instances can run on separate threads. One
+instance must not be used by two threads at once.
+
+Nothing is printed: unknown opcodes and ROMs that don't fit are reported
+through the callback given to chip8_set_error_callback(), and dropped if
+there isn't one.
+
+Functions are only ever added, existing ones keep their signatures and
+meaning, CHIP8_API_VERSION goes up with each addition.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32)
+#define CHIP8_API __declspec(dllexport)
+#else
+#define CHIP8_API __attribute__((visibility("default")))
+#endif
+
+#define CHIP8_API_VERSION 3
+
+typedef struct chip8_instance chip8_instance;
+
+typedef enum {
+    CHIP8_QUIRKS_VIP = 0,
+    CHIP8_QUIRKS_SCHIP = 1,
+    CHIP8_QUIRKS_XOCHIP = 2
+} chip8_quirks;
+
+typedef enum {
+    CHIP8_ERROR_UNKNOWN_OPCODE = 1,
+    CHIP8_ERROR_ROM_TOO_LARGE = 2
+} chip8_error;
+
+// Why chip8_run() or chip8_run_until_frame() returned, see chip8::run_exit
+typedef enum {
+    CHIP8_EXIT_FRAME = 0,
+    CHIP8_EXIT_KEY_WAIT = 1,
+    CHIP8_EXIT_BUDGET = 2,
+    CHIP8_EXIT_INVALID_OPCODE = 3,
+    CHIP8_EXIT_BREAKPOINT = 4,
+    CHIP8_EXIT_HALTED = 5
+} chip8_exit;
+
+/*
+Called from whichever thread is driving the instance. An unknown opcode
+doesn't retire, so until the ROM's own timers or keys move it on, every
+further step reports it again.
+*/
+typedef void (*chip8_error_callback)(void* user, chip8_error error, uint16_t pc, uint16_t opcode);
+
+// CHIP8_API_VERSION the library was built with
+CHIP8_API int chip8_api_version(void);
+
+// A powered-on machine with no ROM and VIP quirks, NULL if out of memory
+CHIP8_API chip8_instance* chip8_create(void);
+
+CHIP8_API void chip8_destroy(chip8_instance* c);
+
+CHIP8_API void chip8_set_error_callback(chip8_instance* c, chip8_error_callback callback, void* user);
+
+// Variant behaviour for the next chip8_load_rom(), -1 for an unknown profile
+CHIP8_API int chip8_set_quirks(chip8_instance* c, chip8_quirks quirks);
+
+// Seed for Cxkk, the same seed and inputs always replay the same way
+CHIP8_API void chip8_seed(chip8_instance* c, uint64_t seed);
+
+// Copy size bytes of ROM to 0x200 and reset the machine, -1 if it doesn't fit
+CHIP8_API int chip8_load_rom(chip8_instance* c, const uint8_t* data, size_t size);
+
+// Held keys, bit n for key n, kept until the next call
+CHIP8_API void chip8_set_keys(chip8_instance* c, uint16_t keys);
+
+// Execute instructions without touching the timers
+CHIP8_API void chip8_step(chip8_instance* c, uint32_t instructions);
+
+// Decrement the delay and sound timers, once per 60 Hz frame
+CHIP8_API void chip8_tick_timers(chip8_instance* c);
+
+// One 60 Hz frame: instructions, then the timers
+CHIP8_API void chip8_run_frame(chip8_instance* c, uint32_t instructions);
+
+/*
+Up to max_cycles instructions, stopping early on Fx0A without a key, an
+unknown opcode, 00FD or a breakpoint. cycles, if not NULL, receives how many
+ran. Since version 2.
+*/
+CHIP8_API chip8_exit chip8_run(chip8_instance* c, uint64_t max_cycles, uint64_t* cycles);
+
+// Finish the current frame of instructions and tick the timers, or stop early as chip8_run() does. Since version 2.
+CHIP8_API chip8_exit chip8_run_until_frame(chip8_instance* c, uint32_t instructions);
+
+// Stop chip8_run() before the instruction at addr, or no longer. Since version 2.
+CHIP8_API void chip8_set_breakpoint(chip8_instance* c, uint16_t addr, int enabled);
+
+// Display size, 64x32 or 128x64 once a SCHIP ROM switches to high resolution
+CHIP8_API int chip8_width(const chip8_instance* c);
+CHIP8_API int chip8_height(const chip8_instance* c);
+
+/*
+Copy the display as width * height bytes, row by row, 1 for a lit pixel.
+Returns the bytes the display needs, nothing is copied if size is smaller.
+*/
+CHIP8_API size_t chip8_read_framebuffer(const chip8_instance* c, uint8_t* pixels, size_t size);
+
+// Non-zero while the buzzer should sound
+CHIP8_API int chip8_sound_on(const chip8_instance* c);
+
+/*
+Batched stepping for reinforcement learning, see step_server.h. A
+chip8_steps owns its instances and a pool of worker threads; each
+chip8_steps_step() reads every instance's keys from the attached buffer,
+runs one frame of each and writes displays, reward bytes and status back
+into it. The buffer is the caller's, e.g. shared memory or a NumPy array,
+and chip8_steps_layout() says where its arrays are. Since version 3.
+*/
+typedef struct chip8_steps chip8_steps;
+
+// Byte offsets into the buffer, and its size
+typedef struct {
+    size_t actions;     // uint16_t per instance, bit n holds key n during the next step
+    size_t frames;      // 128 uint64_t per instance, 64 rows of two words, bit 63 of word 0 leftmost
+    size_t memory;      // one byte per instance and reward address
+    size_t status;      // one byte per instance: chip8_exit in bits 0-5, bit 6 sound on, bit 7 high resolution
+    size_t size;
+} chip8_step_layout;
+
+// instances powered-on machines without a ROM, threads 0 for one per core; NULL if out of memory
+CHIP8_API chip8_steps* chip8_steps_create(size_t instances, unsigned threads, uint32_t instructions_per_frame);
+
+CHIP8_API void chip8_steps_destroy(chip8_steps* s);
+
+// Boot one instance from a copy of the ROM, identical ROMs are kept once. -1 for an instance
+// out of range, a ROM that doesn't fit, an unknown quirks or no memory for the copy
+CHIP8_API int chip8_steps_load_rom(chip8_steps* s, size_t instance, const uint8_t* data, size_t size, chip8_quirks quirks, uint64_t seed);
+
+// Start one instance over from its ROM with a new seed, e.g. at the end of an episode. -1 for an instance out of range
+CHIP8_API int chip8_steps_restart(chip8_steps* s, size_t instance, uint64_t seed);
+
+// Memory copied out after every step, at most 256 addresses, -1 if there are more. Detaches the buffer
+CHIP8_API int chip8_steps_set_reward_addresses(chip8_steps* s, const uint16_t* addresses, size_t count);
+
+CHIP8_API void chip8_steps_layout(const chip8_steps* s, chip8_step_layout* layout);
+
+// Use buffer for the following steps, -1 unless it's 64-byte aligned and layout.size bytes long
+CHIP8_API int chip8_steps_attach(chip8_steps* s, void* buffer, size_t size);
+
+// One frame for every instance, -1 if no buffer is attached
+CHIP8_API int chip8_steps_step(chip8_steps* s);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -1,5 +1,17 @@
+#include "beeper.h"
 #include "chip8.h"
+#include "input_log.h"
+#include "rewind.h"
+#include "scheduler.h"
+#include "triple_buffer.h"
+#include <atomic>
+#include <functional>
 #include <iostream>
+#include <string>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <thread>
 #include "SDL2/SDL.h"
 
 chip8 mychip8; 
@@ -7,12 +19,100 @@ chip8 mychip8;
 const int WINDOW_WIDTH  = 640; 
 const int WINDOW_HEIGHT = 320;
 
-int sx = WINDOW_WIDTH / 64;
-int sy = WINDOW_HEIGHT / 32; 
+// Ten seconds of frames between profile exports
+const unsigned PROFILE_INTERVAL = 600; 
+
+// ARGB colours of lit and unlit pixels
+const uint32_t PIXEL_ON  = 0xFF00009F; 
+const uint32_t PIXEL_OFF = 0xFF000000; 
 
 SDL_Window *window = NULL; 
 SDL_Renderer *renderer = NULL; 
 SDL_Texture *texture = NULL; 
+SDL_Texture *hiresTexture = NULL; 
+SDL_AudioDeviceID audioDevice = 0; 
+
+// Samples flow from the emulation thread to the audio callback
+beeper buzzer; 
+
+void audioCallback(void* userdata, Uint8* stream, int len)
+{
+    ((beeper*)userdata)->fill((int16_t*)stream, len / sizeof(int16_t)); 
+}
+
+// The 8 ARGB pixels for every possible sprite byte, so a row expands 32 bytes at a time
+uint32_t pixelLut[256][8]; 
+
+void initPixelLut()
+{
+    for (int b = 0; b < 256; b++) {
+        for (int i = 0; i < 8; i++) {
+            pixelLut[b][i] = (b & (0x80 >> i)) ? PIXEL_ON : PIXEL_OFF; 
+        }
+    }
+}
+
+// Expand one 64-pixel display row into ARGB texels
+void expandRow(uint64_t row, uint32_t* out)
+{
+    for (int i = 0; i < 8; i++) {
+        memcpy(out + i * 8, pixelLut[(row >> (56 - i * 8)) & 0xFF], sizeof(pixelLut[0])); 
+    }
+}
+
+// A finished frame as the emulation thread hands it to the display
+struct frame_image
+{
+    uint64_t rows[chip8::FRAME_WORDS];
+    bool hires;
+};
+
+triple_buffer<frame_image> frames; 
+
+// What the display last uploaded, so only rows that differ from it are re-uploaded
+frame_image shown; 
+bool shownValid = false; 
+
+// Upload the rows that changed into the streaming texture of the frame's resolution and present it scaled to the window
+void renderFrame(const frame_image* frame)
+{
+    SDL_Texture* target = shown.hires ? hiresTexture : texture; 
+    if (frame) {
+        int width = frame->hires ? chip8::HIRES_PIXEL_W : chip8::PIXEL_W; 
+        int height = frame->hires ? chip8::HIRES_PIXEL_H : chip8::PIXEL_H; 
+        int words = width / 64; 
+        bool all = !shownValid || frame->hires != shown.hires; 
+
+        // Frames the display skipped may have changed any row, so compare against what is on screen
+        int first = 0; 
+        while (first < height && !all && !memcmp(frame->rows + first * words, shown.rows + first * words, words * sizeof(uint64_t))) {
+            first++; 
+        }
+        int last = height - 1; 
+        while (last > first && !all && !memcmp(frame->rows + last * words, shown.rows + last * words, words * sizeof(uint64_t))) {
+            last--; 
+        }
+
+        target = frame->hires ? hiresTexture : texture; 
+        SDL_Rect rows = { 0, first, width, last - first + 1 };
+        void* pixels; 
+        int pitch; 
+        if (first < height && SDL_LockTexture(target, &rows, &pixels, &pitch) == 0) {
+            for (int y = first; y <= last; y++) {
+                uint32_t* out = (uint32_t*)((uint8_t*)pixels + (y - first) * pitch); 
+                for (int w = 0; w < words; w++) {
+                    expandRow(frame->rows[y * words + w], out + w * 64); 
+                }
+            }
+            SDL_UnlockTexture(target);
+        }
+        shown = *frame; 
+        shownValid = true; 
+    }
+
+    SDL_RenderCopy(renderer, target, NULL, NULL);
+    SDL_RenderPresent(renderer);
+}
 
 bool initWindow() 
 {
@@ -21,8 +121,9 @@ bool initWindow()
         return false; 
     }; 
     
-    if (!SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1")) {
-			printf("Warning: Linear texture filtering not enabled!");
+    // Nearest-neighbour scaling keeps the 64x32 and 128x64 textures' pixels sharp
+    if (!SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0")) {
+			printf("Warning: Nearest texture filtering not enabled!");
 	}
 
     window = SDL_CreateWindow("emulator", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, WINDOW_WIDTH, WINDOW_HEIGHT, SDL_WINDOW_SHOWN); 
@@ -31,7 +132,7 @@ bool initWindow()
         return false; 
     }
 
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED); 
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC); 
     if (renderer == NULL) {
         printf("Error creating renderer. SDL Error: %s\n", SDL_GetError()); 
         return false; 
@@ -39,207 +140,279 @@ bool initWindow()
 
     SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0xFF);
 
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 64, 32);
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, chip8::PIXEL_W, chip8::PIXEL_H);
+    hiresTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, chip8::HIRES_PIXEL_W, chip8::HIRES_PIXEL_H);
+    if (texture == NULL || hiresTexture == NULL) {
+        printf("Error creating texture. SDL Error: %s\n", SDL_GetError()); 
+        return false; 
+    }
+    initPixelLut(); 
+
+    // A small device buffer keeps latency down, the ring in between absorbs frame timing
+    SDL_AudioSpec want; 
+    memset(&want, 0, sizeof(want)); 
+    want.freq = beeper::SAMPLE_RATE; 
+    want.format = AUDIO_S16SYS; 
+    want.channels = 1; 
+    want.samples = beeper::DEVICE_SAMPLES; 
+    want.callback = audioCallback; 
+    want.userdata = &buzzer; 
+    audioDevice = SDL_OpenAudioDevice(NULL, 0, &want, NULL, 0); 
+    if (audioDevice == 0) {
+        printf("Warning: no audio device, running silent. SDL Error: %s\n", SDL_GetError()); 
+    } else {
+        SDL_PauseAudioDevice(audioDevice, 0); 
+    }
 
     return true;
 }
 
 void close() {
+    if (audioDevice) {
+        SDL_CloseAudioDevice(audioDevice);
+        audioDevice = 0;
+    }
+    SDL_DestroyTexture(texture);
+    SDL_DestroyTexture(hiresTexture);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
+    texture = NULL;
+    hiresTexture = NULL;
     renderer = NULL;
     window = NULL;
     
     SDL_Quit();
 }
 
+// Host keys for CHIP-8 keys 0-F, the 1234/QWER/ASDF/ZXCV block
+const SDL_Keycode KEYMAP[16] = {
+    SDLK_x, SDLK_1, SDLK_2, SDLK_3, SDLK_q, SDLK_w, SDLK_e, SDLK_a,
+    SDLK_s, SDLK_d, SDLK_z, SDLK_c, SDLK_4, SDLK_r, SDLK_f, SDLK_v
+};
+
+// CHIP-8 key for a host key, -1 if it isn't one
+int chip8Key(SDL_Keycode sym)
+{
+    for (int k = 0; k < 16; k++) {
+        if (KEYMAP[k] == sym) {
+            return k; 
+        }
+    }
+    return -1; 
+}
+
+/*
+State shared between the SDL thread and the emulation thread. The SDL thread
+only writes the atomics, everything else belongs to the emulation thread
+until it has been joined.
+*/
+struct emulation
+{
+    enum state_request { NONE, SAVE_STATE, LOAD_STATE };
+
+    // Held CHIP-8 keys, bit k for key k
+    std::atomic<uint16_t> keys; 
+    std::atomic<bool> rewinding; 
+    std::atomic<int> request; 
+    std::atomic<bool> quit; 
+
+    unsigned ipf; 
+    bool turbo; 
+    std::string stateFile; 
+    input_recorder recorder; 
+    uint64_t cycle; 
+
+    emulation() : keys(0), rewinding(false), request(NONE), quit(false), ipf(frame_scheduler::DEFAULT_IPF), turbo(false), cycle(0) {}
+};
+
+// The emulation thread: one iteration per 60 Hz frame, publishing every frame that drew something
+void emulate(emulation& session)
+{
+    frame_scheduler scheduler(session.ipf, session.turbo); 
+
+    // Every frame is recorded so holding backspace can step back through them
+    rewind_buffer history; 
+
+    while (!session.quit) {
+        // A recording has to be one unbroken timeline, so rewinding and loading are off
+        bool recording = session.recorder.isOpen(); 
+        switch (session.request.exchange(emulation::NONE)) {
+            case emulation::SAVE_STATE:
+                mychip8.saveStateFile(session.stateFile.c_str());
+            break;
+
+            case emulation::LOAD_STATE:
+                if (!recording && mychip8.loadStateFile(session.stateFile.c_str())) {
+                    history.clear();
+                }
+            break;
+        }
+
+        bool rewinding = session.rewinding && !recording; 
+        if (rewinding && history.pop(mychip8)) {
+            mychip8.drawFlag = true; 
+        }
+
+        // Restored frames carry the keys held back then, the live ones win
+        uint16_t held = session.keys.load(std::memory_order_relaxed); 
+        for (int k = 0; k < 16; k++) {
+            mychip8.key[k] = (held >> k) & 1; 
+        }
+
+        if (!rewinding) {
+            session.recorder.record(session.cycle, mychip8.key); 
+            scheduler.runFrame(mychip8); 
+            session.cycle += scheduler.instructionsPerFrame(); 
+            if (!recording) {
+                history.push(mychip8); 
+            }
+        }
+
+        // Only frames where DXYN/CLS changed a row are published, the display keeps showing the last one
+        if (mychip8.drawFlag) {
+            if (mychip8.takeDirtyRows()) {
+                frame_image& frame = frames.writeBuffer(); 
+                mychip8.copyFrame(frame.rows); 
+                frame.hires = mychip8.hires(); 
+                frames.publish(); 
+            }
+            mychip8.drawFlag = false;
+        }
+
+        buzzer.frame(mychip8.soundOn()); 
+
+        scheduler.waitForNextFrame(); 
+    }
+}
+
 int main(int argc, char** argv)
 {
     if (argc < 2) {
-        std::cout << "Usage ./play name_of_ROM" << std::endl; 
+        std::cout << "Usage ./play name_of_ROM [--ipf N] [--turbo] [--seed N] [--quirks vip|schip|xochip] [--record file] [--profile file]" << std::endl; 
         return 1; 
     }
 
+    unsigned ipf = frame_scheduler::DEFAULT_IPF; 
+    bool turbo = false; 
+    uint64_t seed = time(NULL); 
+    const char* recordFile = NULL; 
+    const char* profileFile = NULL; 
+    quirk_profile quirks = QUIRKS_VIP; 
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc) {
+            ipf = strtoul(argv[++i], NULL, 10); 
+        } else if (strcmp(argv[i], "--turbo") == 0) {
+            turbo = true; 
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 10); 
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recordFile = argv[++i]; 
+        } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            if (!parseQuirks(argv[++i], quirks)) {
+                std::cout << "Unknown quirk profile " << argv[i] << ", use vip, schip or xochip" << std::endl; 
+                return 1; 
+            }
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profileFile = argv[++i]; 
+        }
+    }
+
     if (!initWindow())
     {
         std::cout << "Failed to initialize window" << std::endl; 
         return 1; 
     } else {
         bool quit = false; 
+        mychip8.seedRandom(seed); 
+        mychip8.setQuirks(quirks); 
         mychip8.loadGame(argv[1]); 
+
+        // Counters are written every PROFILE_INTERVAL frames and once more on exit
+        if (profileFile) {
+#ifdef CHIP8_PROFILE
+            mychip8.profile.setOutput(profileFile, PROFILE_INTERVAL); 
+#else
+            std::cout << "--profile needs a build with PROFILE=1, ignoring it" << std::endl; 
+            profileFile = NULL; 
+#endif
+        }
         
-        SDL_Event e; 
+        // Keys, rewind and save/load requests go to the emulation thread, frames come back
+        emulation session; 
+        session.ipf = ipf; 
+        session.turbo = turbo; 
+        session.stateFile = std::string(argv[1]) + ".state"; 
+        if (recordFile) {
+            input_log_header header = { 0, seed, ipf, (uint32_t)quirks }; 
+            if (!hashRomFile(argv[1], header.romHash) || !session.recorder.open(recordFile, header)) {
+                close(); 
+                return 1; 
+            }
+        }
+        std::thread emulator(emulate, std::ref(session)); 
 
+        // Without vsync the display loop paces itself at 60 Hz instead of spinning
+        SDL_RendererInfo info; 
+        bool vsync = SDL_GetRendererInfo(renderer, &info) == 0 && (info.flags & SDL_RENDERER_PRESENTVSYNC); 
+        frame_scheduler display(0); 
+
+        // One iteration per display refresh: input, then the newest finished frame if there is one
+        SDL_Event e; 
         while(!quit) {
             while( SDL_PollEvent( &e ) != 0 ) {
                 if( e.type == SDL_QUIT ) {
                     quit = true;
                 }
                 else if (e.type == SDL_KEYDOWN &&e.key.repeat == 0 ){
+                    int k = chip8Key(e.key.keysym.sym); 
+                    if (k >= 0) {
+                        session.keys.fetch_or(1 << k); 
+                    }
                     switch(e.key.keysym.sym){
-                        case SDLK_1:
-                            mychip8.key[0x1] = 1;
-                        break;
-                
-                        case SDLK_2:
-                            mychip8.key[0x2] = 1;
-                        break;
-            
-                        case SDLK_3:
-                            mychip8.key[0x3] = 1;
-                        break;
-            
-                        case SDLK_4:
-                            mychip8.key[0xC] = 1;
-                        break;
-            
-                        case SDLK_q:
-                            mychip8.key[0x4] = 1;
-                        break;
-            
-                        case SDLK_w:
-                            mychip8.key[0x5] = 1;
-                        break;
-            
-                        case SDLK_e:
-                            mychip8.key[0x6] = 1;
-                        break;
-            
-                        case SDLK_r:
-                            mychip8.key[0xD] = 1;
-                        break;
-            
-                        case SDLK_a:
-                            mychip8.key[0x7] = 1;
-                        break;
-            
-                        case SDLK_s:
-                            mychip8.key[0x8] = 1;
-                        break;
-            
-                        case SDLK_d:
-                            mychip8.key[0x9] = 1;
-                        break;
-            
-                        case SDLK_f:
-                            mychip8.key[0xE] = 1;
-                        break;
-            
-                        case SDLK_z:
-                            mychip8.key[0xA] = 1;
-                        break;
-                
-                        case SDLK_x:
-                            mychip8.key[0x0] = 1;
+                        case SDLK_ESCAPE:
+                            quit = true;
                         break;
-            
-                        case SDLK_c:
-                            mychip8.key[0xB] = 1;
+
+                        case SDLK_BACKSPACE:
+                            session.rewinding = true;
                         break;
-            
-                        case SDLK_v:
-                            mychip8.key[0xF] = 1;
+
+                        case SDLK_F5:
+                            session.request = emulation::SAVE_STATE;
                         break;
-                    
-                        case SDLK_ESCAPE:
-                            exit(0);
+
+                        case SDLK_F9:
+                            session.request = emulation::LOAD_STATE;
                         break;
                     }
                 }
                 else if(e.type == SDL_KEYUP && e.key.repeat == 0) {
-                    switch(e.key.keysym.sym){
-                        case SDLK_1:
-                            mychip8.key[0x1] = 0;
-                        break;
-            
-                        case SDLK_2:
-                            mychip8.key[0x2] = 0;
-                        break;
-            
-                        case SDLK_3:
-                            mychip8.key[0x3] = 0;
-                        break;
-            
-                        case SDLK_4:
-                            mychip8.key[0xC] = 0;
-                        break;
-            
-                        case SDLK_q:
-                            mychip8.key[0x4] = 0;
-                        break;
-            
-                        case SDLK_w:
-                            mychip8.key[0x5] = 0;
-                        break;
-            
-                        case SDLK_e:
-                            mychip8.key[0x6] = 0;
-                        break;
-            
-                        case SDLK_r:
-                            mychip8.key[0xD] = 0;
-                        break;
-            
-                        case SDLK_a:
-                            mychip8.key[0x7] = 0;
-                        break;
-            
-                        case SDLK_s:
-                            mychip8.key[0x8] = 0;
-                        break;
-            
-                        case SDLK_d:
-                            mychip8.key[0x9] = 0;
-                        break;
-            
-                        case SDLK_f:
-                            mychip8.key[0xE] = 0;
-                        break;
-            
-                        case SDLK_z:
-                            mychip8.key[0xA] = 0;
-                        break;
-            
-                        case SDLK_x:
-                            mychip8.key[0x0] = 0;
-                        break;
-            
-                        case SDLK_c:
-                            mychip8.key[0xB] = 0;
-                        break;
-            
-                        case SDLK_v:
-                            mychip8.key[0xF] = 0;
-                        break;     
+                    int k = chip8Key(e.key.keysym.sym); 
+                    if (k >= 0) {
+                        session.keys.fetch_and(~(1 << k)); 
+                    }
+                    if (e.key.keysym.sym == SDLK_BACKSPACE) {
+                        session.rewinding = false;
                     }
                 } 
             }
 
-            mychip8.runCycle(); 
-
-            if(mychip8.drawFlag) {
-                SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0xFF);
-                SDL_RenderClear(renderer);
-                SDL_SetRenderDrawColor(renderer, 0x00,0x00,0x9F,0xFF);
-                int rownum = 0;
-                SDL_Rect pixel;
-                for(int y = 0; y < 32; ++y){
-                    for(int x = 0; x< 64; ++x) {
-                        
-                        pixel.x = x*sx;
-                        pixel.y = y*sy;
-                        pixel.w = 10;
-                        pixel.h = 10;
-                        rownum = y*64;
-                        if(mychip8.graphics[x + rownum] == 1){
-                            SDL_RenderFillRect(renderer,&pixel);  
-                        } 
-                    }
-                }
-                SDL_RenderPresent(renderer);
-                mychip8.drawFlag = false;
+            renderFrame(frames.update() ? &frames.readBuffer() : NULL); 
+            if (!vsync) {
+                display.waitForNextFrame(); 
             }
         }
+
+        session.quit = true; 
+        emulator.join(); 
+
+        // The end marker tells a replay how long the session ran
+        session.recorder.finish(session.cycle); 
+#ifdef CHIP8_PROFILE
+        if (profileFile) {
+            mychip8.writeProfile(profileFile); 
+        }
+#endif
     }
 
     close(); 
@@ -0,0 +1,134 @@
+#include "profile.h"
+#include <string.h>
+#include <iostream>
+
+chip8_profile::chip8_profile() : interval(0)
+{
+    reset();
+}
+
+void chip8_profile::reset()
+{
+    memset(handlerCount, 0, sizeof(handlerCount));
+    memset(pcCount, 0, sizeof(pcCount));
+    draws = 0;
+    spriteRows = 0;
+    frames = 0;
+    memset(&peak, 0, sizeof(peak));
+    memset(&current, 0, sizeof(current));
+    history.clear();
+    historyStart = 0;
+    frameStart = std::chrono::steady_clock::now();
+}
+
+bool chip8_profile::endFrame()
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    current.frame = frames++;
+    current.micros = std::chrono::duration_cast<std::chrono::microseconds>(now - frameStart).count();
+    frameStart = now;
+
+    if (current.instructions > peak.instructions) peak.instructions = current.instructions;
+    if (current.draws > peak.draws) peak.draws = current.draws;
+    if (current.spriteRows > peak.spriteRows) peak.spriteRows = current.spriteRows;
+    if (current.micros > peak.micros) peak.micros = current.micros;
+
+    if (history.size() < FRAME_HISTORY) {
+        history.push_back(current);
+    } else {
+        history[historyStart] = current;
+        historyStart = (historyStart + 1) % FRAME_HISTORY;
+    }
+    memset(&current, 0, sizeof(current));
+
+    return interval && !output.empty() && frames % interval == 0;
+}
+
+void chip8_profile::setOutput(const char* file, unsigned interval)
+{
+    output = file ? file : "";
+    this->interval = interval;
+}
+
+bool chip8_profile::write(const char* file, const char* const* names, int count) const
+{
+    FILE* out = fopen(file, "w");
+    if (!out) {
+        std::cout << "Couldn't open " << file << " for writing" << "\n";
+        return false;
+    }
+    size_t length = strlen(file);
+    bool csv = length >= 4 && strcmp(file + length - 4, ".csv") == 0;
+    bool written = csv ? writeCsv(out, names, count) : writeJson(out, names, count);
+    return fclose(out) == 0 && written;
+}
+
+bool chip8_profile::writeJson(FILE* out, const char* const* names, int count) const
+{
+    uint64_t instructions = 0;
+    for (int h = 0; h < count; h++) {
+        instructions += handlerCount[h];
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"instructions\": %llu,\n", (unsigned long long)instructions);
+    fprintf(out, "  \"frames\": %llu,\n", (unsigned long long)frames);
+    fprintf(out, "  \"draws\": %llu,\n", (unsigned long long)draws);
+    fprintf(out, "  \"sprite_rows\": %llu,\n", (unsigned long long)spriteRows);
+    fprintf(out, "  \"peak_frame\": {\"instructions\": %u, \"draws\": %u, \"sprite_rows\": %u, \"micros\": %u},\n",
+            peak.instructions, peak.draws, peak.spriteRows, peak.micros);
+
+    // Handlers and addresses that never ran are left out
+    fprintf(out, "  \"opcodes\": {");
+    const char* separator = "";
+    for (int h = 0; h < count; h++) {
+        if (handlerCount[h]) {
+            fprintf(out, "%s\n    \"%s\": %llu", separator, names[h], (unsigned long long)handlerCount[h]);
+            separator = ",";
+        }
+    }
+    fprintf(out, "\n  },\n");
+
+    fprintf(out, "  \"pc\": {");
+    separator = "";
+    for (int pc = 0; pc < 4096; pc++) {
+        if (pcCount[pc]) {
+            fprintf(out, "%s\n    \"0x%03X\": %llu", separator, pc, (unsigned long long)pcCount[pc]);
+            separator = ",";
+        }
+    }
+    fprintf(out, "\n  },\n");
+
+    fprintf(out, "  \"recent_frames\": [");
+    separator = "";
+    for (size_t i = 0; i < history.size(); i++) {
+        const frame_stats& f = history[(historyStart + i) % history.size()];
+        fprintf(out, "%s\n    {\"frame\": %llu, \"instructions\": %u, \"draws\": %u, \"sprite_rows\": %u, \"micros\": %u}",
+                separator, (unsigned long long)f.frame, f.instructions, f.draws, f.spriteRows, f.micros);
+        separator = ",";
+    }
+    fprintf(out, "\n  ]\n}\n");
+    return !ferror(out);
+}
+
+bool chip8_profile::writeCsv(FILE* out, const char* const* names, int count) const
+{
+    // One table for everything, kind says which columns apply
+    fprintf(out, "kind,key,count,draws,sprite_rows,micros\n");
+    for (int h = 0; h < count; h++) {
+        if (handlerCount[h]) {
+            fprintf(out, "opcode,%s,%llu,,,\n", names[h], (unsigned long long)handlerCount[h]);
+        }
+    }
+    for (int pc = 0; pc < 4096; pc++) {
+        if (pcCount[pc]) {
+            fprintf(out, "pc,0x%03X,%llu,,,\n", pc, (unsigned long long)pcCount[pc]);
+        }
+    }
+    for (size_t i = 0; i < history.size(); i++) {
+        const frame_stats& f = history[(historyStart + i) % history.size()];
+        fprintf(out, "frame,%llu,%u,%u,%u,%u\n", (unsigned long long)f.frame, f.instructions, f.draws,
+                f.spriteRows, f.micros);
+    }
+    return !ferror(out);
+}
@@ -0,0 +1,90 @@
+#ifndef PROFILE
+#define PROFILE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+/*
+Hot path counters, compiled in only when CHIP8_PROFILE is defined (make
+PROFILE=1). Every chip8 instance then carries one of these and counts each
+instruction by handler and by address, every DXYN and the sprite rows it
+drew, and per 60 Hz frame the instructions run and the wall-clock time
+between tickTimers() calls. Without CHIP8_PROFILE none of this is built and
+the hot path is unchanged.
+*/
+class chip8_profile
+{
+
+    public:
+        // Recent frames kept for the per-frame series, totals cover every frame
+        static const size_t FRAME_HISTORY = 3600;
+
+        // Larger than the number of chip8 handlers
+        static const int HANDLERS = 64;
+
+        struct frame_stats
+        {
+            uint64_t frame;
+            uint32_t instructions;
+            uint32_t draws;
+            uint32_t spriteRows;
+            uint32_t micros;
+        };
+
+        chip8_profile();
+
+        void reset();
+
+        // Called for every instruction executed
+        void instruction(uint16_t pc, uint8_t handler)
+        {
+            handlerCount[handler]++;
+            pcCount[pc & 0xFFF]++;
+            current.instructions++;
+        }
+
+        // Called for every DXYN with the rows it drew after clipping
+        void draw(unsigned rows)
+        {
+            current.draws++;
+            current.spriteRows += rows;
+            draws++;
+            spriteRows += rows;
+        }
+
+        // Close the current frame, true when a periodic export is due
+        bool endFrame();
+
+        // Export every interval frames from endFrame(), 0 only writes on request
+        void setOutput(const char* file, unsigned interval);
+        const char* outputFile() const { return output.empty() ? NULL : output.c_str(); }
+
+        // JSON, or CSV if file ends in .csv; names[h] is handler h's mnemonic
+        bool write(const char* file, const char* const* names, int count) const;
+
+    private:
+        bool writeJson(FILE* out, const char* const* names, int count) const;
+        bool writeCsv(FILE* out, const char* const* names, int count) const;
+
+        uint64_t handlerCount[HANDLERS];
+        uint64_t pcCount[4096];
+        uint64_t draws;
+        uint64_t spriteRows;
+
+        // Frames ended so far, the largest value of each stat, and the most
+        // recent FRAME_HISTORY frames as a ring starting at historyStart
+        uint64_t frames;
+        frame_stats peak;
+        std::vector<frame_stats> history;
+        size_t historyStart;
+        frame_stats current;
+        std::chrono::steady_clock::time_point frameStart;
+
+        std::string output;
+        unsigned interval;
+
+};
+#endif
@@ -0,0 +1,94 @@
+#ifndef QUIRKS
+#define QUIRKS
+#include <string.h>
+
+/*
+CHIP-8 variants disagree on a handful of instructions. Each profile fixes
+those choices as compile-time constants: the interpreter's handlers are
+instantiated once per profile, and a ROM's profile is picked when it is
+loaded (chip8::setQuirks), so executing an instruction never tests a flag.
+*/
+enum quirk_profile
+{
+    QUIRKS_VIP, QUIRKS_SCHIP, QUIRKS_XOCHIP, QUIRK_PROFILES
+};
+
+// COSMAC VIP, the original interpreter
+struct quirks_vip
+{
+    // 8xy6/8xyE shift Vy into Vx, rather than shifting Vx in place
+    static const bool SHIFT_VY = true;
+    // Fx55/Fx65 leave I just past the last register they touched
+    static const bool LOAD_STORE_INCREMENTS_I = true;
+    // Bnnn jumps to nnn + Vx with x the top nibble of nnn (BxNN), rather than nnn + V0
+    static const bool JUMP_VX = false;
+    // DXYN wraps sprites around the screen edges, rather than clipping them
+    static const bool WRAP_SPRITES = false;
+    // DXY0 draws a 16x16 sprite, rather than nothing
+    static const bool LARGE_SPRITES = false;
+};
+
+// SUPER-CHIP 1.1 on the HP48
+struct quirks_schip
+{
+    static const bool SHIFT_VY = false;
+    static const bool LOAD_STORE_INCREMENTS_I = false;
+    static const bool JUMP_VX = true;
+    static const bool WRAP_SPRITES = false;
+    static const bool LARGE_SPRITES = true;
+};
+
+// XO-CHIP, as Octo runs it
+struct quirks_xochip
+{
+    static const bool SHIFT_VY = true;
+    static const bool LOAD_STORE_INCREMENTS_I = true;
+    static const bool JUMP_VX = false;
+    static const bool WRAP_SPRITES = true;
+    static const bool LARGE_SPRITES = true;
+};
+
+// The same choices for code that reads them while generating code, not per instruction
+struct quirk_flags
+{
+    bool shiftVy;
+    bool loadStoreIncrementsI;
+    bool jumpVx;
+    bool wrapSprites;
+    bool largeSprites;
+
+    template <class Q>
+    static quirk_flags of()
+    {
+        quirk_flags f = { Q::SHIFT_VY, Q::LOAD_STORE_INCREMENTS_I, Q::JUMP_VX, Q::WRAP_SPRITES, Q::LARGE_SPRITES };
+        return f;
+    }
+
+    static quirk_flags of(quirk_profile profile)
+    {
+        switch (profile){
+            case QUIRKS_SCHIP: return of<quirks_schip>();
+            case QUIRKS_XOCHIP: return of<quirks_xochip>();
+            default: return of<quirks_vip>();
+        }
+    }
+};
+
+inline const char* quirkName(quirk_profile profile)
+{
+    static const char* const names[QUIRK_PROFILES] = { "vip", "schip", "xochip" };
+    return profile < QUIRK_PROFILES ? names[profile] : "unknown";
+}
+
+// Profile named name ("vip", "schip" or "xochip"), false if there is none
+inline bool parseQuirks(const char* name, quirk_profile& profile)
+{
+    for (int p = 0; p < QUIRK_PROFILES; p++) {
+        if (strcmp(name, quirkName((quirk_profile)p)) == 0) {
+            profile = (quirk_profile)p;
+            return true;
+        }
+    }
+    return false;
+}
+#endif
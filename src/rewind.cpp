@@ -0,0 +1,206 @@
+#include "rewind.h"
+#include "chip8.h"
+#include <string.h>
+
+// A run header is a 16-bit skip and a 16-bit length, so shorter gaps are cheaper to copy
+static const size_t RUN_HEADER = 4;
+
+rewind_buffer::rewind_buffer(size_t capacity, unsigned keyframeInterval)
+    : keyframeInterval(keyframeInterval ? keyframeInterval : 1)
+{
+    // Room for at least two keyframes, and offsets have to fit in 32 bits
+    if (capacity < 2 * chip8::STATE_SIZE) {
+        capacity = 2 * chip8::STATE_SIZE;
+    }
+    if (capacity > 0xFFFFFFFFu) {
+        capacity = 0xFFFFFFFFu;
+    }
+    ring.resize(capacity);
+    state.resize(chip8::STATE_SIZE);
+    delta.resize(chip8::STATE_SIZE / 2);
+    clear();
+}
+
+void rewind_buffer::clear()
+{
+    records.clear();
+    head = 0;
+    used = 0;
+    baseOffset = 0;
+    haveBase = false;
+    sinceKeyframe = 0;
+}
+
+size_t rewind_buffer::encodeDelta(const uint8_t* current)
+{
+    const uint8_t* key = &ring[baseOffset];
+    size_t size = 0;
+    size_t last = 0;
+    size_t i = 0;
+    while (i < chip8::STATE_SIZE) {
+        if (current[i] == key[i]) {
+            i++;
+            continue;
+        }
+
+        // Extend the run over gaps too short to be worth a new header
+        size_t start = i;
+        size_t end = i + 1;
+        while (end < chip8::STATE_SIZE) {
+            if (current[end] != key[end]) {
+                end++;
+                continue;
+            }
+            size_t gap = end;
+            while (gap < chip8::STATE_SIZE && gap - end < RUN_HEADER && current[gap] == key[gap]) {
+                gap++;
+            }
+            if (gap - end < RUN_HEADER && gap < chip8::STATE_SIZE) {
+                end = gap;
+            } else {
+                break;
+            }
+        }
+
+        size_t length = end - start;
+        if (size + RUN_HEADER + length > delta.size()) {
+            return 0;
+        }
+        uint16_t skip = start - last;
+        delta[size++] = skip & 0xFF;
+        delta[size++] = skip >> 8;
+        delta[size++] = length & 0xFF;
+        delta[size++] = length >> 8;
+        memcpy(&delta[size], current + start, length);
+        size += length;
+        last = end;
+        i = end;
+    }
+
+    // Identical frames still need a record, an empty run marks them
+    if (size == 0) {
+        memset(&delta[0], 0, RUN_HEADER);
+        size = RUN_HEADER;
+    }
+    return size;
+}
+
+// Rebuilds a frame from its keyframe copied into out
+static void applyDelta(uint8_t* out, const uint8_t* runs, size_t size)
+{
+    size_t pos = 0;
+    size_t i = 0;
+    while (i + RUN_HEADER <= size) {
+        size_t skip = runs[i] | runs[i + 1] << 8;
+        size_t length = runs[i + 2] | runs[i + 3] << 8;
+        i += RUN_HEADER;
+        pos += skip;
+        memcpy(out + pos, runs + i, length);
+        pos += length;
+        i += length;
+    }
+}
+
+void rewind_buffer::evictOldest()
+{
+    // A keyframe takes the deltas stored against it along
+    do {
+        const record& r = records.front();
+        if (r.keyframe && r.offset == baseOffset) {
+            haveBase = false;
+        }
+        used -= r.size;
+        records.pop_front();
+    } while (!records.empty() && !records.front().keyframe);
+}
+
+uint32_t rewind_buffer::reserve(uint32_t size)
+{
+    uint32_t offset = head;
+    if (offset + size > ring.size()) {
+        // Doesn't fit before the end: the frames still in the tail are the oldest, drop them and wrap
+        while (!records.empty() && records.front().offset >= head) {
+            evictOldest();
+        }
+        offset = 0;
+    }
+    while (!records.empty()) {
+        const record& r = records.front();
+        if (r.offset + r.size <= offset || r.offset >= offset + size) {
+            break;
+        }
+        evictOldest();
+    }
+    return offset;
+}
+
+void rewind_buffer::append(uint32_t offset, const uint8_t* data, uint32_t size, bool keyframe)
+{
+    memcpy(&ring[offset], data, size);
+    record r = { offset, size, keyframe ? offset : baseOffset, keyframe };
+    records.push_back(r);
+    head = offset + size;
+    used += size;
+}
+
+void rewind_buffer::push(const chip8& machine)
+{
+    machine.saveState(state.data());
+
+    if (haveBase && sinceKeyframe + 1 < keyframeInterval) {
+        size_t size = encodeDelta(state.data());
+        if (size) {
+            uint32_t offset = reserve(size);
+            // Making room can drop the keyframe the delta refers to, store a keyframe then
+            if (haveBase) {
+                append(offset, delta.data(), size, false);
+                sinceKeyframe++;
+                return;
+            }
+        }
+    }
+
+    uint32_t offset = reserve(chip8::STATE_SIZE);
+    append(offset, state.data(), chip8::STATE_SIZE, true);
+    baseOffset = offset;
+    haveBase = true;
+    sinceKeyframe = 0;
+}
+
+bool rewind_buffer::pop(chip8& machine)
+{
+    if (records.empty()) {
+        return false;
+    }
+
+    record r = records.back();
+    const uint8_t* image = &ring[r.offset];
+    if (!r.keyframe) {
+        memcpy(state.data(), &ring[r.keyOffset], chip8::STATE_SIZE);
+        applyDelta(state.data(), image, r.size);
+        image = state.data();
+    }
+    bool loaded = machine.loadState(image, chip8::STATE_SIZE);
+
+    records.pop_back();
+    used -= r.size;
+    head = r.offset;
+
+    if (!r.keyframe) {
+        sinceKeyframe--;
+        return loaded;
+    }
+
+    // The previous keyframe, if it's still around, becomes the base again
+    haveBase = false;
+    sinceKeyframe = 0;
+    for (size_t i = records.size(); i-- > 0; ) {
+        if (records[i].keyframe) {
+            baseOffset = records[i].offset;
+            haveBase = true;
+            break;
+        }
+        sinceKeyframe++;
+    }
+    return loaded;
+}
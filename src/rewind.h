@@ -0,0 +1,81 @@
+#ifndef REWIND
+#define REWIND
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+class chip8;
+
+/*
+Rewind history of save states, one per frame, held in a fixed-size byte ring.
+Every DEFAULT_KEYFRAME_INTERVAL frames a full image is stored; the frames in
+between only store the byte runs that differ from that keyframe, which is
+mostly a few registers and display rows since memory rarely changes. When the
+ring is full the oldest keyframe and its deltas are dropped, so memory use
+never exceeds the capacity given to the constructor.
+*/
+class rewind_buffer
+{
+
+    public:
+        // 4 MB holds several minutes of a typical game at 60 frames per second
+        static const size_t DEFAULT_CAPACITY = 4 << 20;
+        static const unsigned DEFAULT_KEYFRAME_INTERVAL = 60;
+
+        explicit rewind_buffer(size_t capacity = DEFAULT_CAPACITY,
+                               unsigned keyframeInterval = DEFAULT_KEYFRAME_INTERVAL);
+
+        // Record the machine's current state as the newest frame
+        void push(const chip8& machine);
+
+        // Restore the newest frame into machine and forget it, false if empty
+        bool pop(chip8& machine);
+
+        void clear();
+
+        // Frames that can still be rewound
+        size_t frames() const { return records.size(); }
+
+        // Bytes of the ring taken up by those frames
+        size_t bytesUsed() const { return used; }
+
+        size_t capacity() const { return ring.size(); }
+
+    private:
+        struct record
+        {
+            uint32_t offset;
+            uint32_t size;
+            // Keyframe the delta applies to, equal to offset for keyframes
+            uint32_t keyOffset;
+            bool keyframe;
+        };
+
+        // Encodes state as runs differing from the newest keyframe, 0 if it isn't worth it
+        size_t encodeDelta(const uint8_t* state);
+
+        // Offset where size bytes can be written, evicting the oldest frames
+        uint32_t reserve(uint32_t size);
+
+        void evictOldest();
+
+        void append(uint32_t offset, const uint8_t* data, uint32_t size, bool keyframe);
+
+        std::vector<uint8_t> ring;
+        std::deque<record> records;
+        uint32_t head;
+        size_t used;
+        unsigned keyframeInterval;
+
+        // Newest keyframe in the ring and the number of deltas stored against it
+        uint32_t baseOffset;
+        bool haveBase;
+        unsigned sinceKeyframe;
+
+        // Per-frame working buffers, kept to avoid allocating every frame
+        std::vector<uint8_t> state;
+        std::vector<uint8_t> delta;
+
+};
+#endif
@@ -0,0 +1,128 @@
+#include "rom_cache.h"
+#include "chip8.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+
+mapped_file::mapped_file() : base(NULL), length(0)
+{
+}
+
+mapped_file::~mapped_file()
+{
+    if (base) {
+        munmap(base, length);
+    }
+}
+
+bool mapped_file::open(const char* file)
+{
+    int fd = ::open(file, O_RDONLY);
+    if (fd < 0) {
+        std::cout << "Couldn't open " << file << "\n";
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        std::cout << file << " isn't a regular file" << "\n";
+        close(fd);
+        return false;
+    }
+
+    // The mapping stays valid after the descriptor is closed, mmap can't map 0 bytes
+    length = info.st_size;
+    if (length) {
+        base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED) {
+            base = NULL;
+            length = 0;
+            std::cout << "Couldn't map " << file << "\n";
+            close(fd);
+            return false;
+        }
+    }
+    close(fd);
+    return true;
+}
+
+uint64_t hashRom(const uint8_t* data, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+const rom_image* rom_cache::load(const char* file)
+{
+    mapped_file rom;
+    if (!rom.open(file)) {
+        return NULL;
+    }
+    if (rom.size() == 0) {
+        std::cout << file << " is empty" << "\n";
+        return NULL;
+    }
+    return insert(rom.data(), rom.size());
+}
+
+const rom_image* rom_cache::insert(const uint8_t* data, size_t size)
+{
+    std::unique_ptr<rom_image> image(new rom_image());
+    if (!chip8::bootImage(image->memory, data, size)) {
+        return NULL;
+    }
+    image->hash = hashRom(data, size);
+    image->size = size;
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    // Same hash and same bytes is the same ROM
+    auto range = images.equal_range(image->hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second->size == size && memcmp(it->second->memory, image->memory, sizeof(image->memory)) == 0) {
+            return it->second.get();
+        }
+    }
+    const rom_image* added = image.get();
+    images.emplace(added->hash, std::move(image));
+    return added;
+}
+
+bool rom_cache::loadDirectory(const char* dir, std::vector<std::pair<std::string, const rom_image*> >& roms)
+{
+    DIR* d = opendir(dir);
+    if (!d) {
+        std::cout << "Couldn't open ROM directory " << dir << "\n";
+        return false;
+    }
+
+    std::vector<std::string> names;
+    while (dirent* entry = readdir(d)) {
+        if (entry->d_name[0] != '.') {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+
+    for (size_t i = 0; i < names.size(); i++) {
+        std::string path = std::string(dir) + "/" + names[i];
+        roms.push_back(std::make_pair(path, load(path.c_str())));
+    }
+    return true;
+}
+
+size_t rom_cache::size()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return images.size();
+}
@@ -0,0 +1,80 @@
+#ifndef ROM_CACHE
+#define ROM_CACHE
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+ROM images keyed by content. A ROM file is mapped read-only, checked to fit
+the program area and hashed; the first time its contents are seen the cache
+builds the machine's whole boot memory (fonts and program) once. Every
+instance started from that image afterwards, and every restart, is a single
+4 KB copy with no file access. Identical ROMs under different names share one
+image. Loading is safe from several threads at once.
+*/
+
+struct rom_image
+{
+    // FNV-1a of the ROM file, the same value hashRomFile() gives
+    uint64_t hash;
+
+    // Program bytes, loaded at 0x200
+    size_t size;
+
+    // Memory as chip8::loadBuffer() leaves it
+    uint8_t memory[4096];
+};
+
+// Read-only mapping of a whole file, unmapped on destruction
+class mapped_file
+{
+
+    public:
+        mapped_file();
+        ~mapped_file();
+
+        bool open(const char* file);
+
+        // NULL for an empty file
+        const uint8_t* data() const { return (const uint8_t*)base; }
+        size_t size() const { return length; }
+
+    private:
+        mapped_file(const mapped_file&);
+        mapped_file& operator=(const mapped_file&);
+
+        void* base;
+        size_t length;
+
+};
+
+uint64_t hashRom(const uint8_t* data, size_t size);
+
+class rom_cache
+{
+
+    public:
+        // Image for a ROM file, NULL if it can't be read or doesn't fit in memory
+        const rom_image* load(const char* file);
+
+        // Image for a ROM that is already in memory
+        const rom_image* insert(const uint8_t* data, size_t size);
+
+        // Load every file in dir in name order, appending path and image
+        // (NULL for ROMs that failed) to roms. False if dir can't be listed
+        bool loadDirectory(const char* dir, std::vector<std::pair<std::string, const rom_image*> >& roms);
+
+        // Distinct ROM images held
+        size_t size();
+
+    private:
+        std::mutex lock;
+        std::unordered_multimap<uint64_t, std::unique_ptr<rom_image> > images;
+
+};
+#endif
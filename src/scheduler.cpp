@@ -0,0 +1,55 @@
+#include "scheduler.h"
+#include "chip8.h"
+#include <thread>
+
+// Frame period, 1/60 s
+static const std::chrono::steady_clock::duration FRAME =
+    std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(1000000000 / frame_scheduler::FRAME_RATE));
+
+// How far behind we let the schedule fall before giving up on catching up
+static const int MAX_LAG_FRAMES = 5;
+
+frame_scheduler::frame_scheduler(unsigned instructionsPerFrame, bool turbo)
+    : ipf(instructionsPerFrame), turbo(turbo)
+{
+    deadline = std::chrono::steady_clock::now() + FRAME;
+}
+
+void frame_scheduler::runFrame(chip8& machine)
+{
+    // Whole iterations of an idle loop are skipped, they would change nothing
+    unsigned i = 0;
+    while (i < ipf) {
+        i += machine.skipIdle(ipf - i);
+        if (i < ipf) {
+            machine.runCycle();
+            i++;
+        }
+    }
+    machine.tickTimers();
+}
+
+void frame_scheduler::waitForNextFrame()
+{
+    if (turbo) {
+        return;
+    }
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (now > deadline + MAX_LAG_FRAMES * FRAME) {
+        // The host stalled (suspend, debugger), resync rather than fast-forwarding
+        deadline = now;
+    } else if (now < deadline) {
+        std::this_thread::sleep_until(deadline);
+    }
+    deadline += FRAME;
+}
+
+std::chrono::steady_clock::duration frame_scheduler::untilNextFrame() const
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (turbo || now >= deadline) {
+        return std::chrono::steady_clock::duration::zero();
+    }
+    return deadline - now;
+}
@@ -0,0 +1,42 @@
+#ifndef SCHEDULER
+#define SCHEDULER
+#include <chrono>
+
+class chip8;
+
+/*
+Paces emulation in 60 Hz frames. Every frame runs a fixed number of
+instructions and ticks the delay and sound timers once, so game speed no
+longer depends on how fast the host is. Between frames the caller sleeps
+until the next deadline instead of spinning; turbo mode skips the sleep
+for headless runs.
+*/
+class frame_scheduler
+{
+
+    public:
+        static const unsigned FRAME_RATE = 60;
+        static const unsigned DEFAULT_IPF = 10;
+
+        explicit frame_scheduler(unsigned instructionsPerFrame = DEFAULT_IPF, bool turbo = false);
+
+        // Run one frame's worth of instructions, then tick the timers
+        void runFrame(chip8& machine);
+
+        // Sleep until the next frame is due, returns straight away in turbo mode
+        void waitForNextFrame();
+
+        // Time left until the next frame is due, zero once it is, for callers that wait on something else meanwhile
+        std::chrono::steady_clock::duration untilNextFrame() const;
+
+        unsigned instructionsPerFrame() const { return ipf; }
+
+        bool isTurbo() const { return turbo; }
+
+    private:
+        unsigned ipf;
+        bool turbo;
+        std::chrono::steady_clock::time_point deadline;
+
+};
+#endif
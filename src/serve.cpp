@@ -0,0 +1,108 @@
+#include "chip8.h"
+#include "frame_server.h"
+#include "rom_cache.h"
+#include "scheduler.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+/*
+Runs ROMs at normal speed, one session each, and serves them to dashboards
+over a Unix domain socket (see frame_server.h for the protocol). No SDL is
+linked into this binary.
+*/
+
+static std::atomic<bool> stopping(false);
+
+static void stop(int)
+{
+    stopping.store(true);
+}
+
+static void usage()
+{
+    std::cout << "Usage ./chip8-serve [--socket path] [--ipf N] [--seed N] [--quirks vip|schip|xochip] ROM..." << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    const char* socketPath = "/tmp/chip8.sock";
+    unsigned ipf = frame_scheduler::DEFAULT_IPF;
+    uint64_t seed = 0;
+    quirk_profile quirks = QUIRKS_VIP;
+    std::vector<const char*> roms;
+    std::vector<quirk_profile> romQuirks;
+
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--socket") == 0 && hasValue) {
+            socketPath = argv[++i];
+        } else if (strcmp(argv[i], "--ipf") == 0 && hasValue) {
+            ipf = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--seed") == 0 && hasValue) {
+            seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--quirks") == 0 && hasValue) {
+            if (!parseQuirks(argv[++i], quirks)) {
+                usage();
+                return 1;
+            }
+        } else if (argv[i][0] == '-') {
+            usage();
+            return 1;
+        } else {
+            roms.push_back(argv[i]);
+            romQuirks.push_back(quirks);
+        }
+    }
+    // Session numbers are a byte on the wire
+    if (roms.empty() || roms.size() > 255 || ipf == 0) {
+        usage();
+        return 1;
+    }
+
+    rom_cache cache;
+    std::vector<chip8*> machines;
+    frame_server server;
+    for (size_t i = 0; i < roms.size(); i++) {
+        const rom_image* image = cache.load(roms[i]);
+        if (!image) {
+            return 1;
+        }
+        chip8* machine = new chip8();
+        machine->seedRandom(seed);
+        machine->setQuirks(romQuirks[i]);
+        machine->restart(*image);
+        machines.push_back(machine);
+        server.addSession(roms[i], machine);
+    }
+    if (!server.listen(socketPath)) {
+        return 1;
+    }
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    signal(SIGPIPE, SIG_IGN);
+    std::cout << "Serving " << roms.size() << " sessions on " << socketPath << std::endl;
+
+    // Between frames the server waits on the sockets rather than sleeping
+    frame_scheduler scheduler(ipf);
+    while (!stopping.load()) {
+        for (size_t i = 0; i < machines.size(); i++) {
+            scheduler.runFrame(*machines[i]);
+        }
+        server.frameDone();
+        do {
+            std::chrono::microseconds left = std::chrono::duration_cast<std::chrono::microseconds>(scheduler.untilNextFrame());
+            server.poll((int)((left.count() + 999) / 1000));
+        } while (scheduler.untilNextFrame() > std::chrono::steady_clock::duration::zero() && !stopping.load());
+        scheduler.waitForNextFrame();
+    }
+
+    for (size_t i = 0; i < machines.size(); i++) {
+        delete machines[i];
+    }
+    return 0;
+}
@@ -0,0 +1,69 @@
+#ifndef SPSC_RING
+#define SPSC_RING
+#include <stddef.h>
+#include <atomic>
+
+/*
+Fixed-size FIFO between exactly one producer thread and one consumer thread.
+Each side only stores its own index and loads the other's, so neither ever
+blocks or takes a lock, which makes it safe to read from an audio callback.
+The indices count up forever and are masked on access, so CAPACITY has to be
+a power of two.
+*/
+template <class T, size_t CAPACITY>
+class spsc_ring
+{
+
+    public:
+        spsc_ring() : head(0), tail(0) {}
+
+        // Producer side: append up to count values, returns how many fit
+        size_t write(const T* data, size_t count)
+        {
+            size_t h = head.load(std::memory_order_relaxed);
+            size_t space = CAPACITY - (h - tail.load(std::memory_order_acquire));
+            if (count > space) {
+                count = space;
+            }
+            for (size_t i = 0; i < count; i++) {
+                buffer[(h + i) & MASK] = data[i];
+            }
+            head.store(h + count, std::memory_order_release);
+            return count;
+        }
+
+        // Consumer side: take up to count values, returns how many there were
+        size_t read(T* out, size_t count)
+        {
+            size_t t = tail.load(std::memory_order_relaxed);
+            size_t queued = head.load(std::memory_order_acquire) - t;
+            if (count > queued) {
+                count = queued;
+            }
+            for (size_t i = 0; i < count; i++) {
+                out[i] = buffer[(t + i) & MASK];
+            }
+            tail.store(t + count, std::memory_order_release);
+            return count;
+        }
+
+        // Values queued, exact from either side's point of view at the moment it asks
+        size_t size() const
+        {
+            return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+        }
+
+    private:
+        static_assert(CAPACITY && (CAPACITY & (CAPACITY - 1)) == 0, "spsc_ring capacity must be a power of two");
+        static const size_t MASK = CAPACITY - 1;
+
+        spsc_ring(const spsc_ring&);
+        spsc_ring& operator=(const spsc_ring&);
+
+        // Each index on its own cache line, so the two threads don't keep stealing it
+        alignas(64) std::atomic<size_t> head;
+        alignas(64) std::atomic<size_t> tail;
+        T buffer[CAPACITY];
+
+};
+#endif
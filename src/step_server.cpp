@@ -0,0 +1,178 @@
+#include "step_server.h"
+#include "rom_cache.h"
+#include <string.h>
+
+// status bits next to the run_exit
+static const uint8_t STATUS_SOUND = 0x40;
+static const uint8_t STATUS_HIRES = 0x80;
+
+// An instance's frames entry, chip8::graphics as it is
+static const size_t FRAME_BYTES = chip8::HIRES_PIXEL_H * 2 * sizeof(uint64_t);
+
+static size_t alignLine(size_t offset)
+{
+    return (offset + 63) & ~(size_t)63;
+}
+
+// Unknown opcodes show up in status, printing each one would swamp a training run
+static void ignoreError(void*, chip8::error, uint16_t, uint16_t)
+{
+}
+
+step_server::step_server(size_t instances, unsigned threads, unsigned ipf)
+    : count(instances), ipf(ipf ? ipf : frame_scheduler::DEFAULT_IPF), machines(new chip8[instances]),
+      images(instances, (const rom_image*)NULL), buffer(NULL), generation(0), stopping(false), nextInstance(0), busy(0)
+{
+    regions = bufferLayout();
+    for (size_t i = 0; i < count; i++) {
+        machines[i].setErrorHandler(ignoreError, NULL);
+        machines[i].initialize();
+    }
+
+    unsigned total = threads ? threads : std::thread::hardware_concurrency();
+    for (unsigned w = 1; w < total; w++) {
+        workers.push_back(std::thread(&step_server::work, this));
+    }
+}
+
+step_server::~step_server()
+{
+    {
+        std::lock_guard<std::mutex> hold(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t w = 0; w < workers.size(); w++) {
+        workers[w].join();
+    }
+    delete[] machines;
+}
+
+step_layout step_server::layout(size_t instances, size_t addresses)
+{
+    step_layout l;
+    l.actions = 0;
+    l.frames = alignLine(l.actions + instances * sizeof(uint16_t));
+    l.memory = alignLine(l.frames + instances * FRAME_BYTES);
+    l.status = alignLine(l.memory + instances * addresses);
+    l.size = alignLine(l.status + instances);
+    return l;
+}
+
+void step_server::load(size_t instance, const rom_image& image, quirk_profile profile, uint64_t seed)
+{
+    chip8& m = machines[instance];
+    images[instance] = &image;
+    m.setQuirks(profile);
+    m.seedRandom(seed);
+    m.restart(image);
+}
+
+bool step_server::restart(size_t instance, uint64_t seed)
+{
+    if (instance >= count) {
+        return false;
+    }
+    chip8& m = machines[instance];
+    m.seedRandom(seed);
+    if (images[instance]) {
+        m.restart(*images[instance]);
+    } else {
+        m.initialize();
+    }
+    return true;
+}
+
+bool step_server::setRewardAddresses(const uint16_t* list, size_t n)
+{
+    if (n > MAX_ADDRESSES) {
+        return false;
+    }
+    addresses.assign(list, list + n);
+    regions = bufferLayout();
+    // The old layout no longer fits the buffer
+    buffer = NULL;
+    return true;
+}
+
+bool step_server::attach(void* memory, size_t size)
+{
+    if (!memory || ((uintptr_t)memory & 63) != 0 || size < regions.size) {
+        return false;
+    }
+    buffer = (uint8_t*)memory;
+    return true;
+}
+
+bool step_server::step()
+{
+    if (!buffer) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> hold(lock);
+        nextInstance.store(0, std::memory_order_relaxed);
+        busy.store(workers.size(), std::memory_order_relaxed);
+        generation++;
+    }
+    wake.notify_all();
+    runChunks();
+
+    std::unique_lock<std::mutex> hold(lock);
+    finished.wait(hold, [this] { return busy.load() == 0; });
+    return true;
+}
+
+void step_server::work()
+{
+    uint64_t seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> hold(lock);
+            wake.wait(hold, [this, seen] { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+        }
+        runChunks();
+        if (busy.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> hold(lock);
+            finished.notify_one();
+        }
+    }
+}
+
+void step_server::runChunks()
+{
+    for (;;) {
+        size_t first = nextInstance.fetch_add(CHUNK);
+        if (first >= count) {
+            return;
+        }
+        size_t end = first + CHUNK < count ? first + CHUNK : count;
+        for (size_t i = first; i < end; i++) {
+            runInstance(i);
+        }
+    }
+}
+
+void step_server::runInstance(size_t i)
+{
+    chip8& m = machines[i];
+    uint16_t action;
+    memcpy(&action, buffer + regions.actions + i * sizeof(action), sizeof(action));
+    for (int k = 0; k < 16; k++) {
+        m.key[k] = (action >> k) & 1;
+    }
+
+    chip8::run_exit why = m.runUntilFrame(ipf);
+
+    static_assert(sizeof(m.graphics) == FRAME_BYTES, "frames entries hold chip8::graphics");
+    memcpy(buffer + regions.frames + i * FRAME_BYTES, m.graphics, FRAME_BYTES);
+    uint8_t* reward = buffer + regions.memory + i * addresses.size();
+    for (size_t a = 0; a < addresses.size(); a++) {
+        reward[a] = m.read(addresses[a]);
+    }
+    buffer[regions.status + i] = (uint8_t)why | (m.soundOn() ? STATUS_SOUND : 0) | (m.hires() ? STATUS_HIRES : 0);
+}
@@ -0,0 +1,116 @@
+#ifndef STEP_SERVER
+#define STEP_SERVER
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "chip8.h"
+#include "scheduler.h"
+
+struct rom_image;
+
+/*
+Where each array sits in a step_server's buffer, in bytes from its start.
+Every array starts on a 64-byte boundary:
+
+    uint16_t actions[instances]             keys to hold during the next step, bit k for key k
+    uint64_t frames[instances][64][2]       the display after the step, as chip8::graphics
+    uint8_t  memory[instances][addresses]   the bytes at the reward addresses after the step
+    uint8_t  status[instances]              the step's chip8::run_exit in bits 0-5,
+                                            bit 6 sound on, bit 7 high resolution
+*/
+struct step_layout
+{
+    size_t actions;
+    size_t frames;
+    size_t memory;
+    size_t status;
+    size_t size;
+};
+
+/*
+Steps many chip8 instances a frame at a time, for reinforcement learning.
+Actions go in and observations and rewards come out through one buffer the
+caller provides, typically shared memory the training process maps too.
+step() applies every instance's action to its key array, runs one frame
+(chip8::runUntilFrame()) and has the worker thread that ran the instance
+write its display, reward bytes and status straight into the buffer:
+nothing is copied through the server and nothing is allocated per step.
+
+Workers are started once and take instances CHUNK at a time, so no two of
+them write to the same cache line of the buffer. The calling thread works
+through a share of every step as well.
+*/
+class step_server
+{
+
+    public:
+        // threads 0 means one per core, the caller's thread included
+        explicit step_server(size_t instances, unsigned threads = 0, unsigned ipf = frame_scheduler::DEFAULT_IPF);
+        ~step_server();
+
+        // Reward addresses setRewardAddresses() takes at most
+        static const size_t MAX_ADDRESSES = 256;
+
+        // Instances a worker takes at a time
+        static const size_t CHUNK = 64;
+
+        static step_layout layout(size_t instances, size_t addresses);
+
+        // Boot an instance from image, which must outlive the server (a rom_cache's do)
+        void load(size_t instance, const rom_image& image, quirk_profile profile = QUIRKS_VIP, uint64_t seed = 0);
+
+        // Start an instance over from its image with a new Cxkk seed, e.g. for the next episode.
+        // False for an instance out of range
+        bool restart(size_t instance, uint64_t seed);
+
+        // Memory read into the buffer after every step, false if there are too many.
+        // Changes the layout, attach() again after it
+        bool setRewardAddresses(const uint16_t* addresses, size_t count);
+
+        step_layout bufferLayout() const { return layout(count, addresses.size()); }
+
+        // Use buffer for the following steps: 64-byte aligned and at least bufferLayout().size bytes
+        bool attach(void* buffer, size_t size);
+
+        // One frame for every instance, back once all of them are in the buffer. False if no buffer is attached
+        bool step();
+
+        size_t size() const { return count; }
+        unsigned threads() const { return workers.size() + 1; }
+
+    private:
+        step_server(const step_server&);
+        step_server& operator=(const step_server&);
+
+        // Worker threads, waiting for each step
+        void work();
+
+        // Take chunks of the current step until none are left
+        void runChunks();
+
+        void runInstance(size_t i);
+
+        size_t count;
+        unsigned ipf;
+        chip8* machines;
+        std::vector<const rom_image*> images;
+        std::vector<uint16_t> addresses;
+
+        uint8_t* buffer;
+        step_layout regions;
+
+        std::vector<std::thread> workers;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable finished;
+        uint64_t generation;
+        bool stopping;
+        std::atomic<size_t> nextInstance;
+        std::atomic<unsigned> busy;
+
+};
+#endif
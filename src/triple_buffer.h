@@ -0,0 +1,52 @@
+#ifndef TRIPLE_BUFFER
+#define TRIPLE_BUFFER
+#include <atomic>
+
+/*
+Hands the latest of a stream of values from one producer thread to one
+consumer thread without locks or copies. The producer fills writeBuffer()
+and publish()es it, the consumer calls update() and reads readBuffer(). The third
+buffer sits between them, so neither side ever waits for the other: the
+producer always has a buffer to write, and if it publishes twice before the
+consumer looks, the older value is simply dropped.
+*/
+template <class T>
+class triple_buffer
+{
+
+    public:
+        triple_buffer() : writing(0), shared(1), reading(2) {}
+
+        // Producer side: the buffer being filled, then hand it over
+        T& writeBuffer() { return buffers[writing]; }
+        void publish()
+        {
+            writing = shared.exchange(writing | FRESH, std::memory_order_acq_rel) & INDEX;
+        }
+
+        // Consumer side: swap in the newest published value, false if there is none since the last call
+        bool update()
+        {
+            if (!(shared.load(std::memory_order_relaxed) & FRESH)) {
+                return false;
+            }
+            reading = shared.exchange(reading, std::memory_order_acq_rel) & INDEX;
+            return true;
+        }
+        const T& readBuffer() const { return buffers[reading]; }
+
+    private:
+        triple_buffer(const triple_buffer&);
+        triple_buffer& operator=(const triple_buffer&);
+
+        // The shared index carries a flag saying whether it was published and not yet taken
+        static const int INDEX = 3;
+        static const int FRESH = 4;
+
+        T buffers[3];
+        int writing;
+        std::atomic<int> shared;
+        int reading;
+
+};
+#endif
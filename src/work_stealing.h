@@ -0,0 +1,92 @@
+#ifndef WORK_STEALING
+#define WORK_STEALING
+#include <stddef.h>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+Runs a fixed set of jobs across worker threads.
+Every worker owns a deque seeded round-robin with job indices. It pops from
+the front of its own deque and, once that is empty, steals from the back of
+the other workers' deques, so a few long-running ROMs don't leave the rest of
+the cores idle.
+*/
+class work_stealing_pool
+{
+
+    public:
+        explicit work_stealing_pool(unsigned threads = 0)
+        {
+            workers = threads ? threads : std::thread::hardware_concurrency();
+            if (workers == 0) {
+                workers = 1;
+            }
+        }
+
+        unsigned size() const { return workers; }
+
+        // Calls job(index, worker) once for every index in [0, jobs)
+        void run(size_t jobs, const std::function<void(size_t, unsigned)>& job)
+        {
+            std::vector<queue> queues(workers);
+            for (size_t i = 0; i < jobs; i++) {
+                queues[i % workers].jobs.push_back(i);
+            }
+
+            std::vector<std::thread> threads;
+            for (unsigned w = 1; w < workers; w++) {
+                threads.push_back(std::thread(&work_stealing_pool::work, this, w, std::ref(queues), std::cref(job)));
+            }
+            work(0, queues, job);
+
+            for (size_t i = 0; i < threads.size(); i++) {
+                threads[i].join();
+            }
+        }
+
+    private:
+        struct queue
+        {
+            std::mutex lock;
+            std::deque<size_t> jobs;
+        };
+
+        void work(unsigned self, std::vector<queue>& queues, const std::function<void(size_t, unsigned)>& job)
+        {
+            size_t next;
+            while (take(self, queues, next)) {
+                job(next, self);
+            }
+        }
+
+        bool take(unsigned self, std::vector<queue>& queues, size_t& next)
+        {
+            {
+                std::lock_guard<std::mutex> guard(queues[self].lock);
+                if (!queues[self].jobs.empty()) {
+                    next = queues[self].jobs.front();
+                    queues[self].jobs.pop_front();
+                    return true;
+                }
+            }
+
+            // Own queue is drained, steal from the other end of someone else's
+            for (unsigned i = 1; i < workers; i++) {
+                queue& victim = queues[(self + i) % workers];
+                std::lock_guard<std::mutex> guard(victim.lock);
+                if (!victim.jobs.empty()) {
+                    next = victim.jobs.back();
+                    victim.jobs.pop_back();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        unsigned workers;
+
+};
+#endif